@@ -0,0 +1,214 @@
+#!/usr/bin/env python3
+
+# Measures the overhead of driving the emulator from Python.
+#
+# Every measurement is reported as a number of operations per
+# second, so that the cost of the native emulation can be
+# compared against the cost of crossing the Python/C++ boundary.
+
+import sys
+import time
+import z80
+
+
+# Minimal duration of every measurement, in seconds.
+DURATION = 1.0
+
+
+def measure(name, unit, func):
+    # Run the function in batches until the duration is spent.
+    # The function returns the number of operations it
+    # performed.
+    count = 0
+    start = time.perf_counter()
+    while True:
+        count += func()
+        elapsed = time.perf_counter() - start
+        if elapsed >= DURATION:
+            break
+
+    rate = count / elapsed
+    print(f'{name:<40} {rate:>14,.0f} {unit}/s '
+          f'{1e9 / rate:>10,.1f} ns/{unit}')
+
+
+def make_machine(code=b''):
+    m = z80.Z80Machine()
+    m.set_memory_block(0x0000, code)
+    return m
+
+
+def bench_python_call():
+    # The baseline: cost of an empty Python function call.
+    def f():
+        pass
+
+    def run():
+        for _ in range(10000):
+            f()
+        return 10000
+
+    measure('empty Python call', 'call', run)
+
+
+def bench_run_native():
+    # Long slices; the time is dominated by the native code.
+    m = make_machine()
+
+    def run():
+        ticks = 1000 * 1000
+        m.ticks_to_stop = ticks
+        while not m.run() & m._TICKS_LIMIT_HIT:
+            pass
+        return ticks
+
+    measure('run(), 1M ticks per call', 'tick', run)
+
+
+def bench_run_ticks(ticks):
+    # Short slices; the time is dominated by the call overhead.
+    m = make_machine()
+
+    def run():
+        for _ in range(1000):
+            m.ticks_to_stop = ticks
+            m.run()
+        return 1000
+
+    measure(f'run(), {ticks} ticks per call', 'call', run)
+
+
+def bench_io_callbacks():
+    m = make_machine(
+        b'\xdb\xfe'       # in a, (0xfe)
+        b'\xd3\xfe'       # out (0xfe), a
+        b'\x18\xfa')      # jr 0x0000
+
+    num_ios = 0
+
+    def on_input(port):
+        nonlocal num_ios
+        num_ios += 1
+        return 0xbf
+
+    def on_output(port, value):
+        nonlocal num_ios
+        num_ios += 1
+
+    m.set_input_callback(on_input)
+    m.set_output_callback(on_output)
+
+    def run():
+        nonlocal num_ios
+        num_ios = 0
+        m.ticks_to_stop = 100 * 1000
+        while not m.run() & m._TICKS_LIMIT_HIT:
+            pass
+        return num_ios
+
+    measure('input/output callbacks', 'callback', run)
+
+
+def bench_batched_io():
+    # Same as above, but with inputs served from a port value
+    # table and outputs queued natively.
+    m = make_machine(
+        b'\xdb\xfe'       # in a, (0xfe)
+        b'\xd3\xfe'       # out (0xfe), a
+        b'\x18\xfa')      # jr 0x0000
+
+    m.a = 0xbf
+    m.set_port_input(0xbffe, 0xbf)
+    m.set_output_queuing(True)
+
+    def run():
+        m.ticks_to_stop = 100 * 1000
+        while not m.run() & m._TICKS_LIMIT_HIT:
+            pass
+        return len(m.take_queued_outputs()) * 2
+
+    measure('batched input/output', 'io', run)
+
+
+def bench_state_reads(name):
+    m = make_machine()
+
+    def run():
+        for _ in range(10000):
+            getattr(m, name)
+        return 10000
+
+    measure(f'state read, {name}', 'read', run)
+
+
+def bench_state_writes(name):
+    m = make_machine()
+
+    def run():
+        for i in range(10000):
+            setattr(m, name, i & 0xff)
+        return 10000
+
+    measure(f'state write, {name}', 'write', run)
+
+
+def bench_memory_reads():
+    m = make_machine()
+
+    def run():
+        memory = m.memory
+        for addr in range(0x4000, 0x4000 + 10000):
+            memory[addr]
+        return 10000
+
+    measure('memory read', 'read', run)
+
+
+def bench_disasm(name, code):
+    def run():
+        for _ in range(10000):
+            z80.Z80Machine._disasm(code)
+        return 10000
+
+    measure(f'_disasm(), {name}', 'call', run)
+
+
+def bench_instr_builder():
+    builder = z80.Z80InstrBuilder()
+    code = b'\xdd\x36\x05\x07'  # ld (ix + 5), 0x7
+
+    def run():
+        for _ in range(10000):
+            builder.build_instr(0x0000, code)
+        return 10000
+
+    measure('Z80InstrBuilder.build_instr()', 'instr', run)
+
+
+def main():
+    global DURATION
+    if len(sys.argv) > 1:
+        DURATION = float(sys.argv[1])
+
+    bench_python_call()
+
+    bench_run_native()
+    bench_run_ticks(1)
+    bench_run_ticks(1000)
+
+    bench_io_callbacks()
+    bench_batched_io()
+
+    for name in ('a', 'hl', 'pc', 'ix'):
+        bench_state_reads(name)
+    for name in ('a', 'hl'):
+        bench_state_writes(name)
+    bench_memory_reads()
+
+    bench_disasm('nop', b'\x00')
+    bench_disasm('ld (ix + d), n', b'\xdd\x36\x05\x07')
+    bench_instr_builder()
+
+
+if __name__ == "__main__":
+    main()
@@ -9,10 +9,8 @@ def main():
     for i in range(10):
         print(f'Step {i}: PC={m.pc}')
 
-        # Limit runs to a single tick so each time we execute
-        # exactly one instruction.
-        m.ticks_to_stop = 1
-        m.run()
+        # Execute exactly one instruction.
+        m.run(steps=1)
 
 
 if __name__ == "__main__":
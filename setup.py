@@ -14,18 +14,21 @@ with open(os.path.join(here, 'README.md'), encoding='utf-8') as f:
 
 
 cxx_flags = []
+link_flags = []
 if platform.system() == 'Windows':
     pass
 else:
     cxx_flags.extend([
         '-std=c++11', '-Wall', '-fno-exceptions', '-fno-rtti',
-        '-O3',
+        '-O3', '-pthread',
         # '-S', '-fverbose-asm',  # TODO
     ])
+    link_flags.extend(['-pthread'])
 
 z80_emulator_module = Extension(
     name='z80._z80',
     extra_compile_args=cxx_flags,
+    extra_link_args=link_flags,
     sources=['z80/_z80module.cpp'],
     language='c++')
 
@@ -43,6 +46,7 @@ setup(name='z80',
       license='MIT',
       ext_modules=[z80_emulator_module],
       packages=['z80'],
+      python_requires='>=3.9',
       install_requires=[],
       entry_points={
           'console_scripts': [
@@ -0,0 +1,577 @@
+
+/*  Z80 CPU Emulator.
+    https://github.com/kosarev/z80
+
+    Copyright (c) 2017 Ivan Kosarev <ivan@kosarev.info>
+    Published under the MIT license.
+*/
+
+// Checks the cycle-level handlers of the Z80 emulator against
+// bus traces. Traces are meant to be recorded from the
+// transistor-level simulator with z80sim/record_bus_traces.py;
+// traces marked as hand-written only follow the documented
+// timings.
+//
+// A trace file consists of the following lines:
+//
+//   # <comment>
+//   code <byte> <byte> ...
+//   addr_bus <addr>[*<count>] ...
+//   data_bus <byte>[*<count>] ...
+//   ctrl <signals>[*<count>] ...
+//   m1 <tick> <tick> ...
+//   regs <tick> <reg>=<value> ...
+//
+// The code is placed at address 0 and executed from the reset
+// state until PC reaches the end of the code. 'addr_bus',
+// 'data_bus' and 'ctrl' list the state of the buses and control
+// signals for every T-state, sampled while the clock is high,
+// with repeated values optionally collapsed. The data bus is
+// only listed while MREQ or IORQ is active outside of refresh
+// and is '--' otherwise. Active control signals are written as
+// '1' for M1, 'm' for MREQ, 'i' for IORQ, 'r' for RD, 'w' for
+// WR and 'f' for RFSH, or '-' if none is active.
+//
+// 'm1' lists the T-states at which M1 cycles start. Every
+// 'regs' line gives values of registers at the start of the M1
+// cycle at the specified T-state, or at the end of the code.
+// Registers are named as in the assembly language, e.g., 'a',
+// 'bc' or 'ix'; registers not listed are not compared.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "z80.h"
+
+namespace {
+
+using z80::fast_u8;
+using z80::fast_u16;
+using z80::least_u8;
+using z80::unused;
+
+#if defined(__GNUC__) || defined(__clang__)
+# define LIKE_PRINTF(format, args) \
+      __attribute__((__format__(__printf__, format, args)))
+#else
+# define LIKE_PRINTF(format, args) /* nothing */
+#endif
+
+const char program_name[] = "bus_traces";
+
+[[noreturn]] LIKE_PRINTF(1, 0)
+void verror(const char *format, va_list args) {
+    std::fprintf(stderr, "%s: ", program_name);
+    std::vfprintf(stderr, format, args);
+    std::fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+[[noreturn]] LIKE_PRINTF(1, 2)
+void error(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    verror(format, args);
+    va_end(args);
+}
+
+// Values of the data bus when it is not listed.
+const unsigned no_data = 0x100;
+
+enum : unsigned {
+    m1_signal = 1 << 0,
+    mreq_signal = 1 << 1,
+    iorq_signal = 1 << 2,
+    rd_signal = 1 << 3,
+    wr_signal = 1 << 4,
+    rfsh_signal = 1 << 5,
+};
+
+const char signal_letters[] = "1mirwf";
+
+std::string format_addr(unsigned addr) {
+    char buff[8];
+    std::snprintf(buff, sizeof(buff), "%04x", addr);
+    return buff;
+}
+
+std::string format_data(unsigned n) {
+    if(n == no_data)
+        return "--";
+    char buff[8];
+    std::snprintf(buff, sizeof(buff), "%02x", n);
+    return buff;
+}
+
+std::string format_ctrl(unsigned signals) {
+    std::string s;
+    for(unsigned i = 0; signal_letters[i]; ++i) {
+        if(signals & (1u << i))
+            s += signal_letters[i];
+    }
+    return s.empty() ? "-" : s;
+}
+
+struct reg_snapshot {
+    fast_u16 pc, sp, af, bc, de, hl, ix, iy, ir;
+};
+
+struct reg_field {
+    const char *name;
+    fast_u16 reg_snapshot::*reg;
+    unsigned shift;
+    unsigned mask;
+};
+
+const reg_field reg_fields[] = {
+    { "pc", &reg_snapshot::pc, 0, 0xffff },
+    { "sp", &reg_snapshot::sp, 0, 0xffff },
+    { "af", &reg_snapshot::af, 0, 0xffff },
+    { "bc", &reg_snapshot::bc, 0, 0xffff },
+    { "de", &reg_snapshot::de, 0, 0xffff },
+    { "hl", &reg_snapshot::hl, 0, 0xffff },
+    { "ix", &reg_snapshot::ix, 0, 0xffff },
+    { "iy", &reg_snapshot::iy, 0, 0xffff },
+    { "ir", &reg_snapshot::ir, 0, 0xffff },
+    { "a", &reg_snapshot::af, 8, 0xff },
+    { "f", &reg_snapshot::af, 0, 0xff },
+    { "b", &reg_snapshot::bc, 8, 0xff },
+    { "c", &reg_snapshot::bc, 0, 0xff },
+    { "d", &reg_snapshot::de, 8, 0xff },
+    { "e", &reg_snapshot::de, 0, 0xff },
+    { "h", &reg_snapshot::hl, 8, 0xff },
+    { "l", &reg_snapshot::hl, 0, 0xff },
+    { "i", &reg_snapshot::ir, 8, 0xff },
+    { "r", &reg_snapshot::ir, 0, 0xff },
+};
+
+const std::size_t num_reg_fields = sizeof(reg_fields) / sizeof(reg_fields[0]);
+
+unsigned get_reg_field(const reg_snapshot &regs, const reg_field &field) {
+    return static_cast<unsigned>(regs.*field.reg >> field.shift) &
+           field.mask;
+}
+
+struct reg_value {
+    unsigned tick;
+    std::size_t field;
+    unsigned value;
+};
+
+struct bus_trace {
+    std::vector<least_u8> code;
+    std::vector<unsigned> addr_bus;
+    std::vector<unsigned> data_bus;
+    std::vector<unsigned> ctrl;
+    std::vector<unsigned> m1_ticks;
+    std::vector<reg_value> regs;
+};
+
+unsigned long parse_number(const std::string &token, int base,
+                           const char *filename, unsigned line_no) {
+    char *end;
+    errno = 0;
+    unsigned long n = std::strtoul(token.c_str(), &end, base);
+    if(errno != 0 || token.empty() || *end != '\0')
+        error("%s:%u: malformed number '%s'", filename, line_no,
+              token.c_str());
+    return n;
+}
+
+// Splits a '<value>[*<count>]' token.
+std::string parse_run(const std::string &token, unsigned long &count,
+                      const char *filename, unsigned line_no) {
+    std::size_t star = token.find('*');
+    count = 1;
+    if(star != std::string::npos)
+        count = parse_number(token.substr(star + 1), 10, filename, line_no);
+    return token.substr(0, star);
+}
+
+unsigned parse_ctrl(const std::string &value, const char *filename,
+                    unsigned line_no) {
+    if(value == "-")
+        return 0;
+
+    unsigned signals = 0;
+    for(char c : value) {
+        const char *p = std::strchr(signal_letters, c);
+        if(!p || c == '\0')
+            error("%s:%u: unknown control signal '%c'", filename, line_no,
+                  c);
+        signals |= 1u << (p - signal_letters);
+    }
+    return signals;
+}
+
+void parse_regs(const std::vector<std::string> &tokens, bus_trace &trace,
+                const char *filename, unsigned line_no) {
+    if(tokens.size() < 2)
+        error("%s:%u: missing T-state", filename, line_no);
+
+    reg_value r;
+    r.tick = static_cast<unsigned>(parse_number(tokens[1], 10, filename,
+                                                line_no));
+    for(std::size_t i = 2; i != tokens.size(); ++i) {
+        const std::string &t = tokens[i];
+        std::size_t eq = t.find('=');
+        std::string name = t.substr(0, eq);
+        if(eq == std::string::npos)
+            error("%s:%u: malformed register value '%s'", filename,
+                  line_no, t.c_str());
+
+        r.field = 0;
+        while(r.field != num_reg_fields &&
+                  name != reg_fields[r.field].name)
+            ++r.field;
+        if(r.field == num_reg_fields)
+            error("%s:%u: unknown register '%s'", filename, line_no,
+                  name.c_str());
+
+        unsigned long value = parse_number(t.substr(eq + 1), 16,
+                                           filename, line_no);
+        if(value > reg_fields[r.field].mask)
+            error("%s:%u: value of '%s' out of range", filename, line_no,
+                  name.c_str());
+        r.value = static_cast<unsigned>(value);
+        trace.regs.push_back(r);
+    }
+}
+
+bus_trace load_trace(const char *filename) {
+    FILE *f = std::fopen(filename, "r");
+    if(!f) {
+        error("cannot open trace '%s': %s", filename,
+              std::strerror(errno));
+    }
+
+    bus_trace trace;
+    char line[4096];
+    unsigned line_no = 0;
+    while(std::fgets(line, sizeof(line), f)) {
+        ++line_no;
+
+        std::vector<std::string> tokens;
+        for(char *p = std::strtok(line, " \t\n"); p;
+                p = std::strtok(nullptr, " \t\n"))
+            tokens.push_back(p);
+        if(tokens.empty() || tokens[0][0] == '#')
+            continue;
+
+        const std::string &kind = tokens[0];
+        if(kind == "regs") {
+            parse_regs(tokens, trace, filename, line_no);
+            continue;
+        }
+
+        for(std::size_t i = 1; i != tokens.size(); ++i) {
+            const std::string &t = tokens[i];
+            unsigned long count;
+            if(kind == "code") {
+                unsigned long n = parse_number(t, 16, filename, line_no);
+                if(n > 0xff)
+                    error("%s:%u: byte out of range", filename, line_no);
+                trace.code.push_back(static_cast<least_u8>(n));
+            } else if(kind == "addr_bus") {
+                unsigned long addr = parse_number(
+                    parse_run(t, count, filename, line_no), 16,
+                    filename, line_no);
+                if(addr > 0xffff)
+                    error("%s:%u: address out of range", filename, line_no);
+                trace.addr_bus.insert(trace.addr_bus.end(), count,
+                                      static_cast<unsigned>(addr));
+            } else if(kind == "data_bus") {
+                std::string value = parse_run(t, count, filename, line_no);
+                unsigned long n = no_data;
+                if(value != "--") {
+                    n = parse_number(value, 16, filename, line_no);
+                    if(n > 0xff)
+                        error("%s:%u: byte out of range", filename,
+                              line_no);
+                }
+                trace.data_bus.insert(trace.data_bus.end(), count,
+                                      static_cast<unsigned>(n));
+            } else if(kind == "ctrl") {
+                std::string value = parse_run(t, count, filename, line_no);
+                trace.ctrl.insert(trace.ctrl.end(), count,
+                                  parse_ctrl(value, filename, line_no));
+            } else if(kind == "m1") {
+                trace.m1_ticks.push_back(static_cast<unsigned>(
+                    parse_number(t, 10, filename, line_no)));
+            } else {
+                error("%s:%u: unknown record '%s'", filename, line_no,
+                      kind.c_str());
+            }
+        }
+    }
+    if(std::ferror(f))
+        error("cannot read trace '%s': %s", filename, std::strerror(errno));
+    if(std::fclose(f) != 0)
+        error("cannot close trace '%s': %s", filename, std::strerror(errno));
+
+    if(trace.code.empty())
+        error("%s: no code", filename);
+    if(trace.data_bus.size() != trace.addr_bus.size() ||
+           trace.ctrl.size() != trace.addr_bus.size())
+        error("%s: buses and control signals differ in length", filename);
+    return trace;
+}
+
+// Records the buses, the control signals and the starts of M1
+// cycles at every T-state. The control signals follow the
+// machine cycle timings of the Z80 CPU User Manual.
+class tracing_machine : public z80::z80_cpu<tracing_machine> {
+public:
+    typedef z80::z80_cpu<tracing_machine> base;
+
+    tracing_machine() {}
+
+    void load(const std::vector<least_u8> &code) {
+        std::memcpy(memory, code.data(), code.size());
+    }
+
+    fast_u8 on_read(fast_u16 addr) {
+        assert(addr < z80::address_space_size);
+        data_value = memory[addr];
+        return memory[addr];
+    }
+
+    void on_write(fast_u16 addr, fast_u8 n) {
+        assert(addr < z80::address_space_size);
+        data_value = n;
+        memory[addr] = static_cast<least_u8>(n);
+    }
+
+    fast_u8 on_input(fast_u16 port) {
+        unused(port);
+        return input_value;
+    }
+
+    fast_u8 on_m1_fetch_cycle() {
+        unsigned tick = static_cast<unsigned>(addr_bus.size());
+        m1_ticks.push_back(tick);
+        regs[tick] = get_regs();
+
+        is_m1_cycle = true;
+        fast_u8 op = base::on_m1_fetch_cycle();
+        is_m1_cycle = false;
+        return op;
+    }
+
+    fast_u8 on_fetch_cycle() {
+        static const unsigned m1_cycle[] = {
+            m1_signal,
+            m1_signal | mreq_signal | rd_signal,
+            rfsh_signal,
+            mreq_signal | rfsh_signal };
+        static const unsigned fetch_cycle[] = {
+            0,
+            mreq_signal | rd_signal,
+            rfsh_signal,
+            mreq_signal | rfsh_signal };
+        start_cycle(is_m1_cycle ? m1_cycle : fetch_cycle, 4);
+        return base::on_fetch_cycle();
+    }
+
+    fast_u8 on_read_cycle(fast_u16 addr) {
+        static const unsigned read_cycle[] = {
+            0,
+            mreq_signal | rd_signal,
+            mreq_signal | rd_signal };
+        start_cycle(read_cycle, 3);
+        return base::on_read_cycle(addr);
+    }
+
+    void on_write_cycle(fast_u16 addr, fast_u8 n) {
+        static const unsigned write_cycle[] = {
+            0,
+            mreq_signal,
+            mreq_signal | wr_signal };
+        start_cycle(write_cycle, 3);
+        base::on_write_cycle(addr, n);
+    }
+
+    fast_u8 on_input_cycle(fast_u16 port) {
+        static const unsigned input_cycle[] = {
+            0,
+            iorq_signal | rd_signal,
+            iorq_signal | rd_signal,
+            iorq_signal | rd_signal };
+        start_cycle(input_cycle, 4);
+        data_value = input_value;
+        return base::on_input_cycle(port);
+    }
+
+    void on_output_cycle(fast_u16 port, fast_u8 n) {
+        static const unsigned output_cycle[] = {
+            0,
+            iorq_signal | wr_signal,
+            iorq_signal | wr_signal,
+            iorq_signal | wr_signal };
+        start_cycle(output_cycle, 4);
+        data_value = n;
+        base::on_output_cycle(port, n);
+    }
+
+    void on_set_addr_bus(fast_u16 addr) {
+        addr_bus_value = addr;
+    }
+
+    // T-states past the end of a machine cycle, e.g., those of
+    // execution cycles, have no control signals active.
+    void on_tick(unsigned t) {
+        for(; t != 0; --t) {
+            unsigned signals = 0;
+            if(cycle_tick < cycle_length)
+                signals = cycle_signals[cycle_tick++];
+
+            bool transfer = (signals & (mreq_signal | iorq_signal)) &&
+                            !(signals & rfsh_signal);
+            addr_bus.push_back(static_cast<unsigned>(addr_bus_value));
+            data_bus.push_back(transfer ? data_value : no_data);
+            ctrl.push_back(signals);
+        }
+    }
+
+    reg_snapshot get_regs() const {
+        reg_snapshot r;
+        r.pc = get_pc();
+        r.sp = get_sp();
+        r.af = get_af();
+        r.bc = get_bc();
+        r.de = get_de();
+        r.hl = get_hl();
+        r.ix = get_ix();
+        r.iy = get_iy();
+        r.ir = get_ir();
+        return r;
+    }
+
+    std::vector<unsigned> addr_bus;
+    std::vector<unsigned> data_bus;
+    std::vector<unsigned> ctrl;
+    std::vector<unsigned> m1_ticks;
+    std::map<unsigned, reg_snapshot> regs;
+
+private:
+    // Value returned on input cycles; must match
+    // z80sim/record_bus_traces.py.
+    static const fast_u8 input_value = 0xff;
+
+    void start_cycle(const unsigned *signals, unsigned length) {
+        cycle_signals = signals;
+        cycle_length = length;
+        cycle_tick = 0;
+    }
+
+    fast_u16 addr_bus_value = 0;
+    unsigned data_value = no_data;
+    bool is_m1_cycle = false;
+    const unsigned *cycle_signals = nullptr;
+    unsigned cycle_length = 0;
+    unsigned cycle_tick = 0;
+    least_u8 memory[z80::address_space_size] = {};
+};
+
+// Reports the first T-state at which the expected and actual
+// values differ.
+bool compare_ticks(const char *filename, const char *what,
+                   const std::vector<unsigned> &expected,
+                   const std::vector<unsigned> &actual,
+                   std::string (*format)(unsigned)) {
+    std::size_t num_ticks = std::max(expected.size(), actual.size());
+    for(std::size_t i = 0; i != num_ticks; ++i) {
+        bool has_expected = i < expected.size();
+        bool has_actual = i < actual.size();
+        if(has_expected && has_actual && expected[i] == actual[i])
+            continue;
+
+        std::fprintf(stderr, "%s: T-state %u: %s %s expected, %s found\n",
+                     filename, static_cast<unsigned>(i), what,
+                     has_expected ? format(expected[i]).c_str() : "none",
+                     has_actual ? format(actual[i]).c_str() : "none");
+        return false;
+    }
+    return true;
+}
+
+bool validate(const char *filename) {
+    bus_trace trace = load_trace(filename);
+
+    std::vector<tracing_machine> machines(1);
+    tracing_machine &mach = machines[0];
+    mach.load(trace.code);
+
+    // Do not let a broken engine run forever.
+    const std::size_t max_ticks = trace.addr_bus.size() + 100;
+    while(mach.get_pc() != trace.code.size() &&
+              mach.addr_bus.size() < max_ticks)
+        mach.on_step();
+    mach.regs[static_cast<unsigned>(mach.addr_bus.size())] = mach.get_regs();
+
+    bool ok = true;
+    ok &= compare_ticks(filename, "address bus", trace.addr_bus,
+                        mach.addr_bus, format_addr);
+    ok &= compare_ticks(filename, "data bus", trace.data_bus,
+                        mach.data_bus, format_data);
+    ok &= compare_ticks(filename, "control signals", trace.ctrl,
+                        mach.ctrl, format_ctrl);
+
+    if(trace.m1_ticks != mach.m1_ticks) {
+        std::fprintf(stderr, "%s: M1 cycles start at", filename);
+        for(unsigned t : mach.m1_ticks)
+            std::fprintf(stderr, " %u", t);
+        std::fprintf(stderr, " instead of");
+        for(unsigned t : trace.m1_ticks)
+            std::fprintf(stderr, " %u", t);
+        std::fprintf(stderr, "\n");
+        ok = false;
+    }
+
+    for(const reg_value &r : trace.regs) {
+        const reg_field &field = reg_fields[r.field];
+        auto snapshot = mach.regs.find(r.tick);
+        if(snapshot == mach.regs.end()) {
+            std::fprintf(stderr, "%s: T-state %u: no M1 cycle starts "
+                                 "to compare '%s'\n",
+                         filename, r.tick, field.name);
+            ok = false;
+            continue;
+        }
+
+        unsigned value = get_reg_field(snapshot->second, field);
+        if(value != r.value) {
+            std::fprintf(stderr, "%s: T-state %u: %s %0*x expected, "
+                                 "%0*x found\n",
+                         filename, r.tick, field.name,
+                         field.mask > 0xff ? 4 : 2, r.value,
+                         field.mask > 0xff ? 4 : 2, value);
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+    if(argc < 2)
+        error("usage: bus_traces <trace>...");
+
+    unsigned num_failed = 0;
+    for(int i = 1; i != argc; ++i) {
+        if(!validate(argv[i]))
+            ++num_failed;
+    }
+
+    if(num_failed != 0)
+        error("%u of %u traces failed", num_failed,
+              static_cast<unsigned>(argc - 1));
+}
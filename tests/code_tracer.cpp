@@ -0,0 +1,174 @@
+
+#include <vector>
+
+#include "z80.h"
+
+#include "check.h"
+
+using z80::fast_u16;
+using z80::least_u8;
+
+class my_tracer : public z80::code_tracer<z80::z80_disasm<my_tracer>>
+{};
+
+static void load(my_tracer &t, fast_u16 addr, const least_u8 *code,
+                 std::size_t size) {
+    for(std::size_t i = 0; i != size; ++i)
+        t.set_byte(static_cast<fast_u16>(addr + i), code[i]);
+}
+
+static void test_code_tracer() {
+    static const least_u8 code[] = {
+        0xcd, 0x0a, 0x00,        // 0x00  call 0x000a
+        0x28, 0x02,              // 0x03  jr z, 0x0007
+        0xc3, 0x0c, 0x00,        // 0x05  jp 0x000c
+        0xff,                    // 0x08  rst 0x38
+        0x00,                    // 0x09  nop
+        0xc9,                    // 0x0a  ret
+        0x00,                    // 0x0b  data
+        0xdd, 0xe9,              // 0x0c  jp (ix)
+        0x00 };                  // 0x0e  data
+
+    std::vector<my_tracer> tracers(1);
+    my_tracer &t = tracers[0];
+    load(t, 0x0000, code, sizeof(code));
+    t.add_entry(0x0000);
+    t.trace();
+
+    CHECK(t.get_instr_size(0x00) == 3);
+    CHECK(t.get_instr_size(0x03) == 2);
+    CHECK(t.get_instr_size(0x05) == 3);
+    CHECK(t.get_instr_size(0x0a) == 1);
+    CHECK(t.get_instr_size(0x0c) == 2);
+
+    // The relative jump lands in the middle of 'jp 0x000c'.
+    CHECK(t.get_instr_size(0x07) == 1);
+    CHECK(t.get_marks(0x07) & my_tracer::overlap_mark);
+    CHECK(!(t.get_marks(0x05) & my_tracer::overlap_mark));
+
+    // 0x07 is 'nop' and is followed by 'rst 0x38', whose target is
+    // not defined.
+    CHECK(t.get_instr_size(0x08) == 1);
+    CHECK(t.get_instr_size(0x09) == 1);
+    CHECK(t.get_instr_size(0x38) == 0);
+
+    // Data.
+    CHECK(t.get_instr_size(0x0b) == 0);
+    CHECK(!(t.get_marks(0x0b) & my_tracer::code_mark));
+    CHECK(t.get_instr_size(0x0e) == 0);
+    CHECK(t.get_marks(0x0e) == my_tracer::defined_mark);
+
+    // Instructions extending past the defined bytes are not
+    // decoded.
+    static const least_u8 truncated[] = { 0xc3, 0x00 };
+    load(t, 0x1000, truncated, sizeof(truncated));
+    t.add_entry(0x1000);
+    t.trace();
+    CHECK(t.get_instr_size(0x1000) == 0);
+}
+
+static void test_merge() {
+    static const least_u8 code[] = {
+        0xc3, 0x01, 0x00,        // 0x00  jp 0x0001
+        0xc9 };                  // 0x03  ret
+
+    // Tracing entry points separately and merging the results
+    // should give the same as tracing them together.
+    std::vector<my_tracer> tracers(3);
+    for(my_tracer &t : tracers)
+        load(t, 0x0000, code, sizeof(code));
+    tracers[0].add_entry(0x0000);
+    tracers[0].add_entry(0x0001);
+    tracers[0].trace();
+    tracers[1].add_entry(0x0000);
+    tracers[1].trace();
+    tracers[2].add_entry(0x0001);
+    tracers[2].trace();
+
+    // 'jp 0x0001' jumps into itself, but the tracer only sees
+    // the overlap when both instructions are known.
+    CHECK(!(tracers[2].get_marks(0x01) & my_tracer::overlap_mark));
+    tracers[1].merge(tracers[2]);
+    for(unsigned addr = 0; addr != sizeof(code); ++addr) {
+        auto a = static_cast<fast_u16>(addr);
+        CHECK(tracers[1].get_instr_size(a) == tracers[0].get_instr_size(a));
+        CHECK(tracers[1].get_marks(a) == tracers[0].get_marks(a));
+    }
+    CHECK(tracers[1].get_marks(0x01) & my_tracer::overlap_mark);
+
+    // Cleared tracers forget everything.
+    tracers[1].clear();
+    CHECK(tracers[1].get_marks(0x00) == 0);
+    CHECK(tracers[1].get_instr_size(0x00) == 0);
+}
+
+static void test_blocks() {
+    static const least_u8 code[] = {
+        0x06, 0x03,              // 0x00  ld b, 3
+        0x00,                    // 0x02  nop
+        0x10, 0xfd,              // 0x03  djnz 0x0002
+        0xcd, 0x0d, 0x00,        // 0x05  call 0x000d
+        0x28, 0x01,              // 0x08  jr z, 0x000b
+        0xc9,                    // 0x0a  ret
+        0xdd, 0xe9,              // 0x0b  jp (ix)
+        0xc0,                    // 0x0d  ret nz
+        0xc9 };                  // 0x0e  ret
+
+    std::vector<my_tracer> tracers(1);
+    my_tracer &t = tracers[0];
+    load(t, 0x0000, code, sizeof(code));
+    t.add_entry(0x0000);
+    t.trace();
+
+    z80::basic_block b;
+    CHECK(t.get_block(0x00, b));
+    CHECK(b.size == 2 && b.num_of_instrs == 1);
+    CHECK(b.flow == z80::instr_flow::falls_through && !b.has_target);
+
+    // The loop body.
+    CHECK(t.get_block(0x02, b));
+    CHECK(b.size == 3 && b.num_of_instrs == 2 && b.last_instr_addr == 0x03);
+    CHECK(b.flow == (z80::instr_flow::jump | z80::instr_flow::falls_through));
+    CHECK(b.has_target && b.target == 0x02);
+    CHECK(!t.get_block(0x03, b));
+
+    // Calls end blocks.
+    CHECK(t.get_block(0x05, b));
+    CHECK(b.size == 3);
+    CHECK(b.flow == (z80::instr_flow::call | z80::instr_flow::falls_through));
+    CHECK(b.has_target && b.target == 0x0d);
+
+    CHECK(t.get_block(0x08, b));
+    CHECK(b.size == 2);
+    CHECK(t.get_block(0x0a, b));
+    CHECK(b.flow == z80::instr_flow::ret);
+    CHECK(t.get_block(0x0b, b));
+    CHECK(b.flow == z80::instr_flow::indirect);
+    CHECK(t.get_block(0x0d, b));
+    CHECK(b.size == 1);
+    CHECK(b.flow == (z80::instr_flow::ret | z80::instr_flow::falls_through));
+    CHECK(t.get_block(0x0e, b));
+
+    // Blocks survive merging.
+    std::vector<my_tracer> others(1);
+    my_tracer &other = others[0];
+    load(other, 0x0000, code, sizeof(code));
+    other.add_entry(0x0003);
+    other.trace();
+    CHECK(!other.get_block(0x00, b));
+    other.merge(t);
+    CHECK(other.get_block(0x00, b));
+    CHECK(b.size == 2);
+
+    // Entry points split blocks.
+    CHECK(other.get_block(0x02, b));
+    CHECK(b.size == 1);
+    CHECK(other.get_block(0x03, b));
+    CHECK(b.size == 2);
+}
+
+int main() {
+    test_code_tracer();
+    test_merge();
+    test_blocks();
+}
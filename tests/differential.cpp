@@ -0,0 +1,453 @@
+
+/*  Z80 CPU Emulator.
+    https://github.com/kosarev/z80
+
+    Copyright (c) 2017 Ivan Kosarev <ivan@kosarev.info>
+    Published under the MIT license.
+*/
+
+// Lockstep differential testing of the emulation engines.
+//
+// Every candidate engine, e.g., one that uses lazy flags or
+// bypasses register access dispatching, is run alongside the
+// reference one on the same random instruction streams. The
+// full CPU state, memory writes, input/output operations and
+// ticks are compared after every instruction. On a mismatch,
+// the failing stream is minimised and reported.
+
+#include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "z80.h"
+
+namespace {
+
+using z80::fast_u8;
+using z80::fast_u16;
+using z80::fast_u32;
+using z80::least_u8;
+using z80::unused;
+
+#if defined(__GNUC__) || defined(__clang__)
+# define LIKE_PRINTF(format, args) \
+      __attribute__((__format__(__printf__, format, args)))
+#else
+# define LIKE_PRINTF(format, args) /* nothing */
+#endif
+
+const char program_name[] = "differential";
+
+[[noreturn]] LIKE_PRINTF(1, 0)
+void verror(const char *format, va_list args) {
+    std::fprintf(stderr, "%s: ", program_name);
+    std::vfprintf(stderr, format, args);
+    std::fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+[[noreturn]] LIKE_PRINTF(1, 2)
+void error(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    verror(format, args);
+    va_end(args);
+}
+
+// A test case is a program placed at the initial PC of a
+// memory image filled with pseudo-random bytes, and an initial
+// CPU state derived from the same seed.
+struct test_case {
+    fast_u32 seed = 0;
+    std::vector<least_u8> program;
+};
+
+// Everything that is compared between engines.
+struct cpu_snapshot {
+    fast_u16 bc = 0, de = 0, hl = 0, pc = 0, sp = 0;
+    fast_u8 a = 0, f = 0;
+    fast_u16 ix = 0, iy = 0, ir = 0, wz = 0;
+    fast_u16 alt_bc = 0, alt_de = 0, alt_hl = 0, alt_af = 0;
+    bool iff1 = false, iff2 = false;
+    unsigned int_mode = 0;
+    bool halted = false, int_disabled = false;
+    fast_u32 ticks = 0;
+
+    // Memory writes and input/output operations of the last
+    // instruction, as (kind, address, value) triples.
+    std::vector<fast_u32> accesses;
+};
+
+bool operator == (const cpu_snapshot &x, const cpu_snapshot &y) {
+    return x.bc == y.bc && x.de == y.de && x.hl == y.hl &&
+           x.pc == y.pc && x.sp == y.sp && x.a == y.a && x.f == y.f &&
+           x.ix == y.ix && x.iy == y.iy && x.ir == y.ir && x.wz == y.wz &&
+           x.alt_bc == y.alt_bc && x.alt_de == y.alt_de &&
+           x.alt_hl == y.alt_hl && x.alt_af == y.alt_af &&
+           x.iff1 == y.iff1 && x.iff2 == y.iff2 &&
+           x.int_mode == y.int_mode && x.halted == y.halted &&
+           x.int_disabled == y.int_disabled && x.ticks == y.ticks &&
+           x.accesses == y.accesses;
+}
+
+bool operator != (const cpu_snapshot &x, const cpu_snapshot &y) {
+    return !(x == y);
+}
+
+void print_snapshot(const char *name, const cpu_snapshot &s) {
+    std::fprintf(stderr,
+                 "  %-10s bc %04x de %04x hl %04x af %02x%02x "
+                 "pc %04x sp %04x\n"
+                 "  %-10s ix %04x iy %04x ir %04x wz %04x\n"
+                 "  %-10s bc' %04x de' %04x hl' %04x af' %04x\n"
+                 "  %-10s iff1 %u iff2 %u im %u halted %u "
+                 "int_disabled %u ticks %u\n",
+                 name, static_cast<unsigned>(s.bc),
+                 static_cast<unsigned>(s.de), static_cast<unsigned>(s.hl),
+                 static_cast<unsigned>(s.a), static_cast<unsigned>(s.f),
+                 static_cast<unsigned>(s.pc), static_cast<unsigned>(s.sp),
+                 "", static_cast<unsigned>(s.ix),
+                 static_cast<unsigned>(s.iy), static_cast<unsigned>(s.ir),
+                 static_cast<unsigned>(s.wz),
+                 "", static_cast<unsigned>(s.alt_bc),
+                 static_cast<unsigned>(s.alt_de),
+                 static_cast<unsigned>(s.alt_hl),
+                 static_cast<unsigned>(s.alt_af),
+                 "", s.iff1, s.iff2, s.int_mode, s.halted, s.int_disabled,
+                 static_cast<unsigned>(s.ticks));
+
+    std::fprintf(stderr, "  %-10s", "");
+    for(fast_u32 a : s.accesses) {
+        static const char kinds[] = "wio";
+        std::fprintf(stderr, " %c:%04x:%02x", kinds[a >> 24],
+                     static_cast<unsigned>((a >> 8) & 0xffff),
+                     static_cast<unsigned>(a & 0xff));
+    }
+    std::fprintf(stderr, "\n");
+}
+
+template<typename B>
+class test_machine : public B {
+public:
+    typedef B base;
+
+    test_machine() {}
+
+    enum access_kind { write_access, input_access, output_access };
+
+    fast_u8 on_read(fast_u16 addr) {
+        assert(addr < z80::address_space_size);
+        return memory[addr];
+    }
+
+    void on_write(fast_u16 addr, fast_u8 n) {
+        assert(addr < z80::address_space_size);
+        memory[addr] = static_cast<least_u8>(n);
+        record(write_access, addr, n);
+    }
+
+    fast_u8 on_input(fast_u16 port) {
+        // Any deterministic function of the port would do.
+        fast_u8 n = z80::mask8(port * 0x9d + (port >> 8));
+        record(input_access, port, n);
+        return n;
+    }
+
+    void on_output(fast_u16 port, fast_u8 n) {
+        record(output_access, port, n);
+    }
+
+    void on_tick(unsigned t) {
+        ticks += t;
+    }
+
+    void load(const test_case &c, fast_u16 pc) {
+        std::mt19937 rng(static_cast<std::mt19937::result_type>(c.seed));
+        for(least_u8 &b : memory)
+            b = static_cast<least_u8>(rng() & 0xff);
+        for(std::size_t i = 0; i != c.program.size(); ++i)
+            memory[z80::mask16(pc + i)] = c.program[i];
+
+        base::set_bc(z80::mask16(rng()));
+        base::set_de(z80::mask16(rng()));
+        base::set_hl(z80::mask16(rng()));
+        base::set_sp(z80::mask16(rng()));
+        self().on_set_a(z80::mask8(rng()));
+        self().on_set_f(z80::mask8(rng()));
+        base::set_pc(pc);
+        self().load_extras(rng);
+
+        ticks = 0;
+        accesses.clear();
+    }
+
+    void step(cpu_snapshot &s) {
+        accesses.clear();
+        self().on_step();
+
+        s.bc = base::get_bc();
+        s.de = base::get_de();
+        s.hl = base::get_hl();
+        s.pc = base::get_pc();
+        s.sp = base::get_sp();
+        s.a = self().on_get_a();
+        s.f = self().on_get_f();
+        s.halted = base::is_halted();
+        s.int_disabled = base::is_int_disabled();
+        s.ticks = ticks;
+        s.accesses = accesses;
+        self().capture_extras(s);
+    }
+
+    // Overridden by the Z80 machines to initialise and capture
+    // the Z80-specific state.
+    void load_extras(std::mt19937 &rng) {
+        self().on_set_iff(rng() & 1);
+    }
+
+    void capture_extras(cpu_snapshot &s) {
+        s.iff1 = self().on_get_iff();
+    }
+
+protected:
+    using base::self;
+
+private:
+    void record(access_kind kind, fast_u16 addr, fast_u8 n) {
+        accesses.push_back((static_cast<fast_u32>(kind) << 24) |
+                           (static_cast<fast_u32>(addr) << 8) | n);
+    }
+
+    least_u8 memory[z80::address_space_size] = {};
+    fast_u32 ticks = 0;
+    std::vector<fast_u32> accesses;
+};
+
+template<typename B>
+class z80_test_machine : public test_machine<B> {
+public:
+    typedef test_machine<B> base;
+
+    void load_extras(std::mt19937 &rng) {
+        base::set_ix(z80::mask16(rng()));
+        base::set_iy(z80::mask16(rng()));
+        base::set_ir(z80::mask16(rng()));
+        base::set_wz(z80::mask16(rng()));
+        base::set_alt_bc(z80::mask16(rng()));
+        base::set_alt_de(z80::mask16(rng()));
+        base::set_alt_hl(z80::mask16(rng()));
+        base::set_alt_af(z80::mask16(rng()));
+        base::set_iff1(rng() & 1);
+        base::set_iff2(rng() & 1);
+        base::set_int_mode(static_cast<unsigned>(rng() % 3));
+    }
+
+    void capture_extras(cpu_snapshot &s) {
+        s.ix = base::get_ix();
+        s.iy = base::get_iy();
+        s.ir = base::get_ir();
+        s.wz = base::get_wz();
+        s.alt_bc = base::get_alt_bc();
+        s.alt_de = base::get_alt_de();
+        s.alt_hl = base::get_alt_hl();
+        s.alt_af = base::get_alt_af();
+        s.iff1 = base::get_iff1();
+        s.iff2 = base::get_iff2();
+        s.int_mode = base::get_int_mode();
+    }
+};
+
+// The reference engines.
+class i8080_reference
+    : public test_machine<z80::i8080_cpu<i8080_reference>>
+{};
+
+class z80_reference
+    : public z80_test_machine<z80::z80_cpu<z80_reference>>
+{};
+
+// Candidate: generic register accessors do not dispatch to
+// register-specific handlers.
+class i8080_no_dispatch
+    : public test_machine<z80::i8080_cpu<i8080_no_dispatch>> {
+public:
+    bool on_dispatch_register_accesses() { return false; }
+};
+
+class z80_no_dispatch
+    : public z80_test_machine<z80::z80_cpu<z80_no_dispatch>> {
+public:
+    bool on_dispatch_register_accesses() { return false; }
+};
+
+// Candidate: flags are only stored in their lazy form and
+// evaluated on demand.
+class i8080_lazy_flags
+    : public test_machine<z80::i8080_cpu<i8080_lazy_flags>> {
+public:
+    bool on_is_to_use_lazy_flags() { return true; }
+
+    fast_u16 on_get_flags() { return flags; }
+    void on_set_flags(fast_u16 n) { flags = n; }
+
+    fast_u8 on_get_f() const {
+        flag_set f(/* is_lazy= */ true);
+        f.lazy = flags;
+        return f.get_f();
+    }
+
+    void on_set_f(fast_u8 n) {
+        flags = static_cast<fast_u16>((n << 8) | 1);
+    }
+
+private:
+    fast_u16 flags = 0;
+};
+
+// Runs a reference and a candidate engine in lockstep and
+// returns the index of the first diverging instruction, if any.
+template<typename R, typename C>
+struct engine_pair {
+    static constexpr fast_u16 start_addr = 0x0000;
+
+    // Engine objects are too large for the stack.
+    std::vector<R> refs{1};
+    std::vector<C> cands{1};
+
+    cpu_snapshot ref_state, cand_state;
+
+    bool run(const test_case &c, unsigned num_of_instrs,
+             unsigned *failing_instr = nullptr) {
+        R &ref = refs[0];
+        C &cand = cands[0];
+        ref.load(c, start_addr);
+        cand.load(c, start_addr);
+        for(unsigned i = 0; i != num_of_instrs; ++i) {
+            ref.step(ref_state);
+            cand.step(cand_state);
+            if(ref_state != cand_state) {
+                if(failing_instr)
+                    *failing_instr = i;
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+struct options {
+    fast_u32 seed = 1;
+    unsigned num_of_cases = 3000;
+    unsigned num_of_instrs = 64;
+    unsigned program_size = 16;
+};
+
+// Reduces a failing test case by deleting and then replacing
+// with NOPs individual bytes of its program as long as the case
+// keeps failing.
+template<typename P>
+void minimise(P &pair, test_case &c, unsigned &num_of_instrs) {
+    auto fails = [&](const test_case &t, unsigned n, unsigned &failing) {
+        return !pair.run(t, n, &failing);
+    };
+
+    unsigned failing = 0;
+    bool progress = true;
+    while(progress) {
+        progress = false;
+        for(std::size_t i = 0; i < c.program.size(); ++i) {
+            test_case t = c;
+            t.program.erase(t.program.begin() +
+                            static_cast<std::ptrdiff_t>(i));
+            if(fails(t, num_of_instrs, failing)) {
+                c = t;
+                num_of_instrs = failing + 1;
+                progress = true;
+                --i;
+            }
+        }
+    }
+
+    for(least_u8 &b : c.program) {
+        if(b == 0x00)
+            continue;
+        least_u8 saved = b;
+        b = 0x00;
+        if(fails(c, num_of_instrs, failing))
+            num_of_instrs = failing + 1;
+        else
+            b = saved;
+    }
+
+    bool failed = fails(c, num_of_instrs, failing);
+    assert(failed);
+    unused(failed);
+    num_of_instrs = failing + 1;
+}
+
+template<typename R, typename C>
+bool test_engine(const char *name, const options &opts) {
+    engine_pair<R, C> pair;
+    std::mt19937 rng(static_cast<std::mt19937::result_type>(opts.seed));
+
+    for(unsigned i = 0; i != opts.num_of_cases; ++i) {
+        test_case c;
+        c.seed = rng();
+        c.program.resize(opts.program_size);
+        for(least_u8 &b : c.program)
+            b = static_cast<least_u8>(rng() & 0xff);
+
+        unsigned failing = 0;
+        if(pair.run(c, opts.num_of_instrs, &failing))
+            continue;
+
+        unsigned num_of_instrs = failing + 1;
+        minimise(pair, c, num_of_instrs);
+
+        std::fprintf(stderr, "%s: divergence at instruction %u "
+                             "of case %u, seed %u:\n  program",
+                     name, num_of_instrs - 1, i,
+                     static_cast<unsigned>(c.seed));
+        for(least_u8 b : c.program)
+            std::fprintf(stderr, " %02x", static_cast<unsigned>(b));
+        std::fprintf(stderr, "\n");
+        print_snapshot("reference", pair.ref_state);
+        print_snapshot("candidate", pair.cand_state);
+        return false;
+    }
+
+    std::printf("%s: %u cases of %u instructions passed\n", name,
+                opts.num_of_cases, opts.num_of_instrs);
+    return true;
+}
+
+[[noreturn]] static void usage() {
+    error("differential [<seed> [<num-of-cases> [<num-of-instrs>]]]");
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+    options opts;
+    if(argc > 4)
+        usage();
+    if(argc > 1)
+        opts.seed = static_cast<fast_u32>(std::strtoul(argv[1], nullptr, 0));
+    if(argc > 2)
+        opts.num_of_cases = static_cast<unsigned>(std::atoi(argv[2]));
+    if(argc > 3)
+        opts.num_of_instrs = static_cast<unsigned>(std::atoi(argv[3]));
+
+    bool passed = true;
+    passed &= test_engine<i8080_reference, i8080_no_dispatch>(
+        "i8080 no-dispatch", opts);
+    passed &= test_engine<i8080_reference, i8080_lazy_flags>(
+        "i8080 lazy-flags", opts);
+    passed &= test_engine<z80_reference, z80_no_dispatch>(
+        "z80 no-dispatch", opts);
+
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
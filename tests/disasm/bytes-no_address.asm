@@ -0,0 +1,5 @@
+    db 0xf3                             ; @@ f3
+===
+    db 0xf3                             ; @@ f3
+                                             ^
+disasm/bytes-no_address.asm:1:45: f3: Bytes need a tag address.
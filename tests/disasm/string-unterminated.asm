@@ -0,0 +1,5 @@
+    nop                                 ; @@ 0x0000 .include_binary 'input.bin
+===
+    nop                                 ; @@ 0x0000 .include_binary 'input.bin
+                                                                    ^
+disasm/string-unterminated.asm:1:68: ': Unterminated string.
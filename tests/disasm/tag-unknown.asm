@@ -0,0 +1,5 @@
+    nop                                 ; @@ 0x0000 .nop
+===
+    nop                                 ; @@ 0x0000 .nop
+                                                     ^
+disasm/tag-unknown.asm:1:53: nop: Unknown tag.
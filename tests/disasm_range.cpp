@@ -0,0 +1,114 @@
+
+#include <cstring>
+
+#include "z80.h"
+
+#include "check.h"
+
+using z80::least_u8;
+
+class my_disasm : public z80::range_disasm<z80::z80_disasm<my_disasm>>
+{};
+
+class my_decoder : public z80::range_decoder<z80::z80_disasm<my_decoder>>
+{};
+
+static void test_disasm_range() {
+    static const least_u8 image[] = {
+        0x00,                    // nop
+        0xdd, 0x21, 0x34, 0x12,  // ld ix, 0x1234
+        0xfd, 0x36, 0xfe, 0x07,  // ld (iy - 2), 0x07
+        0x18, 0xfe,              // jr $
+        0xc3 };                  // jp, truncated
+
+    z80::disasm_record records[sizeof(image)];
+    my_disasm dis;
+    std::size_t n = dis.disasm_range(image, sizeof(image), 0xfff0,
+                                     records, sizeof(image));
+
+    CHECK(n == 5);
+    CHECK(records[0].addr == 0xfff0 && records[0].size == 1);
+    CHECK(std::strcmp(records[0].text, "nop") == 0);
+    CHECK(records[1].addr == 0xfff1 && records[1].size == 4);
+    CHECK(std::strcmp(records[1].text, "ld ix, 0x1234") == 0);
+    CHECK(records[2].addr == 0xfff5 && records[2].size == 4);
+    CHECK(std::strcmp(records[2].text, "ld (iy - 2), 0x07") == 0);
+    CHECK(records[3].addr == 0xfff9 && records[3].size == 2);
+    CHECK(std::strcmp(records[3].text, "jr $ + 0") == 0);
+
+    // Missing bytes read as zeros.
+    CHECK(records[4].addr == 0xfffb && records[4].size == 3);
+    CHECK(std::strcmp(records[4].text, "jp 0x0000") == 0);
+
+    // Stop when the buffer is full.
+    n = dis.disasm_range(image, sizeof(image), 0x0000, records, 2);
+    CHECK(n == 2);
+    CHECK(records[1].addr == 0x0001);
+
+    // A prefix followed by another prefix is disassembled on its
+    // own. The second prefix selects the index register.
+    static const least_u8 prefixes[] = { 0xdd, 0xfd, 0x21, 0x00, 0x00 };
+    n = dis.disasm_range(prefixes, sizeof(prefixes), 0x0000, records,
+                         sizeof(prefixes));
+    CHECK(n == 2);
+    CHECK(records[0].addr == 0x0000 && records[0].size == 1);
+    CHECK(std::strcmp(records[0].text, "noni") == 0);
+    CHECK(records[1].addr == 0x0001 && records[1].size == 4);
+    CHECK(std::strcmp(records[1].text, "ld iy, 0x0000") == 0);
+}
+
+static void test_decode_range() {
+    static const least_u8 image[] = {
+        0xfd, 0x36, 0xfe, 0x07,  // ld (iy - 2), 0x07
+        0x88,                    // adc a, b
+        0x20, 0xfc,              // jr nz, $ - 2
+        0xd3, 0xfe,              // out (0xfe), a
+        0x08 };                  // ex af, af'
+
+    z80::decoded_instr instrs[sizeof(image)];
+    my_decoder dec;
+    std::size_t n = dec.decode_range(image, sizeof(image), 0x0000,
+                                     instrs, sizeof(image));
+    CHECK(n == 5);
+
+    const z80::decoded_instr &ld = instrs[0];
+    CHECK(std::strcmp(ld.mnemonic, "ld") == 0);
+    CHECK(ld.num_of_operands == 2);
+    CHECK(ld.operands[0].kind == z80::operand_kind::reg);
+    CHECK(ld.operands[0].value == static_cast<unsigned>(z80::reg::at_hl));
+    CHECK(ld.operands[0].irp == z80::iregp::iy);
+    CHECK(ld.operands[0].disp == -2);
+    CHECK(ld.operands[1].kind == z80::operand_kind::imm8);
+    CHECK(ld.operands[1].value == 0x07);
+
+    const z80::decoded_instr &adc = instrs[1];
+    CHECK(std::strcmp(adc.mnemonic, "adc") == 0);
+    CHECK(adc.num_of_operands == 2);
+    CHECK(adc.operands[0].value == static_cast<unsigned>(z80::reg::a));
+    CHECK(adc.operands[1].value == static_cast<unsigned>(z80::reg::b));
+
+    const z80::decoded_instr &jr = instrs[2];
+    CHECK(std::strcmp(jr.mnemonic, "jr") == 0);
+    CHECK(jr.operands[0].kind == z80::operand_kind::condition);
+    CHECK(jr.operands[0].value ==
+              static_cast<unsigned>(z80::condition::nz));
+    CHECK(jr.operands[1].kind == z80::operand_kind::rel);
+    CHECK(jr.operands[1].value == 0x0003);
+    CHECK(jr.operands[1].disp == -2);
+
+    const z80::decoded_instr &out = instrs[3];
+    CHECK(out.operands[0].kind == z80::operand_kind::imm8);
+    CHECK(out.operands[0].indirect);
+    CHECK(out.operands[1].kind == z80::operand_kind::reg);
+
+    const z80::decoded_instr &ex = instrs[4];
+    CHECK(ex.operands[0].kind == z80::operand_kind::regp2);
+    CHECK(ex.operands[0].value == static_cast<unsigned>(z80::regp2::af));
+    CHECK(ex.operands[1].kind == z80::operand_kind::literal);
+    CHECK(std::strcmp(ex.operands[1].text, "af'") == 0);
+}
+
+int main() {
+    test_disasm_range();
+    test_decode_range();
+}
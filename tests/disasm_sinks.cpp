@@ -0,0 +1,136 @@
+
+#include <cstring>
+#include <string>
+
+#include "z80.h"
+
+#include "check.h"
+
+using z80::fast_u8;
+using z80::least_u8;
+
+template<typename S>
+class my_disasm : public z80::sink_disasm<z80::z80_disasm<my_disasm<S>>, S> {
+public:
+    fast_u8 on_read_next_byte() {
+        return code[index++];
+    }
+
+    bool on_peek_next_byte(fast_u8 &n) {
+        if(index == size)
+            return false;
+        n = code[index];
+        return true;
+    }
+
+    // Disassembles a list of instructions separating them with
+    // semicolons.
+    void disasm(S &sink, const least_u8 *code, std::size_t size) {
+        this->set_sink(&sink);
+        this->code = code;
+        this->size = size;
+        index = 0;
+        while(index < size) {
+            if(index != 0)
+                sink.write("; ");
+            this->on_disassemble();
+        }
+    }
+
+private:
+    const least_u8 *code = nullptr;
+    std::size_t size = 0;
+    std::size_t index = 0;
+};
+
+// Disassemblers that only read bytes, without looking ahead,
+// still take the instruction that follows a prefix.
+class plain_disasm : public z80::z80_disasm<plain_disasm> {
+public:
+    fast_u8 on_read_next_byte() {
+        return code[index++];
+    }
+
+    void on_emit(const char *out) {
+        text = out;
+    }
+
+    std::string disasm(const least_u8 *code, std::size_t *size) {
+        this->code = code;
+        index = 0;
+        on_disassemble();
+        *size = index;
+        return text;
+    }
+
+private:
+    const least_u8 *code = nullptr;
+    std::size_t index = 0;
+    std::string text;
+};
+
+static const least_u8 code[] = {
+    0xdd, 0x36, 0x05, 0x07,  // ld (ix + 5), 0x07
+    0xed, 0x44,              // neg
+    0x10, 0xfe };            // djnz $ + 0
+
+static const char text[] = "ld (ix + 5), 0x07; neg; djnz $ + 0";
+
+static void test_buff_sink() {
+    char buff[64];
+    z80::buff_sink sink(buff, sizeof(buff));
+    my_disasm<z80::buff_sink> dis;
+    dis.disasm(sink, code, sizeof(code));
+    CHECK(std::strcmp(sink.get_buff(), text) == 0);
+    CHECK(sink.get_size() == std::strlen(text));
+    CHECK(!sink.is_truncated());
+
+    // Output that does not fit is dropped.
+    char small_buff[10];
+    z80::buff_sink small_sink(small_buff, sizeof(small_buff));
+    dis.disasm(small_sink, code, sizeof(code));
+    CHECK(std::strcmp(small_sink.get_buff(), "ld (ix + ") == 0);
+    CHECK(small_sink.is_truncated());
+}
+
+static void test_string_sink() {
+    std::string str = "> ";
+    z80::string_sink<std::string> sink(str);
+    my_disasm<z80::string_sink<std::string>> dis;
+    dis.disasm(sink, code, sizeof(code));
+    CHECK(str == std::string("> ") + text);
+}
+
+static void test_file_sink() {
+    std::FILE *f = std::tmpfile();
+    CHECK(f != nullptr);
+    z80::file_sink sink(f);
+    my_disasm<z80::file_sink> dis;
+    dis.disasm(sink, code, sizeof(code));
+
+    char buff[64] = {};
+    std::rewind(f);
+    CHECK(std::fgets(buff, sizeof(buff), f) != nullptr);
+    CHECK(std::strcmp(buff, text) == 0);
+    std::fclose(f);
+}
+
+static void test_plain_disasm() {
+    plain_disasm dis;
+    std::size_t size;
+
+    static const least_u8 ld_ix[] = { 0xdd, 0x21, 0x34, 0x12 };
+    CHECK(dis.disasm(ld_ix, &size) == "ld ix, 0x1234");
+    CHECK(size == 4);
+
+    static const least_u8 ld_iy[] = { 0xdd, 0xfd, 0x21, 0x34, 0x12 };
+    CHECK(dis.disasm(ld_iy, &size) == "ld iy, 0x1234");
+    CHECK(size == 5);
+}
+
+int main() {
+    test_plain_disasm();
+    test_buff_sink();
+    test_string_sink();
+    test_file_sink();
+}
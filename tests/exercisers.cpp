@@ -0,0 +1,374 @@
+
+/*  Z80 CPU Emulator.
+    https://github.com/kosarev/z80
+
+    Copyright (c) 2017 Ivan Kosarev <ivan@kosarev.info>
+    Published under the MIT license.
+*/
+
+// Runs the zexall/zexdoc-like exercisers, e.g., zexall.com and
+// 8080exm.com, in parallel. The exercisers iterate over a
+// null-terminated table of test vectors, so every test is run on
+// its own machine patched to only see its table entry.
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "z80.h"
+
+namespace {
+
+using z80::fast_u8;
+using z80::fast_u16;
+using z80::least_u8;
+using z80::unused;
+
+#if defined(__GNUC__) || defined(__clang__)
+# define LIKE_PRINTF(format, args) \
+      __attribute__((__format__(__printf__, format, args)))
+#else
+# define LIKE_PRINTF(format, args) /* nothing */
+#endif
+
+const char program_name[] = "exercisers";
+
+[[noreturn]] LIKE_PRINTF(1, 0)
+void verror(const char *format, va_list args) {
+    std::fprintf(stderr, "%s: ", program_name);
+    std::vfprintf(stderr, format, args);
+    std::fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+[[noreturn]] LIKE_PRINTF(1, 2)
+void error(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    verror(format, args);
+    va_end(args);
+}
+
+static constexpr fast_u16 quit_addr = 0x0000;
+static constexpr fast_u16 bdos_addr = 0x0005;
+static constexpr fast_u16 entry_addr = 0x0100;
+
+// About twice as many instructions as the longest test of
+// zexall.com and 8080exm.com executes, so hanging tests fail
+// instead of running forever.
+static constexpr unsigned long long max_instrs_per_test = 5000000000;
+
+class program_image {
+public:
+    program_image() {}
+
+    void load(const char *filename) {
+        FILE *f = std::fopen(filename, "rb");
+        if(!f) {
+            error("Cannot open file '%s': %s", filename,
+                  std::strerror(errno));
+        }
+
+        size = std::fread(bytes + entry_addr, /* size= */ 1,
+                          z80::address_space_size - entry_addr, f);
+        if(ferror(f)) {
+            error("Cannot read file '%s': %s", filename,
+                  std::strerror(errno));
+        }
+        if(size == 0)
+            error("Program file '%s' is empty", filename);
+        if(!feof(f))
+            error("Program file '%s' is too large", filename);
+
+        if(std::fclose(f) != 0) {
+            error("Cannot close file '%s': %s", filename,
+                  std::strerror(errno));
+        }
+
+        find_test_table(filename);
+    }
+
+    const least_u8 *get_bytes() const { return bytes; }
+
+    fast_u16 get_table_addr() const { return table_addr; }
+    fast_u16 get_table_ptr_addr() const { return table_ptr_addr; }
+    fast_u16 get_loop_addr() const { return loop_addr; }
+    fast_u16 get_done_addr() const { return done_addr; }
+    unsigned get_num_of_tests() const { return num_of_tests; }
+
+private:
+    fast_u16 read16(fast_u16 addr) const {
+        return z80::make16(bytes[z80::inc16(addr)], bytes[addr]);
+    }
+
+    // The exercisers start with the following sequence:
+    //
+    //          ld hl, tests
+    //  loop:   ld a, (hl)
+    //          inc hl
+    //          or (hl)
+    //          jp z, done
+    void find_test_table(const char *filename) {
+        static const least_u8 pattern[] = {
+            0x21, 0x00, 0x00, 0x7e, 0x23, 0xb6, 0xca };
+        const std::size_t pattern_size = sizeof(pattern);
+
+        for(fast_u16 addr = entry_addr;
+                addr + pattern_size + 2 <= entry_addr + size; ++addr) {
+            bool matches = true;
+            for(std::size_t i = 0; i != pattern_size; ++i) {
+                if(i == 1 || i == 2)
+                    continue;  // The table address.
+                if(bytes[addr + i] != pattern[i]) {
+                    matches = false;
+                    break;
+                }
+            }
+            if(!matches)
+                continue;
+
+            table_ptr_addr = addr + 1;
+            table_addr = read16(table_ptr_addr);
+            loop_addr = addr + 3;
+            done_addr = read16(static_cast<fast_u16>(addr + pattern_size));
+
+            num_of_tests = 0;
+            while(read16(static_cast<fast_u16>(
+                      table_addr + num_of_tests * 2)) != 0)
+                ++num_of_tests;
+            return;
+        }
+
+        error("Cannot find the table of tests in '%s'", filename);
+    }
+
+    least_u8 bytes[z80::address_space_size] = {};
+    std::size_t size = 0;
+
+    fast_u16 table_addr = 0;
+    fast_u16 table_ptr_addr = 0;
+    fast_u16 loop_addr = 0;
+    fast_u16 done_addr = 0;
+    unsigned num_of_tests = 0;
+};
+
+struct test_result {
+    std::string output;
+    double seconds = 0;
+};
+
+template<typename B>
+class exerciser : public B {
+public:
+    typedef B base;
+
+    exerciser() {}
+
+    // The exercisers use no interrupts.
+    void on_set_is_int_disabled(bool f) { unused(f); }
+    void on_set_iff(bool f) { unused(f); }
+
+    bool on_dispatch_register_accesses() {
+        return false;
+    }
+
+    fast_u8 on_read(fast_u16 addr) {
+        assert(addr < z80::address_space_size);
+        return memory[addr];
+    }
+
+    void on_write(fast_u16 addr, fast_u8 n) {
+        assert(addr < z80::address_space_size);
+        memory[addr] = static_cast<least_u8>(n);
+    }
+
+    // Runs a single test of the table.
+    void run(const program_image &image, unsigned test_index,
+             test_result &result) {
+        std::memcpy(memory, image.get_bytes(), z80::address_space_size);
+        memory[bdos_addr] = 0xc9;  // ret
+
+        // Let the table start with the test of interest and
+        // terminate it right after that test.
+        fast_u16 table_addr = image.get_table_addr();
+        fast_u16 test_addr = static_cast<fast_u16>(table_addr +
+                                                   test_index * 2);
+        write16(image.get_table_ptr_addr(), test_addr);
+        write16(static_cast<fast_u16>(test_addr + 2), 0);
+
+        output = &result.output;
+        capturing = false;
+
+        auto start = std::chrono::steady_clock::now();
+
+        base::set_pc(entry_addr);
+        for(unsigned long long num_of_instrs = 0;; ++num_of_instrs) {
+            fast_u16 pc = base::get_pc();
+            if(pc == image.get_done_addr())
+                break;
+            if(pc == quit_addr) {
+                result.output += "unexpected program termination\n";
+                break;
+            }
+            if(num_of_instrs == max_instrs_per_test) {
+                result.output += "ERROR: too many instructions executed\n";
+                break;
+            }
+
+            // Only capture messages of the test itself.
+            if(pc == image.get_loop_addr())
+                capturing = true;
+            if(pc == bdos_addr && capturing)
+                handle_bdos_call();
+
+            self().on_step();
+        }
+
+        auto end = std::chrono::steady_clock::now();
+        result.seconds = std::chrono::duration<double>(end - start).count();
+    }
+
+protected:
+    using base::self;
+
+private:
+    void write16(fast_u16 addr, fast_u16 n) {
+        memory[addr] = static_cast<least_u8>(z80::get_low8(n));
+        memory[z80::inc16(addr)] = static_cast<least_u8>(z80::get_high8(n));
+    }
+
+    void write_char(fast_u8 c) {
+        if(c != '\r')
+            *output += static_cast<char>(c);
+    }
+
+    void handle_bdos_call() {
+        switch(base::get_c()) {
+        case c_write:
+            write_char(base::get_e());
+            break;
+        case c_writestr: {
+            fast_u16 addr = base::get_de();
+            for(;;) {
+                fast_u8 c = memory[addr];
+                if(c == '$')
+                    break;
+
+                write_char(c);
+                addr = z80::inc16(addr);
+            }
+            break; }
+        }
+    }
+
+    static constexpr fast_u8 c_write = 0x02;
+    static constexpr fast_u8 c_writestr = 0x09;
+
+    std::string *output = nullptr;
+    bool capturing = false;
+
+    least_u8 memory[z80::address_space_size] = {};
+};
+
+class i8080_exerciser : public exerciser<z80::i8080_cpu<i8080_exerciser>>
+{};
+
+class z80_exerciser : public exerciser<z80::z80_cpu<z80_exerciser>>
+{};
+
+template<typename E>
+void run_tests(const program_image &image, std::vector<test_result> &results,
+               unsigned num_of_threads) {
+    std::atomic<unsigned> next_test(0);
+
+    auto worker = [&]() {
+        // The machines are large enough to not be allocated on
+        // the stack.
+        std::vector<E> machines(1);
+        E &e = machines[0];
+        for(;;) {
+            unsigned i = next_test++;
+            if(i >= results.size())
+                break;
+            e.run(image, i, results[i]);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for(unsigned i = 0; i != num_of_threads; ++i)
+        threads.emplace_back(worker);
+    for(auto &t : threads)
+        t.join();
+}
+
+[[noreturn]] static void usage() {
+    error("exercisers {i8080|z80} <program.com> [<num-of-threads>]");
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+    if(argc != 3 && argc != 4)
+        usage();
+
+    const char *cpu = argv[1];
+    const char *program = argv[2];
+
+    unsigned num_of_threads = std::thread::hardware_concurrency();
+    if(argc == 4)
+        num_of_threads = static_cast<unsigned>(std::atoi(argv[3]));
+    if(num_of_threads == 0)
+        num_of_threads = 1;
+
+    std::vector<program_image> images(1);
+    program_image &image = images[0];
+    image.load(program);
+
+    std::vector<test_result> results(image.get_num_of_tests());
+
+    auto start = std::chrono::steady_clock::now();
+    if(std::strcmp(cpu, "i8080") == 0)
+        run_tests<i8080_exerciser>(image, results, num_of_threads);
+    else if(std::strcmp(cpu, "z80") == 0)
+        run_tests<z80_exerciser>(image, results, num_of_threads);
+    else
+        error("Unknown CPU '%s'", cpu);
+    auto end = std::chrono::steady_clock::now();
+
+    unsigned num_of_failures = 0;
+    double total_seconds = 0;
+    for(const test_result &r : results) {
+        // Strip trailing new lines.
+        std::string output = r.output;
+        while(!output.empty() && output.back() == '\n')
+            output.pop_back();
+
+        // Tests only pass if the exerciser reports so, which
+        // catches truncated and silent runs.
+        bool passed = output.find("  OK") != std::string::npos ||
+                      output.find("  PASS!") != std::string::npos;
+        bool failed = !passed ||
+                      output.find("ERROR") != std::string::npos ||
+                      output.find("unexpected") != std::string::npos;
+        if(failed)
+            ++num_of_failures;
+
+        std::printf("%s [%.2fs]\n", output.c_str(), r.seconds);
+        total_seconds += r.seconds;
+    }
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    std::printf("%u of %u tests failed; %.2fs with %u thread(s), "
+                "%.2fs sequentially\n",
+                num_of_failures, static_cast<unsigned>(results.size()),
+                seconds, num_of_threads, total_seconds);
+
+    return num_of_failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,80 @@
+
+#include <vector>
+
+#include "z80.h"
+
+#include "check.h"
+
+using z80::fast_u16;
+using z80::least_u8;
+
+class my_timer : public z80::instr_timer<z80::z80_cpu<my_timer>>
+{};
+
+class my_i8080_timer
+    : public z80::instr_timer<z80::i8080_cpu<my_i8080_timer>>
+{};
+
+// Returns the number of ticks the instruction takes when
+// execution continues at the specified address or zero if no
+// setup leads there.
+template<typename T>
+static unsigned get_ticks(T &t, std::vector<least_u8> code, fast_u16 addr,
+                          fast_u16 next_pc) {
+    z80::instr_timing timings[T::num_of_setups];
+    t.time_instr(code.data(), static_cast<unsigned>(code.size()), addr,
+                 timings);
+
+    unsigned ticks = 0;
+    for(const z80::instr_timing &timing : timings) {
+        if(timing.next_pc != next_pc)
+            continue;
+        CHECK(ticks == 0 || ticks == timing.ticks);
+        ticks = timing.ticks;
+    }
+    return ticks;
+}
+
+static void test_instr_timer() {
+    // The timers are too large to be allocated on the stack.
+    std::vector<my_timer> timers(1);
+    my_timer &t = timers[0];
+
+    CHECK(get_ticks(t, {0x00}, 0x100, 0x101) == 4);       // nop
+    CHECK(get_ticks(t, {0xdd, 0xe5}, 0x100, 0x102) == 15);  // push ix
+
+    // jr nz, $ + 4
+    CHECK(get_ticks(t, {0x20, 0x02}, 0x100, 0x102) == 7);
+    CHECK(get_ticks(t, {0x20, 0x02}, 0x100, 0x104) == 12);
+
+    // djnz $
+    CHECK(get_ticks(t, {0x10, 0xfe}, 0x100, 0x102) == 8);
+    CHECK(get_ticks(t, {0x10, 0xfe}, 0x100, 0x100) == 13);
+
+    // call z, 0x1234
+    CHECK(get_ticks(t, {0xcc, 0x34, 0x12}, 0x100, 0x103) == 10);
+    CHECK(get_ticks(t, {0xcc, 0x34, 0x12}, 0x100, 0x1234) == 17);
+
+    // ret c
+    CHECK(get_ticks(t, {0xd8}, 0x100, 0x101) == 5);
+
+    // ldir, cpir
+    CHECK(get_ticks(t, {0xed, 0xb0}, 0x100, 0x102) == 16);
+    CHECK(get_ticks(t, {0xed, 0xb0}, 0x100, 0x100) == 21);
+    CHECK(get_ticks(t, {0xed, 0xb1}, 0x100, 0x102) == 16);
+    CHECK(get_ticks(t, {0xed, 0xb1}, 0x100, 0x100) == 21);
+
+    // Wrapping around the end of the address space.
+    CHECK(get_ticks(t, {0xc3, 0x00, 0x00}, 0xfffe, 0x0000) == 10);
+
+    std::vector<my_i8080_timer> i8080_timers(1);
+    my_i8080_timer &i8080_t = i8080_timers[0];
+
+    // call z, 0x1234
+    CHECK(get_ticks(i8080_t, {0xcc, 0x34, 0x12}, 0x100, 0x103) == 11);
+    CHECK(get_ticks(i8080_t, {0xcc, 0x34, 0x12}, 0x100, 0x1234) == 17);
+}
+
+int main() {
+    test_instr_timer();
+}
@@ -6,12 +6,25 @@
     Published under the MIT license.
 */
 
+#include <atomic>
 #include <cerrno>
+#include <condition_variable>
 #include <cstdarg>
 #include <cstdio>
 #include <cstring>
 #include <map>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+# define HAVE_MMAP 1
+#endif
 
 #include "z80.h"
 
@@ -53,36 +66,99 @@ using z80::z80_variant;
 
 static const std::size_t max_line_size = 1024;
 
+// A section of the test file that can be processed
+// independently of other sections. Sections are delimited with
+// empty lines and are run in parallel. Errors are reported for
+// the first failing section in file order, so the output does
+// not depend on the scheduling.
+struct test_shard {
+    // The first line and the end of the section.
+    const char *begin = nullptr;
+    const char *end = nullptr;
+    unsigned long first_line_no = 0;
+
+    bool done = false;
+    bool failed = false;
+    std::string error_message;
+};
+
+std::mutex shards_mutex;
+std::condition_variable shards_cond;
+
+// The shard the current thread works on, if any.
+thread_local test_shard *current_shard = nullptr;
+
+// Reports an error and terminates the program or, if called on
+// a worker thread, records the error for the main thread to
+// report and parks the thread.
+[[noreturn]] void fail(const std::string &message) {
+    if(!current_shard) {
+        std::fputs(message.c_str(), stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    std::unique_lock<std::mutex> lock(shards_mutex);
+    current_shard->error_message = message;
+    current_shard->failed = true;
+    current_shard->done = true;
+    shards_cond.notify_all();
+
+    // The main thread terminates the process once all the
+    // preceding shards are done.
+    for(;;)
+        shards_cond.wait(lock);
+}
+
+LIKE_PRINTF(2, 0)
+void vappend(std::string &s, const char *format, va_list args) {
+    char buff[max_line_size * 2];
+    std::vsnprintf(buff, sizeof(buff), format, args);
+    s += buff;
+}
+
+LIKE_PRINTF(2, 3)
+void append(std::string &s, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vappend(s, format, args);
+    va_end(args);
+}
+
 class test_input {
 public:
-    test_input(FILE *stream)
-        : stream(stream), read(false), eof(false), line_no(0)
+    test_input(const test_shard &shard)
+        : p(shard.begin), end(shard.end), read(false), eof(false),
+          line_no(shard.first_line_no - 1)
     {}
 
     const char *read_line() {
-        const char *res = fgets(line, max_line_size, stream);
-        if(ferror(stream))
-            error("cannot read test input: %s", std::strerror(errno));
         read = true;
 
         if(!eof)
             ++line_no;
 
-        // Return empty string instead of null.
-        if(!res) {
+        // Return empty string at the end of input.
+        if(p == end) {
             eof = true;
             line[0] = '\0';
             return line;
         }
 
-        // Strip trailing new-line marker.
-        line[std::strlen(line) - 1] = '\0';
+        const char *nl = static_cast<const char*>(
+            std::memchr(p, '\n', static_cast<std::size_t>(end - p)));
+        const char *line_end = nl ? nl : end;
+        auto size = static_cast<std::size_t>(line_end - p);
+        if(size >= max_line_size)
+            error("line is too long");
+
+        std::memcpy(line, p, size);
+        line[size] = '\0';
+        p = nl ? nl + 1 : end;
         return line;
     }
 
     bool is_eof() const {
-        // Note that we cannot rely on feof() until we tried to read.
-        return read && feof(stream);
+        return eof;
     }
 
     explicit operator bool () const {
@@ -93,24 +169,34 @@ public:
         return line;
     }
 
-    void quote_line() const {
+    unsigned long get_line_no() const {
+        return line_no;
+    }
+
+    void quote_line(std::string &message) const {
         assert(read);
-        std::fprintf(stderr, "%s: line %lu: '%s'\n", program_name,
-                     static_cast<unsigned long>(line_no), line);
+        append(message, "%s: line %lu: '%s'\n", program_name,
+               static_cast<unsigned long>(line_no), line);
     }
 
     [[noreturn]] LIKE_PRINTF(2, 3)
     void error(const char *format, ...) const {
-        quote_line();
+        std::string message;
+        quote_line(message);
 
+        append(message, "%s: ", program_name);
         va_list args;
         va_start(args, format);
-        ::verror(format, args);
+        vappend(message, format, args);
         va_end(args);
+        message += "\n";
+
+        fail(message);
     }
 
 private:
-    FILE *stream;
+    const char *p;
+    const char *end;
     bool read;
     bool eof;
     unsigned long line_no;
@@ -150,10 +236,17 @@ private:
     unsigned size = 0;
 };
 
-class test_context {
-    using encodings_type = std::map<std::string, instr_encoding>;
+// Remembers where an instruction encoding was seen first.
+struct encoding_use {
+    instr_encoding encoding;
+    unsigned long line_no;
+    std::string line;
+};
 
+class test_context {
 public:
+    using encodings_type = std::map<std::string, encoding_use>;
+
     test_context(test_input &input) : input(input) {}
 
     test_input &get_input() { return input; }
@@ -250,6 +343,13 @@ public:
         return encoding[index++];
     }
 
+    bool on_peek_next_byte(fast_u8 &n) {
+        if(index == encoding.get_size())
+            return false;
+        n = encoding[index];
+        return true;
+    }
+
     unsigned get_num_consumed_bytes() const {
         return index;
     }
@@ -306,14 +406,6 @@ public:
         return does_depend_on_iregp_kind;
     }
 
-    void on_disassemble() {
-        base::on_disassemble();
-
-        // Do one more step if the previous opcode was a prefix.
-        if(base::get_iregp_kind() != z80::iregp::hl)
-            base::on_disassemble();
-    }
-
     void set_variant(z80_variant v, const test_input &input) {
         unused(&input);
         variant = v;
@@ -1062,9 +1154,10 @@ void handle_test_entry(test_context &context) {
         input.error("extra instruction bytes");
 
     auto &encodings = context.get_encodings();
-    auto i = encodings.insert({buff, encoding});
+    encoding_use use{encoding, input.get_line_no(), input.get_line()};
+    auto i = encodings.insert({buff, use});
     bool inserted = i.second;
-    const instr_encoding &prev_encoding = i.first->second;
+    const instr_encoding &prev_encoding = i.first->second.encoding;
     if(!inserted && prev_encoding != encoding)
         input.error("multiple encodings for same instruction");
 
@@ -1086,25 +1179,116 @@ cpu_kind get_cpu_kind(const char *id) {
     return cpu_kind::unknown;
 }
 
-}  // anonymous namespace
+// The contents of the test file, mapped into memory where
+// possible.
+class test_file {
+public:
+    test_file(const char *filename) : filename(filename) {}
 
-int main(int argc, char *argv[]) {
-    if(argc != 3)
-        error("usage: tester <cpu> <test-input>");
+    ~test_file() {
+#if HAVE_MMAP
+        if(mapped && munmap(mapped, size) != 0)
+            error("cannot unmap test input '%s': %s", filename,
+                  std::strerror(errno));
+#endif
+    }
 
-    const char *cpu_id = argv[1];
-    cpu_kind cpu = get_cpu_kind(cpu_id);
-    if(cpu == cpu_kind::unknown)
-        error("unknown cpu '%s'", cpu_id);
+    void load() {
+#if HAVE_MMAP
+        int fd = open(filename, O_RDONLY);
+        if(fd < 0) {
+            error("cannot open test input '%s': %s", filename,
+                  std::strerror(errno));
+        }
 
-    const char *filename = argv[2];
-    FILE *f = fopen(filename, "r");
-    if(!f) {
-        error("cannot open test input '%s': %s", filename,
-              std::strerror(errno));
+        struct stat st;
+        if(fstat(fd, &st) != 0) {
+            error("cannot stat test input '%s': %s", filename,
+                  std::strerror(errno));
+        }
+
+        // Empty files cannot be mapped.
+        size = static_cast<std::size_t>(st.st_size);
+        if(size > 0) {
+            mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(mapped == MAP_FAILED) {
+                error("cannot map test input '%s': %s", filename,
+                      std::strerror(errno));
+            }
+            data = static_cast<const char*>(mapped);
+        }
+
+        if(close(fd) != 0) {
+            error("cannot close test input '%s': %s", filename,
+                  std::strerror(errno));
+        }
+#else
+        FILE *f = fopen(filename, "rb");
+        if(!f) {
+            error("cannot open test input '%s': %s", filename,
+                  std::strerror(errno));
+        }
+
+        char buff[4096];
+        std::size_t n;
+        while((n = fread(buff, 1, sizeof(buff), f)) != 0)
+            contents.append(buff, n);
+        if(ferror(f))
+            error("cannot read test input: %s", std::strerror(errno));
+
+        if(fclose(f) != 0) {
+            error("cannot close test input '%s': %s", filename,
+                  std::strerror(errno));
+        }
+
+        data = contents.data();
+        size = contents.size();
+#endif
     }
 
-    test_input input(f);
+    const char *get_data() const { return data; }
+    std::size_t get_size() const { return size; }
+
+private:
+    const char *filename;
+    const char *data = "";
+    std::size_t size = 0;
+
+#if HAVE_MMAP
+    void *mapped = nullptr;
+#else
+    std::string contents;
+#endif
+};
+
+// Splits the input at empty lines.
+std::vector<test_shard> split_to_shards(const char *data, std::size_t size) {
+    std::vector<test_shard> shards;
+    const char *end = data + size;
+    const char *p = data;
+    unsigned long line_no = 1;
+    while(p != end) {
+        test_shard shard;
+        shard.begin = p;
+        shard.first_line_no = line_no;
+        for(;;) {
+            const char *nl = static_cast<const char*>(
+                std::memchr(p, '\n', static_cast<std::size_t>(end - p)));
+            bool is_empty = (p == nl);
+            p = nl ? nl + 1 : end;
+            ++line_no;
+            if(is_empty || p == end)
+                break;
+        }
+        shard.end = p;
+        shards.push_back(shard);
+    }
+    return shards;
+}
+
+void run_shard(cpu_kind cpu, test_shard &shard,
+               test_context::encodings_type &encodings) {
+    test_input input(shard);
     test_context context(input);
 
     input.read_line();
@@ -1130,7 +1314,80 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    if(fclose(f) != 0)
-        error("cannot close test input '%s': %s", argv[1],
-              std::strerror(errno));
+    encodings = std::move(context.get_encodings());
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+    if(argc != 3)
+        error("usage: tester <cpu> <test-input>");
+
+    const char *cpu_id = argv[1];
+    cpu_kind cpu = get_cpu_kind(cpu_id);
+    if(cpu == cpu_kind::unknown)
+        error("unknown cpu '%s'", cpu_id);
+
+    const char *filename = argv[2];
+    test_file file(filename);
+    file.load();
+
+    std::vector<test_shard> shards = split_to_shards(file.get_data(),
+                                                     file.get_size());
+    std::vector<test_context::encodings_type> encodings(shards.size());
+
+    std::atomic<std::size_t> next_shard(0);
+    auto worker = [&]() {
+        for(;;) {
+            std::size_t i = next_shard++;
+            if(i >= shards.size())
+                break;
+
+            current_shard = &shards[i];
+            run_shard(cpu, shards[i], encodings[i]);
+            current_shard = nullptr;
+
+            std::lock_guard<std::mutex> lock(shards_mutex);
+            shards[i].done = true;
+            shards_cond.notify_all();
+        }
+    };
+
+    unsigned num_of_threads = std::thread::hardware_concurrency();
+    if(num_of_threads == 0)
+        num_of_threads = 1;
+    std::vector<std::thread> threads;
+    for(unsigned i = 0; i != num_of_threads; ++i)
+        threads.emplace_back(worker);
+
+    // Report the first failure in file order.
+    for(test_shard &shard : shards) {
+        std::unique_lock<std::mutex> lock(shards_mutex);
+        shards_cond.wait(lock, [&]() { return shard.done; });
+        if(shard.failed) {
+            std::fputs(shard.error_message.c_str(), stderr);
+            std::fflush(stderr);
+            std::_Exit(EXIT_FAILURE);
+        }
+    }
+
+    for(std::thread &t : threads)
+        t.join();
+
+    // Make sure every instruction has a single encoding across
+    // all shards.
+    test_context::encodings_type all_encodings;
+    for(const auto &shard_encodings : encodings) {
+        for(const auto &e : shard_encodings) {
+            auto i = all_encodings.insert(e);
+            bool inserted = i.second;
+            const encoding_use &prev = i.first->second;
+            if(!inserted && prev.encoding != e.second.encoding) {
+                const encoding_use &use = e.second;
+                error("line %lu: '%s'\n%s: multiple encodings for same "
+                      "instruction", use.line_no, use.line.c_str(),
+                      program_name);
+            }
+        }
+    }
 }
@@ -1,9 +1,38 @@
 # -*- coding: utf-8 -*-
 
+import asyncio
+import concurrent.futures
+import copy
+import gc
 import os
+import pickle
+import tempfile
+import threading
+import weakref
 import z80
 import unittest
 
+try:
+    import _interpreters
+except ImportError:
+    _interpreters = None
+
+
+# Copies input from port 0x10 to port 0x20 in a loop. Runs on
+# both Z80 and i8080 machines.
+_IO_LOOP = (b'\xdb\x10'  # in a, (0x10)
+            b'\xd3\x20'  # out (0x20), a
+            b'\xc3\x00\x00')  # jp 0x0000
+
+
+def _make_io_loop_machine(input, output=None, type=z80.Z80Machine):
+    m = type()
+    m.set_memory_block(0, _IO_LOOP)
+    m.set_input_callback(input)
+    if output:
+        m.set_output_callback(output)
+    return m
+
 
 class TestInstrBuilder(unittest.TestCase):
     def __str__(self):
@@ -16,6 +45,9 @@ class TestInstrBuilder(unittest.TestCase):
             (b'\xfd\xe1', 'pop iy'),
             (b'\xed\x50', 'in d, (c)'),
             (b'\xed\xa3', 'outi'),
+            (b'\xdd\x36\xfb\x07', 'ld (ix - 0x5), 0x7'),
+            (b'\xd3\xfe', 'out (0xfe), a'),
+            (b'\x18\xfe', 'jr 0x0'),
             )
 
         builder = z80.Z80InstrBuilder()
@@ -26,6 +58,715 @@ class TestInstrBuilder(unittest.TestCase):
 
             self.assertEqual(str(instr), text)
 
+        # Instructions built for the same bytes are shared, except
+        # relative forms at different addresses.
+        builder = z80.Z80InstrBuilder()
+        push = builder.get_instr(0, b'\xdd\xe5')
+        self.assertIs(builder.get_instr(0x1234, b'\xdd\xe5\x00'), push)
+        self.assertIsNone(push.addr)
+        self.assertEqual(str(builder.get_instr(0x10, b'\x18\xfe')), 'jr 0x10')
+        self.assertEqual(str(builder.get_instr(0x20, b'\x18\xfe')), 'jr 0x20')
+        self.assertIs(builder.get_instr(0x20, b'\x18\xfe'),
+                      builder.get_instr(0x20, b'\x18\xfe'))
+        self.assertEqual((builder.cache_hits, builder.cache_misses), (3, 3))
+
+        builder.clear_cache()
+        self.assertIsNot(builder.get_instr(0, b'\xdd\xe5'), push)
+        self.assertEqual((builder.cache_hits, builder.cache_misses), (0, 1))
+
+        # Cached instructions are not decoded again.
+        self.assertEqual(z80.Z80Machine._instr_size(b'\xdd\xe5\x00'), 2)
+        self.assertEqual(z80.Z80Machine._instr_size(b''), 0)
+        decode = z80.Z80Machine._decode
+        decoded = []
+
+        def count_decodes(image, addr):
+            decoded.append(addr)
+            return decode(image, addr)
+
+        z80.Z80Machine._decode = staticmethod(count_decodes)
+        try:
+            builder.get_instr(0x1234, b'\xdd\xe5\x00')
+            builder.get_instr(0x20, b'\x18\xfe')
+            builder.get_instr(0x20, b'\x18\xfe')
+        finally:
+            del z80.Z80Machine._decode
+        self.assertEqual(decoded, [0x20])
+
+
+class TestDisasmRange(unittest.TestCase):
+    def __str__(self):
+        return 'DisasmRange'
+
+    def runTest(self):
+        image = (b'\xdd\x21\x00\x80'  # ld ix, 0x8000
+                 b'\xdd\x36\x05\x07'  # ld (ix + 5), 7
+                 b'\xcb\x30'  # sll b
+                 b'\xed\xb0'  # ldir
+                 b'\x18\xfe'  # jr $
+                 b'\xcd')  # call, truncated
+
+        for machine in (z80.I8080Machine, z80.Z80Machine):
+            records = machine._disasm_range(image, 0xfffe)
+
+            # Should match disassembling the instructions one by one.
+            offset = 0
+            for addr, size, text in records:
+                self.assertEqual(addr, (0xfffe + offset) & 0xffff)
+                self.assertEqual((text, size),
+                                 machine._disasm(image[offset:offset + 4]))
+                offset += size
+
+            self.assertGreaterEqual(offset, len(image))
+
+        # A prefix followed by another prefix or the end of the
+        # image is disassembled on its own.
+        self.assertEqual(
+            z80.Z80Machine._disasm_range(b'\xdd\xfd\x21\x00\x00'),
+            [(0, 1, 'noni'), (1, 4, 'ld Piy, W0x0000')])
+        self.assertEqual(z80.Z80Machine._disasm(b'\xfd'), ('noni', 1))
+
+
+class TestParallelTracing(unittest.TestCase):
+    def __str__(self):
+        return 'ParallelTracing'
+
+    def runTest(self):
+        image = (b'\xcd\x0a\x00'  # call 0x000a
+                 b'\x28\x02'  # jr z, 0x0007
+                 b'\xc3\x0c\x00'  # jp 0x000c
+                 b'\xff'  # rst 0x38
+                 b'\x00'  # nop
+                 b'\xc9'  # ret
+                 b'\x00'  # data
+                 b'\xdd\xe9'  # jp (ix)
+                 b'\x00')  # data
+        defined = b'\x01' * len(image)
+
+        jobs = [(image, defined, [0x00]),
+                (image, defined, [0x03, 0x0c]),
+                (image, defined, []),
+                (image[:5], defined[:5], [0x0b, 0x00, 0x0b])]
+        expected = [z80.Z80Machine._trace_code(*job) for job in jobs]
+
+        # Results should not depend on the number of threads.
+        for num_threads in (0, 1, 2, 8):
+            self.assertEqual(z80.Z80Machine._trace_images(jobs, num_threads),
+                             expected)
+
+
+class TestStateAccess(unittest.TestCase):
+    def __str__(self):
+        return 'StateAccess'
+
+    def runTest(self):
+        m = z80.Z80Machine()
+
+        # Memory is exposed as a writable buffer.
+        memory = memoryview(m)
+        self.assertEqual((memory.nbytes, memory.readonly), (0x10000, False))
+        memory[0x1234] = 0x56
+        self.assertEqual(m.memory[0x1234], 0x56)
+        m.set_memory_block(0xfffe, b'\x01\x02')
+        self.assertEqual(bytes(memory[-2:]), b'\x01\x02')
+
+        m.bc = 0x1234
+        self.assertEqual((m.b, m.c), (0x12, 0x34))
+        m.a, m.f = 0x56, 0x78
+        self.assertEqual(m.af, 0x5678)
+        m.ix, m.alt_hl = 0x9abc, 0xdef0
+        self.assertEqual((m.ix, m.alt_hl), (0x9abc, 0xdef0))
+        m.ticks_to_stop = 0x12345678
+        self.assertEqual(m.ticks_to_stop, 0x12345678)
+        self.assertIs(m.index_rp_kind, z80.HL)
+
+        with self.assertRaises(ValueError):
+            m.a = 0x100
+        with self.assertRaises(ValueError):
+            m.pc = 0x10000
+
+        # The state is the one the emulator works with.
+        m.pc = 0x1234
+        m.ticks_to_stop = 1
+        m.run()
+        self.assertEqual((m.pc, m.a), (0x1235, 0x56))
+
+        i8080 = z80.I8080Machine()
+        i8080.hl = 0x1234
+        self.assertEqual((i8080.h, i8080.l), (0x12, 0x34))
+
+
+class TestSnapshots(unittest.TestCase):
+    def __str__(self):
+        return 'Snapshots'
+
+    def runTest(self):
+        m = z80.Z80Machine()
+        m.set_memory_block(0, b'\x3c'  # inc a
+                              b'\x18\xfd')  # jr 0x0000
+        m.set_breakpoint(0x0003)
+        m.ticks_to_stop = 1000
+        m.run()
+        m.name = 'test'
+
+        snapshot = m.snapshot()
+        for c in (copy.copy(m), pickle.loads(pickle.dumps(m))):
+            self.assertIsInstance(c, z80.Z80Machine)
+            self.assertEqual(c.snapshot(), snapshot)
+            self.assertEqual((c.a, c.pc, c.name), (m.a, m.pc, 'test'))
+
+        # Restored machines continue the same way.
+        m.ticks_to_stop = 100 * 1000
+        result = m.run(), m.a, m.pc
+        m.restore(snapshot)
+        m.ticks_to_stop = 100 * 1000
+        self.assertEqual((m.run(), m.a, m.pc), result)
+
+        # The breakpoint is restored as well.
+        m.restore(snapshot)
+        m.pc = 0x0001
+        m.set_memory_block(0x0001, b'\x00\x00')
+        self.assertEqual(m.run(), m._BREAKPOINT_HIT)
+
+        with self.assertRaises(ValueError):
+            z80.I8080Machine().restore(snapshot)
+
+
+class TestThreadedRun(unittest.TestCase):
+    def __str__(self):
+        return 'ThreadedRun'
+
+    def runTest(self):
+        def run(m, outputs):
+            for _ in range(3):
+                m.run()
+
+        # Machines in different threads run independently and
+        # call their own callbacks.
+        machines = []
+        for i in range(4):
+            outputs = []
+            m = _make_io_loop_machine(
+                lambda addr, i=i: i,
+                lambda addr, value, outputs=outputs: outputs.append(value))
+            machines.append((m, outputs))
+
+        threads = [threading.Thread(target=run, args=job) for job in machines]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+
+        for i, (m, outputs) in enumerate(machines):
+            self.assertTrue(outputs)
+            self.assertEqual(set(outputs), {i})
+
+        # Exceptions raised by callbacks stop the machine.
+        m, outputs = machines[0]
+
+        def fail(addr, value):
+            raise KeyError(value)
+
+        m.set_output_callback(fail)
+        with self.assertRaises(KeyError):
+            m.run()
+        self.assertEqual(m.pc, 0x0004)
+
+        # Machines cannot be run from their callbacks.
+        m.set_input_callback(lambda addr: m.run())
+        with self.assertRaises(RuntimeError):
+            m.run()
+
+        # Memory of machines running in other threads cannot be
+        # exported.
+        m = z80.Z80Machine()
+        m.set_memory_block(0, b'\xdb\x10'  # in a, (0x10)
+                              b'\x18\xfe')  # jr $
+        started = threading.Event()
+        m.set_input_callback(lambda addr: started.set() or 0)
+        t = threading.Thread(target=z80.run_machines,
+                             args=([m], 1 << 31))
+        t.start()
+        started.wait()
+        with self.assertRaises(RuntimeError):
+            while True:
+                m.pc
+        with self.assertRaises(RuntimeError):
+            memoryview(m)
+        with self.assertRaises(RuntimeError):
+            m.memory
+        m.request_stop()
+        t.join()
+        self.assertEqual(m.memory[0], 0xdb)
+
+
+class TestRunMachines(unittest.TestCase):
+    def __str__(self):
+        return 'RunMachines'
+
+    def runTest(self):
+        types = [z80.Z80Machine, z80.I8080Machine, z80.Z80Machine]
+        outputs = [set() for _ in types]
+        machines = [
+            _make_io_loop_machine(
+                lambda port, i=i: i,
+                lambda port, value, i=i: outputs[i].add(value),
+                type)
+            for i, type in enumerate(types)]
+
+        # Machines run for the given number of ticks, across
+        # frames.
+        events = (z80.Z80Machine._END_OF_FRAME |
+                  z80.Z80Machine._TICKS_LIMIT_HIT)
+        for num_threads in (0, 1, 2):
+            self.assertEqual(z80.run_machines(machines, 250 * 1000,
+                                              num_threads),
+                             [events] * len(machines))
+        self.assertEqual(outputs, [{0}, {1}, {2}])
+
+        with self.assertRaises(RuntimeError):
+            z80.run_machines([machines[0], machines[0]], 100)
+
+        def fail(port, value):
+            raise KeyError(value)
+
+        machines[1].set_output_callback(fail)
+        with self.assertRaises(KeyError):
+            z80.run_machines(machines, 100)
+
+        with self.assertRaises(TypeError):
+            z80.run_machines([object()], 100)
+
+        # Machines dropped from the list while running are kept
+        # alive until the end of the run.
+        def drop(port):
+            machines.clear()
+            gc.collect()
+            return 0
+
+        machines = [_make_io_loop_machine(drop) for _ in range(3)]
+        self.assertEqual(len(z80.run_machines(machines, 1000, 1)), 3)
+
+
+class TestModuleState(unittest.TestCase):
+    def __str__(self):
+        return 'ModuleState'
+
+    def runTest(self):
+        # Machines referenced by their callbacks are collected.
+        m = z80.Z80Machine()
+        m.set_input_callback(lambda addr: m.a)
+        ref = weakref.ref(m)
+        del m
+        gc.collect()
+        self.assertIsNone(ref())
+
+        # Callbacks can access the state of the running machine.
+        outputs = []
+        m = _make_io_loop_machine(
+            lambda addr: m.a + 1,
+            lambda addr, value: outputs.append(value))
+        m.a = 5
+        m.ticks_to_stop = 100
+        m.run()
+        self.assertEqual(outputs[:3], [6, 7, 8])
+
+
+@unittest.skipUnless(_interpreters, 'no _interpreters module')
+class TestSubInterpreters(unittest.TestCase):
+    def __str__(self):
+        return 'SubInterpreters'
+
+    def runTest(self):
+        # The module can be imported in isolated sub-interpreters.
+        script = """if 1:
+            import z80
+            m = z80.Z80Machine()
+            m.set_memory_block(0, %r)
+            outputs = []
+            m.set_input_callback(lambda addr: 7)
+            m.set_output_callback(lambda addr, value: outputs.append(value))
+            z80.run_machines([m], 100, 2)
+            assert set(outputs) == {7}
+            """ % _IO_LOOP
+
+        interp = _interpreters.create('isolated')
+        try:
+            self.assertIsNone(_interpreters.exec(interp, script))
+        finally:
+            _interpreters.destroy(interp)
+
+
+class TestAsyncRun(unittest.TestCase):
+    def __str__(self):
+        return 'AsyncRun'
+
+    def runTest(self):
+        # Stop requests stop runs after the current instruction
+        # and have no effect on machines that are not running.
+        m = _make_io_loop_machine(lambda addr: 0)
+        m.request_stop()
+        self.assertEqual(m.run(steps=1), m._STEPS_DONE)
+        self.assertEqual(m.pc, 0x0002)
+
+        m.set_input_callback(lambda addr: m.request_stop() or 0)
+        self.assertEqual(m.run(), m._STOP_REQUESTED)
+        self.assertEqual(m.pc, 0x0002)
+
+        # Machines run concurrently with the event loop.
+        async def run_session(m, ticks):
+            events = 0
+            while not events & m._TICKS_LIMIT_HIT:
+                events = await m.run_async(ticks=ticks)
+                ticks = None
+            return m.a
+
+        def make_machine(value):
+            return _make_io_loop_machine(lambda addr: value)
+
+        async def run_sessions():
+            machines = [make_machine(i) for i in range(4)]
+            return await asyncio.gather(
+                *(run_session(m, 250 * 1000) for m in machines))
+
+        self.assertEqual(asyncio.run(run_sessions()), [0, 1, 2, 3])
+
+        # Cancelling the awaiting task stops the machine.
+        async def cancel_session():
+            m = make_machine(0)
+            task = asyncio.ensure_future(run_session(m, 0))
+            await asyncio.sleep(0.01)
+            task.cancel()
+            with self.assertRaises(asyncio.CancelledError):
+                await task
+            return m.run(steps=1)
+
+        self.assertEqual(asyncio.run(cancel_session()), m._STEPS_DONE)
+
+        # Runs cancelled while queued on the executor do not start.
+        async def cancel_queued_session(executor, blocker):
+            m = make_machine(0)
+            task = asyncio.ensure_future(m.run_async(ticks=1000,
+                                                     executor=executor))
+            await asyncio.sleep(0.01)
+            task.cancel()
+            await asyncio.sleep(0.01)
+            blocker.set()
+            with self.assertRaises(asyncio.CancelledError):
+                await task
+            return m.pc
+
+        with concurrent.futures.ThreadPoolExecutor(1) as executor:
+            blocker = threading.Event()
+            executor.submit(blocker.wait)
+            self.assertEqual(
+                asyncio.run(cancel_queued_session(executor, blocker)), 0)
+
+
+class TestTracing(unittest.TestCase):
+    def __str__(self):
+        return 'Tracing'
+
+    def runTest(self):
+        code = (b'\x06\x03'  # ld b, 3
+                b'\x05'  # loop: dec b
+                b'\x20\xfd'  # jr nz, loop
+                b'\x00'  # nop
+                b'\x18\xfe')  # jr $
+
+        # Only instructions within the ranges are traced. The
+        # ring buffer keeps the latest records.
+        m = z80.Z80Machine()
+        m.set_memory_block(0, code)
+        with tempfile.TemporaryFile() as f:
+            m.start_tracing(pc_ranges=[(0x0002, 0x0005)], fd=f,
+                            ring_size=4)
+            m.run(steps=10)
+            self.assertEqual(m.trace_count, 6)
+            self.assertEqual(
+                [(pc, bc) for pc, sp, af, bc, *_ in m.get_trace()],
+                [(0x0002, 0x0200), (0x0003, 0x0100),
+                 (0x0002, 0x0100), (0x0003, 0x0000)])
+            m.stop_tracing()
+            self.assertIsNone(m.trace_buffer)
+
+            f.seek(0)
+            lines = f.read().decode().splitlines()
+            self.assertEqual(len(lines), 6)
+            self.assertEqual(lines[0], 'PC=0002 SP=0000 BC=0300 DE=0000 '
+                                       'HL=0000 AF=0002 0520fd00')
+
+        # Opcode and register filters.
+        m.pc = 0x0000
+        m.start_tracing(opcodes=[0x05], regs={'b': (0x02, 0xfe)},
+                        ring_size=8)
+        m.run(steps=10)
+        self.assertEqual([(pc, bc) for pc, sp, af, bc, *_ in m.get_trace()],
+                         [(0x0002, 0x0300), (0x0002, 0x0200)])
+
+        # Prefixed opcodes include the next byte.
+        m.set_memory_block(0, b'\xed\x44'  # neg
+                              b'\xed\x56'  # im 1
+                              b'\x00')  # nop
+        m.pc = 0x0000
+        m.start_tracing(opcodes=[0xed44, 0x00], ring_size=8)
+        m.run(steps=3)
+        self.assertEqual([r[0] for r in m.get_trace()], [0x0000, 0x0004])
+
+        # Failing to write lines does not stop ring tracing.
+        fd = os.open(os.devnull, os.O_RDONLY)
+        try:
+            m.pc = 0x0000
+            m.start_tracing(fd=fd, ring_size=8)
+            with self.assertRaises(OSError):
+                m.run(steps=200)
+            self.assertEqual(m.trace_count, 200)
+            self.assertEqual(len(m.get_trace()), 8)
+            with self.assertRaises(OSError):
+                m.stop_tracing()
+        finally:
+            os.close(fd)
+
+        with self.assertRaises(ValueError):
+            m.start_tracing(regs={'xyz': 0}, ring_size=1)
+        with self.assertRaises(ValueError):
+            m.start_tracing()
+
+
+class TestWatchedAccesses(unittest.TestCase):
+    def __str__(self):
+        return 'WatchedAccesses'
+
+    def runTest(self):
+        code = (b'\x3a\x00\x40'  # ld a, (0x4000)
+                b'\x3c'  # inc a
+                b'\x32\x01\x40'  # ld (0x4001), a
+                b'\x18\xf7')  # jr 0x0000
+
+        # Callbacks model memory-mapped registers: values they
+        # return replace the values read and written.
+        m = z80.Z80Machine()
+        m.set_memory_block(0, code)
+        m.mark_addrs(0x4000, 2, m._READ_MARK | m._WRITE_MARK)
+        m.mark_addr(0x0003, m._EXEC_MARK)
+
+        accesses = []
+
+        def on_access(addr, value, kind):
+            accesses.append((addr, value, kind))
+            if kind == m._READ_MARK and addr == 0x4000:
+                return 0x10
+            if kind == m._WRITE_MARK:
+                return value + 1
+            return None
+
+        m.set_watch_callback(on_access)
+        m.run(steps=3)
+        self.assertEqual(accesses, [(0x4000, 0x00, m._READ_MARK),
+                                    (0x0003, 0x3c, m._EXEC_MARK),
+                                    (0x4001, 0x11, m._WRITE_MARK)])
+        self.assertEqual(m.a, 0x11)
+        self.assertEqual(m.memory[0x4001], 0x12)
+
+        # Unmarked addresses are not watched. Watched reads
+        # include instruction fetches.
+        del accesses[:]
+        m.unmark_addrs(0x4000, 2, m._READ_MARK)
+        m.unmark_addr(0x0003, m._EXEC_MARK)
+        m.mark_addr(0x0003, m._READ_MARK)
+        m.pc = 0x0000
+        m.run(steps=2)
+        self.assertEqual(accesses, [(0x0003, 0x3c, m._READ_MARK)])
+        m.unmark_addr(0x0003, m._READ_MARK)
+        m.mark_addr(0x4000, m._READ_MARK)
+
+        # Without a callback, watched accesses stop runs after
+        # the instruction.
+        m.set_watch_callback(None)
+        m.set_memory_block(0, code)
+        m.pc = 0x0000
+        self.assertEqual(m.run(), m._ADDR_ACCESSED)
+        self.assertEqual(m.pc, 0x0003)
+        self.assertEqual(m.watch_hit, (0x4000, 0x00, m._READ_MARK))
+
+        self.assertEqual(m.run(), m._ADDR_ACCESSED)
+        self.assertEqual(m.pc, 0x0007)
+        self.assertEqual(m.watch_hit, (0x4001, 0x01, m._WRITE_MARK))
+
+        # Marks are restored from snapshots.
+        m2 = copy.copy(m)
+        m2.pc = 0x0000
+        self.assertEqual(m2.run(), m._ADDR_ACCESSED)
+
+        # Exceptions raised by callbacks stop the machine.
+        def fail(addr, value, kind):
+            raise KeyError(addr)
+
+        m.set_watch_callback(fail)
+        with self.assertRaises(KeyError):
+            m.run()
+
+
+class TestBatchedIO(unittest.TestCase):
+    def __str__(self):
+        return 'BatchedIO'
+
+    def runTest(self):
+        m = z80.Z80Machine()
+        m.set_memory_block(0, b'\xdb\x10'  # in a, (0x10)
+                              b'\xd3\x20'  # out (0x20), a
+                              b'\x18\xfa')  # jr 0x0000
+
+        misses = []
+
+        def on_input(port):
+            misses.append(port)
+            return 0x77
+
+        m.set_input_callback(on_input)
+        m.set_output_callback(lambda port, value: self.fail())
+
+        # Queued values come first, then the value set for the
+        # port. Python is only called when there are none.
+        m.a = 0x10
+        m.queue_port_input(0x1010, b'\x10\x03')
+        m.set_port_input(0x0310, 0x03)
+        m.set_output_queuing(True)
+
+        m.ticks_to_stop = 34 * 4
+        m.run()
+        outputs = m.take_queued_outputs()
+        self.assertEqual([value for _, _, value in outputs],
+                         [0x10, 0x03, 0x03, 0x03])
+        self.assertEqual([port for _, port, _ in outputs],
+                         [0x1020, 0x0320, 0x0320, 0x0320])
+        self.assertEqual([ticks for ticks, _, _ in outputs],
+                         [22, 56, 90, 124])
+        self.assertEqual(misses, [])
+        self.assertEqual(m.take_queued_outputs(), [])
+
+        m.set_port_input(0x0310, None)
+        m.ticks_to_stop = 34
+        m.run()
+        self.assertEqual(misses, [0x0310])
+        self.assertEqual(m.take_queued_outputs(), [(158, 0x7720, 0x77)])
+
+        with self.assertRaises(ValueError):
+            m.set_port_input(0x0310, 0x100)
+
+
+class TestStopConditions(unittest.TestCase):
+    def __str__(self):
+        return 'StopConditions'
+
+    def runTest(self):
+        m = z80.Z80Machine()
+        m.set_memory_block(0, b'\x31\x00\x80'  # ld sp, 0x8000
+                              b'\xcd\x09\x00'  # call 0x0009
+                              b'\xd3\x20'  # out (0x20), a
+                              b'\x76'  # halt
+                              b'\x00'  # 0x0009  nop
+                              b'\xc9')  # ret
+
+        self.assertEqual(m.run(steps=1), m._STEPS_DONE)
+        self.assertEqual(m.pc, 0x0003)
+
+        # Step over the call.
+        self.assertEqual(m.run(steps=1, step_over=True), m._STEPS_DONE)
+        self.assertEqual(m.pc, 0x0006)
+
+        m.pc = 0x0003
+        self.assertEqual(m.run(stop_at=[0x0009, 0x000a]), m._PC_REACHED)
+        self.assertEqual(m.pc, 0x0009)
+
+        self.assertEqual(m.run(finish=True), m._ROUTINE_FINISHED)
+        self.assertEqual(m.pc, 0x0006)
+
+        self.assertEqual(m.run(stop_on_ports=[0x20]), m._PORT_ACCESSED)
+        self.assertEqual(m.pc, 0x0008)
+
+        # Conditions only apply to the run they are specified for.
+        m.pc = 0x0003
+        m.ticks_to_stop = 100
+        self.assertEqual(m.run(), m._TICKS_LIMIT_HIT)
+
+        with self.assertRaises(ValueError):
+            m.run(steps=0)
+
+
+class TestTimingAnalyser(unittest.TestCase):
+    def __str__(self):
+        return 'TimingAnalyser'
+
+    def runTest(self):
+        image = (b'\x0e\x02'  # 0x00  ld c, 2
+                 b'\x06\x03'  # 0x02  ld b, 3
+                 b'\xcd\x0c\x00'  # 0x04  call 0x000c
+                 b'\x10\xfb'  # 0x07  djnz 0x0004
+                 b'\x0d'  # 0x09  dec c
+                 b'\x20\xf6'  # 0x0a  jr nz, 0x0002
+                 b'\xc8'  # 0x0c  ret z
+                 b'\xed\xb0'  # 0x0d  ldir
+                 b'\xc9')  # 0x0f  ret
+
+        a = z80.TimingAnalyser(image, loop_bounds={0x07: (3, 3),
+                                                   0x02: 2,
+                                                   0x0d: 4})
+        sub = a.analyse(0x0c)
+        self.assertEqual((sub.best, sub.worst), (11, 5 + 3 * 21 + 16 + 10))
+
+        # The routine at 0x0000 falls through to 0x000c.
+        inner = 7 + 3 * 17 + 2 * 13 + 8
+        routine = a.analyse(0x00)
+        self.assertEqual(routine.best, 7 + inner + 3 * 11 + 4 + 7 + 11)
+        self.assertEqual(routine.worst,
+                         7 + 2 * (inner + 3 * 94 + 4) + 12 + 7 + 94)
+
+        # The critical path accounts for all the worst-case ticks.
+        self.assertEqual(sum(count * ticks
+                             for addr, count, ticks in routine.critical_path),
+                         routine.worst)
+
+        with self.assertRaises(z80.Error):
+            z80.TimingAnalyser(image).analyse(0x00)
+
+
+class TestControlFlowGraph(unittest.TestCase):
+    def __str__(self):
+        return 'ControlFlowGraph'
+
+    def runTest(self):
+        image = (b'\x06\x03'  # 0x8000  ld b, 3
+                 b'\x00'  # 0x8002  nop
+                 b'\x10\xfd'  # 0x8003  djnz 0x8002
+                 b'\xcd\x0d\x80'  # 0x8005  call 0x800d
+                 b'\x28\x01'  # 0x8008  jr z, 0x800b
+                 b'\xc9'  # 0x800a  ret
+                 b'\xdd\xe9'  # 0x800b  jp (ix)
+                 b'\xc9')  # 0x800d  ret
+
+        cfg = z80.ControlFlowGraph(image, [0x8000], base_addr=0x8000)
+        self.assertEqual(list(cfg.blocks), [0x8000, 0x8002, 0x8005, 0x8008,
+                                            0x800a, 0x800b, 0x800d])
+
+        loop = cfg.get_block(0x8002)
+        self.assertEqual((loop.size, loop.num_of_instrs), (3, 2))
+        self.assertEqual(loop.successors, [0x8002, 0x8005])
+        self.assertEqual([text for _, _, text in cfg.get_instrs(loop)],
+                         ['nop', 'djnz $ - 1'])
+
+        call = cfg.get_block(0x8005)
+        self.assertTrue(call.is_call)
+        self.assertEqual((call.callee, call.successors), (0x800d, [0x8008]))
+
+        self.assertTrue(cfg.get_block(0x800b).is_indirect_jump)
+        self.assertEqual(cfg.get_block(0x800b).successors, [])
+        self.assertTrue(cfg.get_block(0x800d).is_return)
+
+        dot = cfg.to_dot()
+        self.assertIn('b8002 -> b8002;', dot)
+        self.assertIn('b8005 -> b800d [style=dashed, label=call];', dot)
+
 
 class DisasmTestCase(unittest.TestCase):
     maxDiff = None
@@ -82,6 +823,21 @@ def suite():
     suite = unittest.TestSuite()
 
     suite.addTest(TestInstrBuilder())
+    suite.addTest(TestDisasmRange())
+    suite.addTest(TestParallelTracing())
+    suite.addTest(TestStateAccess())
+    suite.addTest(TestSnapshots())
+    suite.addTest(TestThreadedRun())
+    suite.addTest(TestRunMachines())
+    suite.addTest(TestModuleState())
+    suite.addTest(TestSubInterpreters())
+    suite.addTest(TestAsyncRun())
+    suite.addTest(TestTracing())
+    suite.addTest(TestWatchedAccesses())
+    suite.addTest(TestBatchedIO())
+    suite.addTest(TestStopConditions())
+    suite.addTest(TestTimingAnalyser())
+    suite.addTest(TestControlFlowGraph())
 
     suite_dir = os.path.dirname(__file__)
     disasm_tests_dir = 'disasm'
@@ -0,0 +1,699 @@
+
+/*  Native switch-level simulation engine for z80sim.
+    https://github.com/kosarev/z80
+
+    Copyright (c) 2017 Ivan Kosarev <ivan@kosarev.info>
+    Published under the MIT license.
+*/
+
+// Implements the propagation logic of z80sim.Z80Simulator for
+// concrete, that is, non-symbolic, states. Nodes and transistors
+// are kept in flat arrays indexed by dense node and transistor
+// numbers; connections are stored in the compressed sparse row
+// form and states are packed into bit sets.
+
+#include <Python.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <vector>
+
+namespace {
+
+using index_type = std::uint32_t;
+
+class bit_set {
+public:
+    bit_set() {}
+
+    void resize(std::size_t n) {
+        words.assign((n + 63) / 64, 0);
+    }
+
+    bool get(index_type i) const {
+        return (words[i / 64] >> (i % 64)) & 1;
+    }
+
+    void set(index_type i, bool v) {
+        std::uint64_t mask = std::uint64_t(1) << (i % 64);
+        if(v)
+            words[i / 64] |= mask;
+        else
+            words[i / 64] &= ~mask;
+    }
+
+private:
+    std::vector<std::uint64_t> words;
+};
+
+// A compressed sparse row list of items for every node.
+class node_lists {
+public:
+    node_lists() {}
+
+    void build(index_type num_nodes,
+               const std::vector<std::pair<index_type, index_type>> &pairs) {
+        offsets.assign(num_nodes + 1, 0);
+        for(const auto &p : pairs)
+            ++offsets[p.first + 1];
+        for(index_type n = 0; n != num_nodes; ++n)
+            offsets[n + 1] += offsets[n];
+
+        items.resize(pairs.size());
+        std::vector<index_type> pos(offsets.begin(), offsets.end() - 1);
+        for(const auto &p : pairs)
+            items[pos[p.first]++] = p.second;
+    }
+
+    const index_type *begin(index_type n) const {
+        return items.data() + offsets[n];
+    }
+
+    const index_type *end(index_type n) const {
+        return items.data() + offsets[n + 1];
+    }
+
+private:
+    std::vector<index_type> offsets;
+    std::vector<index_type> items;
+};
+
+enum class pull_kind { none = 0, up = 1, down = 2 };
+
+class engine {
+public:
+    engine() {}
+
+    // Transistors are passed as (gate, c1, c2, state) tuples.
+    void init(index_type num_nodes, index_type gnd, index_type pwr,
+              const std::uint8_t *pulls, const std::uint32_t *trans,
+              index_type num_trans) {
+        this->num_nodes = num_nodes;
+        this->gnd = gnd;
+        this->pwr = pwr;
+
+        pullups.resize(num_nodes);
+        pulldowns.resize(num_nodes);
+        for(index_type n = 0; n != num_nodes; ++n)
+            set_pull(n, static_cast<pull_kind>(pulls[n]));
+
+        node_states.resize(num_nodes);
+        trans_states.resize(num_trans);
+        other_conns.resize(num_trans);
+        group_conns.resize(num_trans);
+
+        std::vector<std::pair<index_type, index_type>> conn_pairs;
+        std::vector<std::pair<index_type, index_type>> gate_pairs;
+        for(index_type t = 0; t != num_trans; ++t) {
+            const std::uint32_t *tr = &trans[t * 4];
+            index_type gate = tr[0], c1 = tr[1], c2 = tr[2];
+            // The xor of the connections lets us get the other end
+            // of a transistor knowing one of them.
+            other_conns[t] = c1 ^ c2;
+            // At most one end of a transistor is gnd or pwr.
+            group_conns[t] = (c1 == gnd || c1 == pwr) ? c2 : c1;
+            trans_states.set(t, tr[3] != 0);
+            conn_pairs.push_back({c1, t});
+            conn_pairs.push_back({c2, t});
+            gate_pairs.push_back({gate, t});
+
+            // Nodes take the state of their gates.
+            node_states.set(gate, tr[3] != 0);
+        }
+        conns.build(num_nodes, conn_pairs);
+        gated.build(num_nodes, gate_pairs);
+
+        identify_groups();
+
+        stamps.assign(num_nodes, 0);
+        components.assign(num_nodes, 0);
+        group_marks.assign(num_groups, 0);
+    }
+
+    bool is_valid_node(index_type n) const {
+        return n < num_nodes;
+    }
+
+    void set_pull(index_type n, pull_kind pull) {
+        pullups.set(n, pull == pull_kind::up);
+        pulldowns.set(n, pull == pull_kind::down);
+        invalidate_components();
+    }
+
+    // Computes the state of a node from the states of its group.
+    bool get_node_state(index_type n) {
+        if(n == gnd)
+            return false;
+        if(n == pwr)
+            return true;
+
+        if(stamps[n] != epoch)
+            evaluate_component(n);
+
+        unsigned flags = component_flags[components[n]];
+        if(flags & (reaches_gnd | reaches_pwr))
+            return !(flags & reaches_gnd);
+        if(flags & (has_pullup | has_pulldown))
+            return !(flags & has_pulldown);
+
+        // Floating nodes retain their state.
+        return node_states.get(n);
+    }
+
+    // Propagates changes in the groups of the specified nodes.
+    // Returns false if the states do not settle.
+    bool update_groups_of(const std::vector<index_type> &nodes) {
+        std::vector<index_type> groups;
+        for(index_type n : nodes)
+            add_group(groups, n);
+
+        std::vector<index_type> changed;
+        unsigned round = 0;
+        while(!groups.empty()) {
+            if(++round >= max_rounds) {
+                for(index_type g : groups)
+                    group_marks[g] = 0;
+                return false;
+            }
+
+            for(index_type g : groups)
+                group_marks[g] = 0;
+
+            changed.clear();
+            bool repeat = true;
+            while(repeat) {
+                repeat = false;
+                for(index_type g : groups) {
+                    for(index_type i = group_offsets[g];
+                            i != group_offsets[g + 1]; ++i) {
+                        index_type n = group_gates[i];
+                        bool state = get_node_state(n);
+                        if(state == node_states.get(n))
+                            continue;
+
+                        set_gate_state(n, state);
+                        if(!changed_marks.get(n)) {
+                            changed_marks.set(n, true);
+                            changed.push_back(n);
+                        }
+                        repeat = true;
+                    }
+                }
+            }
+
+            groups.clear();
+            for(index_type n : changed) {
+                changed_marks.set(n, false);
+                for(const index_type *t = gated.begin(n); t != gated.end(n);
+                        ++t)
+                    add_conns_group(groups, *t);
+            }
+        }
+
+        return true;
+    }
+
+    bool power_up() {
+        std::vector<index_type> nodes;
+        for(index_type s : {gnd, pwr}) {
+            for(const index_type *t = conns.begin(s); t != conns.end(s); ++t)
+                nodes.push_back(other_conns[*t] ^ s);
+        }
+        return update_groups_of(nodes);
+    }
+
+private:
+    static const unsigned max_rounds = 100;
+
+    enum : unsigned {
+        reaches_gnd = 1 << 0,
+        reaches_pwr = 1 << 1,
+        has_pullup = 1 << 2,
+        has_pulldown = 1 << 3,
+    };
+
+    void identify_groups() {
+        const index_type no_group = static_cast<index_type>(-1);
+        node_groups.assign(num_nodes, no_group);
+        num_groups = 0;
+
+        std::vector<std::pair<index_type, index_type>> group_gate_pairs;
+        std::vector<index_type> worklist;
+        for(index_type start = 0; start != num_nodes; ++start) {
+            if(start == gnd || start == pwr ||
+                   node_groups[start] != no_group)
+                continue;
+
+            index_type g = num_groups++;
+            node_groups[start] = g;
+            worklist.push_back(start);
+            std::vector<index_type> members;
+            while(!worklist.empty()) {
+                index_type n = worklist.back();
+                worklist.pop_back();
+                members.push_back(n);
+                for(const index_type *t = conns.begin(n); t != conns.end(n);
+                        ++t) {
+                    index_type m = other_conns[*t] ^ n;
+                    if(m == gnd || m == pwr || node_groups[m] != no_group)
+                        continue;
+                    node_groups[m] = g;
+                    worklist.push_back(m);
+                }
+            }
+
+            // Gates are processed in the order of their indexes,
+            // same as the Python engine does.
+            std::sort(members.begin(), members.end());
+            for(index_type n : members) {
+                if(gated.begin(n) != gated.end(n))
+                    group_gate_pairs.push_back({g, n});
+            }
+        }
+
+        group_offsets.assign(num_groups + 1, 0);
+        for(const auto &p : group_gate_pairs)
+            ++group_offsets[p.first + 1];
+        for(index_type g = 0; g != num_groups; ++g)
+            group_offsets[g + 1] += group_offsets[g];
+        group_gates.resize(group_gate_pairs.size());
+        for(std::size_t i = 0; i != group_gate_pairs.size(); ++i)
+            group_gates[i] = group_gate_pairs[i].second;
+
+        changed_marks.resize(num_nodes);
+    }
+
+    void add_group(std::vector<index_type> &groups, index_type n) {
+        if(n == gnd || n == pwr)
+            return;
+        index_type g = node_groups[n];
+        if(!group_marks[g]) {
+            group_marks[g] = 1;
+            groups.push_back(g);
+        }
+    }
+
+    void add_conns_group(std::vector<index_type> &groups, index_type t) {
+        add_group(groups, group_conns[t]);
+    }
+
+    void set_gate_state(index_type n, bool state) {
+        node_states.set(n, state);
+        for(const index_type *t = gated.begin(n); t != gated.end(n); ++t)
+            trans_states.set(*t, state);
+
+        invalidate_components();
+    }
+
+    // Any change in pulls or transistor states invalidates the
+    // evaluated components.
+    void invalidate_components() {
+        ++epoch;
+        next_component = 0;
+    }
+
+    // Walks the nodes connected to the specified one via
+    // conducting transistors.
+    void evaluate_component(index_type start) {
+        index_type c = next_component++;
+        if(component_flags.size() <= c)
+            component_flags.resize(c + 1);
+
+        unsigned flags = 0;
+        worklist.clear();
+        worklist.push_back(start);
+        stamps[start] = epoch;
+        components[start] = c;
+        while(!worklist.empty()) {
+            index_type n = worklist.back();
+            worklist.pop_back();
+            if(pullups.get(n))
+                flags |= has_pullup;
+            if(pulldowns.get(n))
+                flags |= has_pulldown;
+
+            for(const index_type *t = conns.begin(n); t != conns.end(n);
+                    ++t) {
+                if(!trans_states.get(*t))
+                    continue;
+
+                index_type m = other_conns[*t] ^ n;
+                if(m == gnd) {
+                    flags |= reaches_gnd;
+                    continue;
+                }
+                if(m == pwr) {
+                    flags |= reaches_pwr;
+                    continue;
+                }
+                if(stamps[m] == epoch)
+                    continue;
+
+                stamps[m] = epoch;
+                components[m] = c;
+                worklist.push_back(m);
+            }
+        }
+        component_flags[c] = flags;
+    }
+
+    index_type num_nodes = 0;
+    index_type gnd = 0, pwr = 0;
+
+    bit_set pullups, pulldowns;
+    bit_set node_states;
+    bit_set trans_states;
+    bit_set changed_marks;
+
+    std::vector<index_type> other_conns;
+    std::vector<index_type> group_conns;
+    node_lists conns;
+    node_lists gated;
+
+    index_type num_groups = 0;
+    std::vector<index_type> node_groups;
+    std::vector<index_type> group_offsets;
+    std::vector<index_type> group_gates;
+    std::vector<std::uint8_t> group_marks;
+
+    // Evaluated components are valid as long as their stamps
+    // match the current epoch.
+    std::uint64_t epoch = 1;
+    std::vector<std::uint64_t> stamps;
+    std::vector<index_type> components;
+    index_type next_component = 0;
+    std::vector<unsigned> component_flags;
+    std::vector<index_type> worklist;
+};
+
+struct object_instance {
+    PyObject_HEAD
+    engine eng;
+};
+
+static inline object_instance *cast_object(PyObject *p) {
+    return reinterpret_cast<object_instance*>(p);
+}
+
+static inline engine &cast_engine(PyObject *p) {
+    return cast_object(p)->eng;
+}
+
+static bool parse_node(PyObject *self, PyObject *arg, index_type &n) {
+    unsigned long v = PyLong_AsUnsignedLong(arg);
+    if(PyErr_Occurred())
+        return false;
+    n = static_cast<index_type>(v);
+    if(v != n || !cast_engine(self).is_valid_node(n)) {
+        PyErr_SetString(PyExc_IndexError, "Node index out of range.");
+        return false;
+    }
+    return true;
+}
+
+static bool parse_nodes(PyObject *self, PyObject *arg,
+                        std::vector<index_type> &nodes) {
+    PyObject *seq = PySequence_Fast(arg, "Expected a sequence of nodes.");
+    if(!seq)
+        return false;
+
+    Py_ssize_t size = PySequence_Fast_GET_SIZE(seq);
+    nodes.resize(static_cast<std::size_t>(size));
+    for(Py_ssize_t i = 0; i != size; ++i) {
+        if(!parse_node(self, PySequence_Fast_GET_ITEM(seq, i),
+                       nodes[static_cast<std::size_t>(i)])) {
+            Py_DECREF(seq);
+            return false;
+        }
+    }
+
+    Py_DECREF(seq);
+    return true;
+}
+
+static bool check_settled(bool settled) {
+    if(!settled)
+        PyErr_SetString(PyExc_RuntimeError, "Loop encountered!");
+    return settled;
+}
+
+static PyObject *set_pull(PyObject *self, PyObject *args) {
+    PyObject *node, *pull;
+    if(!PyArg_ParseTuple(args, "OO:set_pull", &node, &pull))
+        return nullptr;
+
+    index_type n;
+    if(!parse_node(self, node, n))
+        return nullptr;
+
+    pull_kind kind = pull_kind::none;
+    if(pull != Py_None) {
+        int v = PyObject_IsTrue(pull);
+        if(v < 0)
+            return nullptr;
+        kind = v ? pull_kind::up : pull_kind::down;
+    }
+
+    cast_engine(self).set_pull(n, kind);
+    Py_RETURN_NONE;
+}
+
+static PyObject *update(PyObject *self, PyObject *arg) {
+    std::vector<index_type> nodes;
+    if(!parse_nodes(self, arg, nodes))
+        return nullptr;
+
+    if(!check_settled(cast_engine(self).update_groups_of(nodes)))
+        return nullptr;
+    Py_RETURN_NONE;
+}
+
+static PyObject *power_up(PyObject *self, PyObject *args) {
+    (void) args;
+    if(!check_settled(cast_engine(self).power_up()))
+        return nullptr;
+    Py_RETURN_NONE;
+}
+
+static PyObject *get_state(PyObject *self, PyObject *arg) {
+    index_type n;
+    if(!parse_node(self, arg, n))
+        return nullptr;
+
+    return PyBool_FromLong(cast_engine(self).get_node_state(n));
+}
+
+static PyObject *read_bits(PyObject *self, PyObject *arg) {
+    std::vector<index_type> nodes;
+    if(!parse_nodes(self, arg, nodes))
+        return nullptr;
+    if(nodes.size() > 64) {
+        PyErr_SetString(PyExc_ValueError, "Too many nodes.");
+        return nullptr;
+    }
+
+    engine &eng = cast_engine(self);
+    unsigned long long v = 0;
+    for(std::size_t i = 0; i != nodes.size(); ++i)
+        v |= static_cast<unsigned long long>(eng.get_node_state(nodes[i])) << i;
+    return PyLong_FromUnsignedLongLong(v);
+}
+
+// Sets pulls of the nodes to the bits of the value one by
+// one, propagating every change, same as the Python engine does.
+static PyObject *write_bits(PyObject *self, PyObject *args) {
+    PyObject *nodes_arg;
+    unsigned long long value;
+    if(!PyArg_ParseTuple(args, "OK:write_bits", &nodes_arg, &value))
+        return nullptr;
+
+    std::vector<index_type> nodes;
+    if(!parse_nodes(self, nodes_arg, nodes))
+        return nullptr;
+
+    engine &eng = cast_engine(self);
+    for(std::size_t i = 0; i != nodes.size(); ++i) {
+        bool bit = (value >> i) & 1;
+        eng.set_pull(nodes[i], bit ? pull_kind::up : pull_kind::down);
+        if(!check_settled(eng.update_groups_of({nodes[i]})))
+            return nullptr;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef methods[] = {
+    {"set_pull", set_pull, METH_VARARGS,
+     "Set the pull of a node to None, True or False."},
+    {"update", update, METH_O,
+     "Propagate changes in the groups of the passed nodes."},
+    {"power_up", power_up, METH_NOARGS,
+     "Propagate the states of gnd and pwr."},
+    {"get_state", get_state, METH_O,
+     "Return the state of a node."},
+    {"read_bits", read_bits, METH_O,
+     "Return the states of the passed nodes as bits of an integer."},
+    {"write_bits", write_bits, METH_VARARGS,
+     "Set the pulls of the passed nodes to the bits of a value."},
+    { nullptr }  // Sentinel.
+};
+
+// Engine(num_nodes, gnd, pwr, pulls, trans) where 'pulls' holds
+// a byte for every node, 0 for no pull, 1 for pull-up and 2 for
+// pull-down, and 'trans' holds (gate, c1, c2, state) quadruples
+// of native 32-bit integers.
+static PyObject *object_new(PyTypeObject *type, PyObject *args,
+                            PyObject *kwds) {
+    static const char *keywords[] = {
+        "num_nodes", "gnd", "pwr", "pulls", "trans", nullptr };
+    unsigned num_nodes, gnd, pwr;
+    Py_buffer pulls, trans;
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "IIIy*y*:Engine",
+                                    const_cast<char**>(keywords),
+                                    &num_nodes, &gnd, &pwr, &pulls, &trans))
+        return nullptr;
+
+    const char *failure = nullptr;
+    if(gnd >= num_nodes || pwr >= num_nodes || gnd == pwr)
+        failure = "Invalid gnd or pwr nodes.";
+    else if(static_cast<std::size_t>(pulls.len) != num_nodes)
+        failure = "Wrong number of pulls.";
+    else if(trans.len % (4 * sizeof(std::uint32_t)) != 0)
+        failure = "Transistors shall be passed as quadruples.";
+
+    std::size_t num_trans = static_cast<std::size_t>(trans.len) /
+                            (4 * sizeof(std::uint32_t));
+    std::vector<std::uint32_t> trans_data(num_trans * 4);
+    if(!failure) {
+        std::memcpy(trans_data.data(), trans.buf,
+                    static_cast<std::size_t>(trans.len));
+        const std::uint8_t *p = static_cast<const std::uint8_t*>(pulls.buf);
+        for(unsigned n = 0; n != num_nodes; ++n) {
+            if(p[n] > 2)
+                failure = "Invalid pull.";
+        }
+        for(std::size_t t = 0; t != num_trans; ++t) {
+            const std::uint32_t *tr = &trans_data[t * 4];
+            if(tr[0] >= num_nodes || tr[1] >= num_nodes ||
+                   tr[2] >= num_nodes || tr[1] == tr[2] ||
+                   ((tr[1] == gnd || tr[1] == pwr) &&
+                        (tr[2] == gnd || tr[2] == pwr)))
+                failure = "Invalid transistor.";
+        }
+    }
+
+    if(failure) {
+        PyBuffer_Release(&pulls);
+        PyBuffer_Release(&trans);
+        PyErr_SetString(PyExc_ValueError, failure);
+        return nullptr;
+    }
+
+    auto *self = cast_object(type->tp_alloc(type, /* nitems= */ 0));
+    if(self) {
+        ::new(&self->eng) engine();
+        self->eng.init(num_nodes, gnd, pwr,
+                       static_cast<const std::uint8_t*>(pulls.buf),
+                       trans_data.data(),
+                       static_cast<index_type>(num_trans));
+    }
+
+    PyBuffer_Release(&pulls);
+    PyBuffer_Release(&trans);
+    if(!self)
+        return nullptr;
+    return &self->ob_base;
+}
+
+static void object_dealloc(PyObject *self) {
+    cast_engine(self).~engine();
+    Py_TYPE(self)->tp_free(self);
+}
+
+static PyTypeObject type_object = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "_z80sim_native.Engine",    // tp_name
+    sizeof(object_instance),    // tp_basicsize
+    0,                          // tp_itemsize
+    object_dealloc,             // tp_dealloc
+    0,                          // tp_print
+    0,                          // tp_getattr
+    0,                          // tp_setattr
+    0,                          // tp_reserved
+    0,                          // tp_repr
+    0,                          // tp_as_number
+    0,                          // tp_as_sequence
+    0,                          // tp_as_mapping
+    0,                          // tp_hash
+    0,                          // tp_call
+    0,                          // tp_str
+    0,                          // tp_getattro
+    0,                          // tp_setattro
+    0,                          // tp_as_buffer
+    Py_TPFLAGS_DEFAULT,         // tp_flags
+    "Switch-level simulation engine",
+                                // tp_doc
+    0,                          // tp_traverse
+    0,                          // tp_clear
+    0,                          // tp_richcompare
+    0,                          // tp_weaklistoffset
+    0,                          // tp_iter
+    0,                          // tp_iternext
+    methods,                    // tp_methods
+    nullptr,                    // tp_members
+    0,                          // tp_getset
+    0,                          // tp_base
+    0,                          // tp_dict
+    0,                          // tp_descr_get
+    0,                          // tp_descr_set
+    0,                          // tp_dictoffset
+    0,                          // tp_init
+    0,                          // tp_alloc
+    object_new,                 // tp_new
+    0,                          // tp_free
+    0,                          // tp_is_gc
+    0,                          // tp_bases
+    0,                          // tp_mro
+    0,                          // tp_cache
+    0,                          // tp_subclasses
+    0,                          // tp_weaklist
+    0,                          // tp_del
+    0,                          // tp_version_tag
+    0,                          // tp_finalize
+};
+
+static PyModuleDef module = {
+    PyModuleDef_HEAD_INIT,      // m_base
+    "_z80sim_native",           // m_name
+    "Native switch-level simulation engine for z80sim",
+                                // m_doc
+    -1,                         // m_size
+    nullptr,                    // m_methods
+    nullptr,                    // m_slots
+    nullptr,                    // m_traverse
+    nullptr,                    // m_clear
+    nullptr,                    // m_free
+};
+
+}  // anonymous namespace
+
+extern "C" PyMODINIT_FUNC PyInit__z80sim_native(void) {
+    PyObject *m = PyModule_Create(&module);
+    if(!m)
+        return nullptr;
+
+    if(PyType_Ready(&type_object) < 0) {
+        Py_DECREF(m);
+        return nullptr;
+    }
+
+    Py_INCREF(&type_object);
+    if(PyModule_AddObject(m, "Engine", &type_object.ob_base.ob_base) < 0) {
+        Py_DECREF(&type_object);
+        Py_DECREF(m);
+        return nullptr;
+    }
+
+    return m;
+}
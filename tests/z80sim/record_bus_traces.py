@@ -0,0 +1,208 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+# Records per-T-state bus traces of instruction sequences from
+# the transistor-level simulator, for the native 'bus_traces'
+# test to validate the emulator's cycle-level handlers against.
+# See tests/bus_traces.cpp for the format.
+#
+# Recording is slow, so traces are only recorded for sequences
+# that do not have them yet, unless --force is specified. With
+# --native, the native engine built with setup_native.py is
+# used. Run from this directory, the same way as z80sim.py.
+
+import pathlib
+import sys
+
+
+_TRACES_DIR = pathlib.Path(__file__).resolve().parent.parent / 'bus_traces'
+
+# Value returned on input cycles; must match tests/bus_traces.cpp.
+_INPUT_VALUE = 0xff
+
+# Give up on sequences that do not reach their end.
+_MAX_TICKS = 1000
+
+# Every sequence is executed from the reset state starting at
+# address 0 and is terminated when PC reaches its end. The
+# listed registers are recorded at starts of M1 cycles; they
+# should be set by the sequence, as values of other registers
+# after reset are not defined. Sequences must not swap
+# register banks, e.g., with 'exx', as the recorder reads the
+# register nodes directly.
+SEQUENCES = {
+    'nop': (
+        'nop',
+        b'\x00',
+        ('pc', 'r')),
+    'ld_r_n': (
+        'ld a, 0x12',
+        b'\x3e\x12',
+        ('pc', 'a')),
+    'ld_rp_nn_inc_rp': (
+        'ld bc, 0x1234; inc bc; dec bc',
+        b'\x01\x34\x12\x03\x0b',
+        ('pc', 'bc')),
+    'ld_at_hl_n': (
+        'ld hl, 0x8000; ld (hl), 0x34; ld a, (hl)',
+        b'\x21\x00\x80\x36\x34\x7e',
+        ('pc', 'hl', 'a')),
+    'push_pop': (
+        'ld bc, 0x1234; ld sp, 0x8000; push bc; pop de',
+        b'\x01\x34\x12\x31\x00\x80\xc5\xd1',
+        ('pc', 'bc', 'sp', 'de')),
+    'in_out': (
+        'ld a, 0x12; out (0xfe), a; in a, (0xfe)',
+        b'\x3e\x12\xd3\xfe\xdb\xfe',
+        ('pc', 'a')),
+    'jr_djnz': (
+        'ld b, 2; djnz $; jr $ + 2',
+        b'\x06\x02\x10\xfe\x18\x00',
+        ('pc', 'b')),
+    'ldir': (
+        'ld hl, 0x8000; ld de, 0x9000; ld bc, 2; ldir',
+        b'\x21\x00\x80\x11\x00\x90\x01\x02\x00\xed\xb0',
+        ('pc', 'hl', 'de', 'bc')),
+    'index_regs': (
+        'ld ix, 0x8000; ld (ix + 5), 7; inc (ix + 5)',
+        b'\xdd\x21\x00\x80\xdd\x36\x05\x07\xdd\x34\x05',
+        ('pc', 'ix')),
+}
+
+# Nodes of register pairs, high byte first.
+_REG_NODES = {
+    'pc': ('pch', 'pcl'),
+    'sp': ('sph', 'spl'),
+    'af': ('a', 'f'),
+    'bc': ('b', 'c'),
+    'de': ('d', 'e'),
+    'hl': ('h', 'l'),
+    'ix': ('ixh', 'ixl'),
+    'iy': ('iyh', 'iyl'),
+    'ir': ('i', 'r'),
+}
+
+
+def _read_reg(sim, name):
+    value = 0
+    for part in _REG_NODES.get(name, (name,)):
+        value = (value << 8) | int(sim.read_nodes(f'reg_{part}'))
+    return value
+
+
+def _format_reg(name, value):
+    width = 2 * len(_REG_NODES.get(name, (name,)))
+    return f'{name}={value:0{width}x}'
+
+
+def _get_ctrl(sim):
+    # Letters of active control signals in the order of
+    # tests/bus_traces.cpp.
+    signals = (sim.m1, sim.mreq, sim.iorq, sim.rd, sim.wr, sim.rfsh)
+    return ''.join(c for c, s in zip('1mirwf', signals) if bool(s)) or '-'
+
+
+def _record(sim, code, regs):
+    memory = bytearray(0x10000)
+    memory[:len(code)] = code
+
+    def drive_buses():
+        addr = int(sim.abus)
+        if bool(sim.mreq) and not bool(sim.rfsh):
+            if bool(sim.rd):
+                sim.dbus = memory[addr]
+            elif bool(sim.wr):
+                memory[addr] = int(sim.dbus)
+        elif bool(sim.iorq) and not bool(sim.m1) and bool(sim.rd):
+            sim.dbus = _INPUT_VALUE
+
+    trace = {'addr_bus': [], 'data_bus': [], 'ctrl': [], 'm1': [],
+             'regs': []}
+    values = None
+    while len(trace['addr_bus']) < _MAX_TICKS:
+        # Every T-state is sampled while the clock is high.
+        assert bool(sim.clk)
+        drive_buses()
+
+        tick = len(trace['addr_bus'])
+        addr = int(sim.abus)
+        if bool(sim.m1) and bool(sim.t1):
+            # Record registers that changed since the previous
+            # M1 cycle and all of them at the end.
+            new_values = {r: _read_reg(sim, r) for r in regs}
+            end = addr == len(code)
+            if values is not None:
+                changed = [r for r in regs
+                           if end or new_values[r] != values[r]]
+                if changed:
+                    trace['regs'].append((tick, [(r, new_values[r])
+                                                 for r in changed]))
+            values = new_values
+
+            if end:
+                return trace
+            trace['m1'].append(tick)
+
+        ctrl = _get_ctrl(sim)
+        transfer = (bool(sim.mreq) or bool(sim.iorq)) and not bool(sim.rfsh)
+        trace['addr_bus'].append(f'{addr:04x}')
+        trace['data_bus'].append(f'{int(sim.dbus):02x}' if transfer
+                                 else '--')
+        trace['ctrl'].append(ctrl)
+
+        sim.half_tick()
+        sim.half_tick()
+
+    sys.exit(f'sequence {code.hex()} does not terminate')
+
+
+def _compress(values):
+    # Collapse repeated values.
+    res = []
+    for v in values:
+        if res and res[-1][0] == v:
+            res[-1][1] += 1
+        else:
+            res.append([v, 1])
+
+    return ' '.join(v if n == 1 else f'{v}*{n}' for v, n in res)
+
+
+def _write_trace(path, desc, code, trace):
+    with open(path, 'w') as f:
+        print(f'# {desc}', file=f)
+        print('#', file=f)
+        print('# Recorded with z80sim/record_bus_traces.py.', file=f)
+        print('code', ' '.join(f'{b:02x}' for b in code), file=f)
+        for kind in ('addr_bus', 'data_bus', 'ctrl'):
+            print(kind, _compress(trace[kind]), file=f)
+        print('m1', ' '.join(str(t) for t in trace['m1']), file=f)
+        for tick, values in trace['regs']:
+            print('regs', tick, ' '.join(_format_reg(r, v)
+                                         for r, v in values), file=f)
+
+
+def main():
+    # The simulator needs its netlist and solvers, so only
+    # import it when actually recording.
+    import z80sim
+
+    force = '--force' in sys.argv
+    native = '--native' in sys.argv
+    _TRACES_DIR.mkdir(exist_ok=True)
+
+    for name, (desc, code, regs) in sorted(SEQUENCES.items()):
+        path = _TRACES_DIR / f'{name}.trace'
+        if path.exists() and not force:
+            continue
+
+        print(f'recording {name}: {desc}')
+        if native:
+            sim = z80sim.NativeZ80Simulator()
+        else:
+            sim = z80sim.Z80Simulator()
+        _write_trace(path, desc, code, _record(sim, code, regs))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,22 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+# Builds the native simulation engine used by z80sim.py for
+# concrete runs:
+#
+#   python3 setup_native.py build_ext --inplace
+
+import platform
+from setuptools import Extension, setup
+
+
+cxx_flags = []
+if platform.system() != 'Windows':
+    cxx_flags.extend(['-std=c++11', '-Wall', '-fno-exceptions',
+                      '-fno-rtti', '-O3'])
+
+setup(name='z80sim_native',
+      ext_modules=[Extension(name='_z80sim_native',
+                             extra_compile_args=cxx_flags,
+                             sources=['_z80sim_native.cpp'],
+                             language='c++')])
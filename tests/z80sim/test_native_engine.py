@@ -0,0 +1,220 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+# Checks the native switch-level engine on small hand-made
+# netlists. Unlike the --test-native check of z80sim.py, this
+# needs neither the Z80 netlist nor the solvers z80sim.py
+# depends on. The engine is built with setup_native.py into a
+# temporary directory:
+#
+#   python3 test_native_engine.py
+
+import array
+import pathlib
+import subprocess
+import sys
+import tempfile
+import unittest
+
+
+_HERE = pathlib.Path(__file__).resolve().parent
+
+_build_dir = None
+_z80sim_native = None
+
+
+def setUpModule():
+    global _build_dir, _z80sim_native
+    _build_dir = tempfile.TemporaryDirectory()
+    subprocess.run([sys.executable, 'setup_native.py', 'build_ext',
+                    '--build-lib', _build_dir.name,
+                    '--build-temp', _build_dir.name],
+                   cwd=_HERE, check=True, stdout=subprocess.DEVNULL)
+    sys.path.insert(0, _build_dir.name)
+    import _z80sim_native
+
+
+def tearDownModule():
+    _build_dir.cleanup()
+
+
+class _Netlist(object):
+    GND, PWR = 0, 1
+
+    def __init__(self):
+        self.__pulls = [None, None]
+        self.__trans = []
+
+    # Adds a node with a pull of None, True or False.
+    def node(self, pull=None):
+        self.__pulls.append(pull)
+        return len(self.__pulls) - 1
+
+    def trans(self, gate, c1, c2):
+        self.__trans.append((gate, c1, c2))
+
+    # Adds an inverter driven by the specified node.
+    def inverter(self, input):
+        output = self.node(pull=True)
+        self.trans(input, output, self.GND)
+        return output
+
+    def engine(self):
+        pulls = bytes({None: 0, True: 1, False: 2}[p] for p in self.__pulls)
+        trans = array.array('I')
+        for gate, c1, c2 in self.__trans:
+            trans.extend((gate, c1, c2, 0))
+        engine = _z80sim_native.Engine(len(self.__pulls), self.GND,
+                                       self.PWR, pulls, trans.tobytes())
+        engine.power_up()
+        return engine
+
+
+def _drive(engine, n, state):
+    engine.set_pull(n, state)
+    engine.update([n])
+
+
+class TestNativeEngine(unittest.TestCase):
+    def test_inverter(self):
+        net = _Netlist()
+        input = net.node(pull=False)
+        output = net.inverter(input)
+        e = net.engine()
+        self.assertIs(e.get_state(net.GND), False)
+        self.assertIs(e.get_state(net.PWR), True)
+        self.assertIs(e.get_state(output), True)
+
+        for state in (True, False, True):
+            _drive(e, input, state)
+            self.assertIs(e.get_state(input), state)
+            self.assertIs(e.get_state(output), not state)
+
+    def test_inverter_chain(self):
+        # Changes propagate through several groups.
+        net = _Netlist()
+        input = net.node(pull=False)
+        output = input
+        for _ in range(5):
+            output = net.inverter(output)
+        e = net.engine()
+        self.assertIs(e.get_state(output), True)
+
+        _drive(e, input, True)
+        self.assertIs(e.get_state(output), False)
+
+    def test_nand(self):
+        # The node between the transistors is only connected
+        # to gnd and the output through them.
+        net = _Netlist()
+        a, b = net.node(pull=False), net.node(pull=False)
+        output = net.node(pull=True)
+        middle = net.node()
+        net.trans(a, output, middle)
+        net.trans(b, middle, net.GND)
+        e = net.engine()
+
+        for x in (False, True):
+            for y in (False, True):
+                _drive(e, a, x)
+                _drive(e, b, y)
+                self.assertIs(e.get_state(output), not (x and y), (x, y))
+
+    def test_pass_transistor(self):
+        # The node behind a pass transistor follows the source
+        # while the transistor conducts and keeps its state
+        # otherwise, along with the gates it drives.
+        net = _Netlist()
+        source, enable = net.node(pull=False), net.node(pull=False)
+        stored = net.node()
+        net.trans(enable, source, stored)
+        output = net.inverter(stored)
+        e = net.engine()
+
+        _drive(e, enable, True)
+        for state in (True, False, True):
+            _drive(e, source, state)
+            self.assertIs(e.get_state(stored), state)
+            self.assertIs(e.get_state(output), not state)
+
+        _drive(e, enable, False)
+        _drive(e, source, False)
+        self.assertIs(e.get_state(stored), True)
+        self.assertIs(e.get_state(output), False)
+
+        _drive(e, enable, True)
+        self.assertIs(e.get_state(stored), False)
+        self.assertIs(e.get_state(output), True)
+
+    def test_conflicts(self):
+        # Connections to gnd win over those to pwr, which win
+        # over pulls. Pull-downs win over pull-ups.
+        net = _Netlist()
+        on = net.node(pull=False)
+        up, down = net.node(pull=True), net.node(pull=False)
+        net.trans(on, up, down)
+        up_output, down_output = net.inverter(up), net.inverter(down)
+
+        gnd_pwr = net.node()
+        gnd_enable = net.node(pull=False)
+        net.trans(on, gnd_pwr, net.PWR)
+        net.trans(gnd_enable, gnd_pwr, net.GND)
+        gnd_pwr_output = net.inverter(gnd_pwr)
+
+        pwr_down = net.node(pull=False)
+        net.trans(on, pwr_down, net.PWR)
+        e = net.engine()
+
+        # Powering up only propagates the states of gnd and pwr,
+        # so nodes that are only gates are driven explicitly.
+        _drive(e, on, True)
+
+        self.assertIs(e.get_state(up), False)
+        self.assertIs(e.get_state(down), False)
+        self.assertIs(e.get_state(up_output), True)
+        self.assertIs(e.get_state(down_output), True)
+
+        self.assertIs(e.get_state(gnd_pwr), True)
+        self.assertIs(e.get_state(gnd_pwr_output), False)
+        _drive(e, gnd_enable, True)
+        self.assertIs(e.get_state(gnd_pwr), False)
+        self.assertIs(e.get_state(gnd_pwr_output), True)
+
+        self.assertIs(e.get_state(pwr_down), True)
+
+        # Breaking the connection resolves the conflict.
+        _drive(e, on, False)
+        self.assertIs(e.get_state(up), True)
+        self.assertIs(e.get_state(down), False)
+        self.assertIs(e.get_state(up_output), False)
+
+    def test_bits(self):
+        net = _Netlist()
+        inputs = [net.node(pull=False) for _ in range(4)]
+        outputs = [net.inverter(n) for n in inputs]
+        e = net.engine()
+
+        e.write_bits(inputs, 0b1010)
+        self.assertEqual(e.read_bits(inputs), 0b1010)
+        self.assertEqual(e.read_bits(outputs), 0b0101)
+
+    def test_invalid_netlists(self):
+        with self.assertRaises(ValueError):
+            _z80sim_native.Engine(2, 0, 0, bytes(2), b'')
+        with self.assertRaises(ValueError):
+            _z80sim_native.Engine(3, 0, 1, bytes(2), b'')
+        with self.assertRaises(ValueError):
+            _z80sim_native.Engine(3, 0, 1, bytes((0, 0, 3)), b'')
+
+        net = _Netlist()
+        net.trans(net.node(pull=True), net.GND, net.PWR)
+        with self.assertRaises(ValueError):
+            net.engine()
+
+        e = _Netlist().engine()
+        with self.assertRaises(IndexError):
+            e.get_state(2)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+# Runs record_bus_traces.py on a stub simulator and validates
+# the written trace with the native 'bus_traces' test, so the
+# recorder and the trace reader are known to agree without the
+# transistor-level simulator:
+#
+#   test_record_bus_traces.py <path-to-bus_traces>
+
+import pathlib
+import subprocess
+import sys
+import tempfile
+
+import record_bus_traces
+
+
+class _StubSimulator(object):
+    # Runs 'nop; ld a, 0x12; out (0xfe), a' with the machine
+    # cycle timings of the Z80 CPU User Manual, exposing the
+    # subset of the simulator interface the recorder uses.
+    # Opcodes and operands are taken from the data bus as
+    # driven by the recorder.
+
+    CODE = b'\x00\x3e\x12\xd3\xfe'
+
+    def __init__(self):
+        self.__regs = {'pch': 0, 'pcl': 0, 'a': 0xff, 'f': 0xff,
+                       'i': 0, 'r': 0}
+        self.dbus = 0
+        self.__cycles = self.__run()
+        self.clk = False
+        self.half_tick()
+
+    def __set(self, addr, signals='', t1=False):
+        self.abus = addr
+        self.t1 = t1
+        for s in ('m1', 'mreq', 'iorq', 'rd', 'wr', 'rfsh'):
+            setattr(self, s, s in signals)
+
+    def __get_pc(self):
+        return (self.__regs['pch'] << 8) | self.__regs['pcl']
+
+    def __set_pc(self, pc):
+        self.__regs['pch'], self.__regs['pcl'] = pc >> 8, pc & 0xff
+
+    def __m1_cycle(self):
+        pc = self.__get_pc()
+        ir = (self.__regs['i'] << 8) | self.__regs['r']
+        self.__set(pc, ('m1',), t1=True)
+        yield
+        self.__set(pc, ('m1', 'mreq', 'rd'))
+        yield
+        op = self.dbus
+        self.__set_pc(pc + 1)
+        self.__regs['r'] = (self.__regs['r'] + 1) & 0x7f
+        self.__set(ir, ('rfsh',))
+        yield
+        self.__set(ir, ('mreq', 'rfsh'))
+        yield
+        return op
+
+    def __read_cycle(self):
+        pc = self.__get_pc()
+        self.__set(pc, t1=True)
+        yield
+        for _ in range(2):
+            self.__set(pc, ('mreq', 'rd'))
+            yield
+        self.__set_pc(pc + 1)
+        return self.dbus
+
+    def __output_cycle(self, port, n):
+        self.__set(port, t1=True)
+        yield
+        for _ in range(3):
+            self.__set(port, ('iorq', 'wr'))
+            self.dbus = n
+            yield
+
+    def __run(self):
+        assert (yield from self.__m1_cycle()) == 0x00
+        assert (yield from self.__m1_cycle()) == 0x3e
+        self.__regs['a'] = yield from self.__read_cycle()
+        assert (yield from self.__m1_cycle()) == 0xd3
+        port = yield from self.__read_cycle()
+        a = self.__regs['a']
+        yield from self.__output_cycle((a << 8) | port, a)
+        while True:
+            yield from self.__m1_cycle()
+
+    def half_tick(self):
+        self.clk = not self.clk
+        if self.clk:
+            next(self.__cycles)
+
+    def read_nodes(self, id, width=8):
+        assert id.startswith('reg_') and width == 8
+        return self.__regs[id[len('reg_'):]]
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit('usage: test_record_bus_traces.py <path-to-bus_traces>')
+
+    code = _StubSimulator.CODE
+    trace = record_bus_traces._record(_StubSimulator(), code,
+                                      ('pc', 'a', 'r'))
+    with tempfile.TemporaryDirectory() as dir:
+        path = pathlib.Path(dir) / 'stub.trace'
+        record_bus_traces._write_trace(
+            path, 'nop; ld a, 0x12; out (0xfe), a', code, trace)
+        print(path.read_text(), end='')
+        subprocess.run([sys.argv[1], str(path)], check=True)
+
+
+if __name__ == '__main__':
+    main()
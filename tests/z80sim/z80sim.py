@@ -12,6 +12,7 @@
 # commit c11574c1d80352b355d297ad3ae33701a7110485 of 19 Jan 2021
 
 
+import array
 import ast
 import datetime
 import gc
@@ -1435,6 +1436,39 @@ class Z80Simulator(object):
         return {id: self.get_node_state(self.__nodes_by_name[id])
                 for id in ids}
 
+    def export_netlist(self):
+        # Returns the netlist in the form accepted by the native
+        # engine: node indexes are made dense and pulls and
+        # transistor states are required to be concrete.
+        nodes = sorted(self.__nodes.values())
+        indexes = {n: i for i, n in enumerate(nodes)}
+
+        def get_value(b, what):
+            if b is None:
+                return None
+            v = b.value
+            if v is None:
+                raise ValueError(f'symbolic {what}: {b}')
+            return v
+
+        pulls = bytearray(len(nodes))
+        for n in nodes:
+            pull = get_value(n.pull, f'pull of {n}')
+            pulls[indexes[n]] = {None: 0, True: 1, False: 2}[pull]
+
+        trans = array.array('I')
+        for t in sorted(self.__trans.values()):
+            state = get_value(t.state, f'state of {t}')
+            trans.extend((indexes[t.gate], indexes[t.c1], indexes[t.c2],
+                          int(bool(state))))
+
+        names = {n.id: indexes[n] for n in nodes}
+        names.update((id, indexes[n])
+                     for id, n in self.__nodes_by_name.items())
+
+        return (len(nodes), indexes[self.__gnd], indexes[self.__pwr],
+                bytes(pulls), trans.tobytes(), names)
+
     def __identify_group_of(self, n):
         nodes = []
         worklist = [n]
@@ -1722,6 +1756,7 @@ class Z80Simulator(object):
         self.__nreset = self.__nodes_by_name['~reset']
         self.__nrfsh = self.__nodes_by_name['~rfsh']
         self.__nwait = self.__nodes_by_name['~wait']
+        self.__nwr = self.__nodes_by_name['~wr']
 
         self.__t1 = self.__nodes_by_name['t1']
         self.__t2 = self.__nodes_by_name['t2']
@@ -1820,6 +1855,14 @@ class Z80Simulator(object):
     def rd(self):
         return ~self.nrd
 
+    @property
+    def nwr(self):
+        return self.__nwr.state
+
+    @property
+    def wr(self):
+        return ~self.nwr
+
     @property
     def nwait(self):
         return self.__nwait.state
@@ -1948,6 +1991,207 @@ class Z80Simulator(object):
             self.half_tick()
 
 
+class NativeZ80Simulator(object):
+    # Concrete simulation on the native engine. Build it with
+    # setup_native.py. Supports the subset of the Z80Simulator
+    # interface that makes sense for non-symbolic runs.
+
+    __DEFAULT_RESET_PROPAGATION_DELAY = 31
+
+    def __init__(self, *, memory=None, skip_reset=None):
+        import _z80sim_native
+
+        sim = Z80Simulator(image=_load_initial_image())
+        sim.clear_state()
+        (num_nodes, gnd, pwr,
+         pulls, trans, self.__names) = sim.export_netlist()
+        del sim
+
+        self.__engine = _z80sim_native.Engine(num_nodes, gnd, pwr,
+                                              pulls, trans)
+        self.__engine.power_up()
+
+        if memory is None:
+            self.__memory = None
+        else:
+            self.__memory = bytearray(0x10000)
+            self.__memory[:len(memory)] = memory
+
+        if not skip_reset:
+            self.reset()
+
+    def get_node(self, id):
+        return self.__names[id]
+
+    def get_node_state(self, n):
+        if isinstance(n, str):
+            n = self.__names[n]
+        return self.__engine.get_state(n)
+
+    def read_nodes(self, id, width=8):
+        return self.__engine.read_bits(
+            [self.__names[f'{id}{i}'] for i in range(width)])
+
+    def __set_node(self, id, pull):
+        n = self.__names[id]
+        self.__engine.set_pull(n, pull)
+        self.__engine.update([n])
+
+    def set_pin_pull(self, pin, pull):
+        assert pin in _PINS
+        self.__engine.set_pull(self.__names[pin], pull)
+
+    def update_pin(self, pin):
+        self.__engine.update([self.__names[pin]])
+
+    def __is_active(self, id):
+        return not self.get_node_state(id)
+
+    def half_tick(self):
+        if self.__memory is not None and self.clk:
+            if self.mreq and not self.rfsh and not self.iorq:
+                if self.m1 and self.rd and self.t2:
+                    self.dbus = self.__memory[self.abus]
+
+        self.nclk = not self.nclk
+
+    def reset(self, propagation_delay=__DEFAULT_RESET_PROPAGATION_DELAY,
+              waiting_for_m1_delay=None):
+        self.nclk = True
+
+        self.nreset = False
+        self.nbusrq = True
+        self.nint = True
+        self.nnmi = True
+        self.nwait = True
+
+        for _ in range(propagation_delay):
+            self.half_tick()
+
+        self.nreset = True
+
+        if waiting_for_m1_delay is None:
+            while not self.m1:
+                self.half_tick()
+        else:
+            for _ in range(waiting_for_m1_delay):
+                self.half_tick()
+
+    @property
+    def nclk(self):
+        return self.get_node_state('~clk')
+
+    @nclk.setter
+    def nclk(self, state):
+        self.__set_node('~clk', state)
+
+    @property
+    def clk(self):
+        return not self.nclk
+
+    @property
+    def m1(self):
+        return self.__is_active('~m1')
+
+    @property
+    def mreq(self):
+        return self.__is_active('~mreq')
+
+    @property
+    def iorq(self):
+        return self.__is_active('~iorq')
+
+    @property
+    def rd(self):
+        return self.__is_active('~rd')
+
+    @property
+    def wr(self):
+        return self.__is_active('~wr')
+
+    @property
+    def rfsh(self):
+        return self.__is_active('~rfsh')
+
+    def __set_pin(id):
+        def setter(self, state):
+            self.__set_node(id, state)
+        return property(lambda self: self.get_node_state(id), setter)
+
+    nreset = __set_pin('~reset')
+    nbusrq = __set_pin('~busrq')
+    nint = __set_pin('~int')
+    nnmi = __set_pin('~nmi')
+    nwait = __set_pin('~wait')
+
+    del __set_pin
+
+    t1 = property(lambda self: self.get_node_state('t1'))
+    t2 = property(lambda self: self.get_node_state('t2'))
+    t3 = property(lambda self: self.get_node_state('t3'))
+    t4 = property(lambda self: self.get_node_state('t4'))
+    t5 = property(lambda self: self.get_node_state('t5'))
+    t6 = property(lambda self: self.get_node_state('t6'))
+
+    @property
+    def abus(self):
+        return self.read_nodes('ab', 16)
+
+    @property
+    def dbus(self):
+        return self.read_nodes('db')
+
+    @dbus.setter
+    def dbus(self, n):
+        self.__engine.write_bits([self.__names[f'db{i}'] for i in range(8)],
+                                 n)
+
+    @property
+    def a(self):
+        return self.read_nodes('reg_a')
+
+    @property
+    def r(self):
+        return self.read_nodes('reg_r')
+
+    @property
+    def pc(self):
+        return (self.read_nodes('reg_pch') << 8) | self.read_nodes('reg_pcl')
+
+
+def test_native_engine():
+    # Runs the same program on both engines and compares the
+    # pins and a few registers on every half-tick.
+    memory = [
+        0x3e, 0x12,  # ld a, 0x12
+        0x05,  # dec b
+        0x0f,  # rrca
+        0xf6, 0x40,  # or 0x40
+        0xc5,  # push bc
+        0x7e,  # ld a, (hl)
+        0xfe, 0x0d,  # cp 0x0d
+    ]
+
+    def get_state(s):
+        return (int(s.abus), int(s.dbus), int(s.pc), int(s.a),
+                tuple(bool(s.get_node_state(s.get_node(p)))
+                      for p in _PINS))
+
+    # Also make sure the simulators can be constructed and reset
+    # without memory, as when recording bus traces.
+    for m in (memory, None):
+        sim = Z80Simulator(memory=m)
+        native = NativeZ80Simulator(memory=m)
+
+        for i in range(200):
+            expected, actual = get_state(sim), get_state(native)
+            assert expected == actual, (m is None, i, expected, actual)
+            sim.half_tick()
+            native.half_tick()
+
+    Status.print('native engine matches')
+
+
 class State(object):
     def __init__(self, other=None, *, cache_all_reportable_states=False):
         if other is None:
@@ -3561,6 +3805,10 @@ def main():
         test_computing_node_values()
         return
 
+    if '--test-native' in sys.argv:
+        test_native_engine()
+        return
+
     if '--play-sandbox' in sys.argv:
         play_sandbox()
         return
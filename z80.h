@@ -142,6 +142,8 @@ enum class block_out { outi, outd, otir, otdr };
 
 enum class condition { nz, z, nc, c, po, pe, p, m };
 
+static const fast_u32 address_space_size = 0x10000;  // 64K bytes.
+
 enum class z80_variant {
     common,
     cmos,  // Newer chips.
@@ -155,6 +157,7 @@ private:
 
     template<typename B> class decoder_base;
     template<typename B> class disasm_base;
+    template<typename B, typename R> class range_disasm_base;
     template<typename B> class cpu_state_base;
     template<typename B> class executor_base;
 
@@ -166,6 +169,9 @@ private:
     template<typename D> friend class i8080_disasm;
     template<typename D> friend class z80_disasm;
 
+    template<typename B> friend class range_disasm;
+    template<typename B> friend class range_decoder;
+
     template<typename B> friend class i8080_state;
     template<typename B> friend class z80_state;
 
@@ -1689,19 +1695,69 @@ public:
         unreachable("Unknown condition code.");
     }
 
+    // Disassembles an instruction along with its index-register
+    // prefix, if any, in a single pass. A prefix followed by
+    // another prefix or the end of the code only disables
+    // interrupts and is disassembled on its own as 'noni'. The
+    // next prefix is then left to the following instruction.
     void on_disassemble() { self().on_fetch_and_decode(); }
 
+    // Lets the disassembler see the byte following a prefix
+    // without consuming it. Returns false at the end of the code.
+    // Disassemblers that cannot look ahead keep this default,
+    // which assumes an instruction follows; a run of prefixes is
+    // then disassembled together with the instruction that ends
+    // it, the last prefix taking effect.
+    bool on_peek_next_byte(fast_u8 &n) {
+        n = 0x00;
+        return true;
+    }
+
+    void on_instr_prefix(iregp irp) {
+        if(decoding_prefixed_instr) {
+            base::on_instr_prefix(irp);
+            prefix_superseded = true;
+            return;
+        }
+
+        fast_u8 op;
+        if(!self().on_peek_next_byte(op) || op == 0xdd || op == 0xfd) {
+            self().on_set_iregp_kind(iregp::hl);
+            self().on_format("noni");
+            return;
+        }
+
+        base::on_instr_prefix(irp);
+        decoding_prefixed_instr = true;
+        do {
+            prefix_superseded = false;
+            self().on_fetch_and_decode();
+        } while(prefix_superseded);
+        decoding_prefixed_instr = false;
+    }
+
 protected:
     using base::self;
 
     class output_buff {
     public:
+        static const unsigned max_size = 32;
+
         output_buff() {}
 
+        // Formats directly into a caller-supplied buffer.
+        output_buff(char *buff)
+            : buff(buff)
+        {}
+
         const char *get_buff() const {
             return buff;
         }
 
+        unsigned get_size() const {
+            return size;
+        }
+
         void append(char c) {
             assert(size < max_size);
             buff[size++] = c;
@@ -1713,38 +1769,45 @@ protected:
         }
 
         void append_u8(fast_u8 n) {
-            char pad[32];
-            std::snprintf(pad, sizeof(pad), "0x%02x",
-                          static_cast<unsigned>(n));
-            append(pad);
+            append("0x");
+            append_hex(n, /* num_of_digits= */ 2);
         }
 
         void append_u(unsigned n) {
-            char pad[32];
-            std::snprintf(pad, sizeof(pad), "%u",
-                          static_cast<unsigned>(n));
-            append(pad);
+            char digits[16];
+            unsigned num_of_digits = 0;
+            do {
+                digits[num_of_digits++] = static_cast<char>('0' + n % 10);
+                n /= 10;
+            } while(n != 0);
+
+            while(num_of_digits != 0)
+                append(digits[--num_of_digits]);
         }
 
         void append_u16(fast_u16 n) {
-            char pad[32];
-            std::snprintf(pad, sizeof(pad), "0x%04x",
-                          static_cast<unsigned>(n));
-            append(pad);
+            append("0x");
+            append_hex(n, /* num_of_digits= */ 4);
         }
 
         void append_disp(int d) {
-            char pad[32];
-            std::snprintf(pad, sizeof(pad), "%c %d",
-                          static_cast<int>(d < 0 ? '-' : '+'),
-                          static_cast<int>(std::abs(d)));
-            append(pad);
+            append(d < 0 ? '-' : '+');
+            append(' ');
+            append_u(static_cast<unsigned>(std::abs(d)));
         }
 
     private:
-        static const unsigned max_size = 32;
+        void append_hex(fast_u16 n, unsigned num_of_digits) {
+            static const char hex_digits[] = "0123456789abcdef";
+            while(num_of_digits != 0) {
+                --num_of_digits;
+                append(hex_digits[(n >> (num_of_digits * 4)) & 0xf]);
+            }
+        }
+
         unsigned size = 0;
-        char buff[max_size];
+        char storage[max_size];
+        char *buff = storage;
     };
 
     template<typename T>
@@ -1945,6 +2008,10 @@ protected:
         }
         unreachable("Unknown block output operation.");
     }
+
+private:
+    bool decoding_prefixed_instr = false;
+    bool prefix_superseded = false;
 };
 
 // TODO: Split to a instructions verbalizer and a disassembler.
@@ -1957,6 +2024,875 @@ class z80_disasm
     : public internals::disasm_base<z80_decoder<z80_decoder_state<root<D>>>>
 {};
 
+// Disassembler output sinks for sink_disasm. Every sink provides
+// space for formatting an instruction with reserve(), takes the
+// formatted characters with commit() and writes other text, such
+// as addresses and separators, with write().
+
+// Writes to a caller-supplied buffer and keeps it null-terminated.
+// Output that does not fit is dropped.
+class buff_sink {
+public:
+    buff_sink(char *buff, std::size_t buff_size)
+        : buff(buff), buff_size(buff_size) {
+        assert(buff_size > 0);
+        clear();
+    }
+
+    const char *get_buff() const { return buff; }
+    std::size_t get_size() const { return size; }
+    bool is_truncated() const { return truncated; }
+
+    void clear() {
+        size = 0;
+        truncated = false;
+        buff[0] = '\0';
+    }
+
+    char *reserve(unsigned max_size) {
+        assert(max_size <= max_scratch_size);
+        reserved = size + max_size < buff_size ? buff + size : scratch;
+        return reserved;
+    }
+
+    void commit(unsigned n) {
+        if(reserved == scratch) {
+            write(scratch, n);
+        } else {
+            size += n;
+            buff[size] = '\0';
+        }
+    }
+
+    void write(const char *str) {
+        std::size_t n = 0;
+        while(str[n] != '\0')
+            ++n;
+        write(str, n);
+    }
+
+private:
+    void write(const char *chars, std::size_t n) {
+        for(std::size_t i = 0; i != n; ++i) {
+            if(size + 1 == buff_size) {
+                truncated = true;
+                break;
+            }
+            buff[size++] = chars[i];
+        }
+        buff[size] = '\0';
+    }
+
+    static const unsigned max_scratch_size = 32;
+
+    char *buff;
+    std::size_t buff_size;
+    std::size_t size = 0;
+    bool truncated = false;
+    char *reserved = nullptr;
+    char scratch[max_scratch_size];
+};
+
+// Appends to a string-like object, e.g., std::string or
+// std::vector<char>, that supports size(), resize() and
+// subscripting.
+template<typename S>
+class string_sink {
+public:
+    string_sink(S &str)
+        : str(str)
+    {}
+
+    char *reserve(unsigned max_size) {
+        reserved_pos = str.size();
+        str.resize(reserved_pos + max_size);
+        return &str[reserved_pos];
+    }
+
+    void commit(unsigned n) {
+        str.resize(reserved_pos + n);
+    }
+
+    void write(const char *s) {
+        for(; *s != '\0'; ++s)
+            str.push_back(*s);
+    }
+
+private:
+    S &str;
+    typename S::size_type reserved_pos = 0;
+};
+
+// Writes to a stdio stream.
+class file_sink {
+public:
+    file_sink(std::FILE *f)
+        : f(f)
+    {}
+
+    char *reserve(unsigned max_size) {
+        assert(max_size <= max_scratch_size);
+        unused(max_size);
+        return scratch;
+    }
+
+    void commit(unsigned n) {
+        std::fwrite(scratch, /* size= */ 1, n, f);
+    }
+
+    void write(const char *str) {
+        std::fputs(str, f);
+    }
+
+private:
+    static const unsigned max_scratch_size = 32;
+
+    std::FILE *f;
+    char scratch[max_scratch_size];
+};
+
+// Formats instructions directly into a sink instead of emitting
+// them with on_emit(). Meant to be used on top of i8080_disasm or
+// z80_disasm.
+template<typename B, typename S>
+class sink_disasm : public B {
+public:
+    typedef B base;
+    typedef S sink_type;
+
+    sink_disasm() {}
+
+    sink_type *get_sink() const { return sink; }
+    void set_sink(sink_type *s) { sink = s; }
+
+    void on_format_impl(const char *fmt, const void *args[]) {
+        typedef typename base::output_buff output_buff;
+        output_buff out(sink->reserve(output_buff::max_size));
+        for(const char *p = fmt; *p != '\0'; ++p)
+            self().on_format_char(*p, args, out);
+        sink->commit(out.get_size());
+    }
+
+protected:
+    using base::self;
+
+private:
+    sink_type *sink = nullptr;
+};
+
+// An instruction disassembled by disasm_range().
+struct disasm_record {
+    static const unsigned max_text_size = 32;
+
+    fast_u16 addr;
+    unsigned size;
+    char text[max_text_size];
+};
+
+enum class operand_kind {
+    none,
+    literal,    // Operands that have no enumerator, e.g., af'.
+    reg,        // value is a reg.
+    regp,       // value is a regp.
+    regp2,      // value is a regp2.
+    condition,  // value is a condition.
+    imm8,
+    imm16,
+    rel,        // value is the target address, disp is the offset.
+    number,     // Bit numbers, interrupt modes and the like.
+};
+
+// An operand of an instruction decoded by decode_range(). Note
+// that reg::at_hl operands refer to memory regardless of whether
+// they are marked as indirect.
+struct instr_operand {
+    static const unsigned max_text_size = 4;
+
+    operand_kind kind;
+    bool indirect;  // Enclosed in parentheses, e.g., (nn) or (c).
+    unsigned value;
+    iregp irp;      // The index register for reg, regp and regp2.
+    int disp;
+    char text[max_text_size];
+};
+
+// An instruction decoded by decode_range().
+struct decoded_instr {
+    static const unsigned max_mnemonic_size = 8;
+    static const unsigned max_num_of_operands = 3;
+
+    fast_u16 addr;
+    unsigned size;
+    char mnemonic[max_mnemonic_size];
+    unsigned num_of_operands;
+    instr_operand operands[max_num_of_operands];
+};
+
+template<typename B, typename R>
+class internals::range_disasm_base : public B {
+public:
+    typedef B base;
+
+    range_disasm_base() {}
+
+    fast_u8 on_read_next_byte() {
+        // Bytes past the end of the image read as zeros, so the
+        // last instruction may extend past it.
+        std::size_t offset = record_offset + record->size++;
+        return offset < image_size ? image[offset] : 0;
+    }
+
+    bool on_peek_next_byte(fast_u8 &n) {
+        std::size_t offset = record_offset + record->size;
+        if(offset >= image_size)
+            return false;
+        n = image[offset];
+        return true;
+    }
+
+protected:
+    using base::self;
+
+    std::size_t disasm_records(const least_u8 *image, std::size_t image_size,
+                               fast_u16 base_addr, R *records,
+                               std::size_t max_records) {
+        this->image = image;
+        this->image_size = image_size;
+
+        std::size_t num_records = 0;
+        record_offset = 0;
+        while(record_offset < image_size && num_records < max_records) {
+            record = &records[num_records++];
+            *record = R();
+            record->addr = mask16(static_cast<fast_u16>(base_addr +
+                                                       record_offset));
+
+            self().on_set_iregp_kind(iregp::hl);
+            self().on_disassemble();
+
+            record_offset += record->size;
+        }
+
+        return num_records;
+    }
+
+    R &get_record() {
+        return *record;
+    }
+
+private:
+    const least_u8 *image = nullptr;
+    std::size_t image_size = 0;
+    std::size_t record_offset = 0;
+    R *record = nullptr;
+};
+
+// Disassembles whole memory ranges in a single call. Meant to be
+// used on top of i8080_disasm or z80_disasm.
+template<typename B>
+class range_disasm
+    : public internals::range_disasm_base<B, disasm_record> {
+public:
+    typedef internals::range_disasm_base<B, disasm_record> base;
+
+    range_disasm() {}
+
+    void on_format_impl(const char *fmt, const void *args[]) {
+        static_assert(disasm_record::max_text_size ==
+                          base::output_buff::max_size,
+                      "Records shall fit formatted instructions.");
+        typename base::output_buff out(base::get_record().text);
+        for(const char *p = fmt; *p != '\0'; ++p)
+            self().on_format_char(*p, args, out);
+        out.append('\0');
+    }
+
+    // Disassembles instructions of an image mapped at the specified
+    // address into the given buffer until either the image or the
+    // buffer are exhausted. An image of N bytes never takes more
+    // than N records. Returns the number of records produced.
+    std::size_t disasm_range(const least_u8 *image, std::size_t image_size,
+                             fast_u16 base_addr, disasm_record *records,
+                             std::size_t max_records) {
+        return base::disasm_records(image, image_size, base_addr, records,
+                                    max_records);
+    }
+
+protected:
+    using base::self;
+};
+
+// Same as range_disasm, but produces decoded_instr records
+// describing mnemonics and operands instead of text. Meant to be
+// used on top of i8080_disasm or z80_disasm.
+template<typename B>
+class range_decoder
+    : public internals::range_disasm_base<B, decoded_instr> {
+public:
+    typedef internals::range_disasm_base<B, decoded_instr> base;
+
+    range_decoder() {}
+
+    void on_format_impl(const char *fmt, const void *args[]) {
+        decoded_instr &instr = base::get_record();
+
+        // The mnemonic. Conditions embedded into i8080 mnemonics,
+        // such as in 'jnz', are also recorded as operands.
+        const char *p = fmt;
+        unsigned size = 0;
+        for(; *p != '\0' && *p != ' '; ++p) {
+            const char *part;
+            switch(*p) {
+            case 'A': {
+                auto k = get_arg<alu>(args);
+                if(!self().on_is_z80()) {
+                    part = base::get_mnemonic_r(k);
+                } else {
+                    part = base::get_mnemonic(k);
+                    if(base::is_two_operand_alu_instr(k))
+                        add_operand(operand_kind::reg).value =
+                            static_cast<unsigned>(reg::a);
+                }
+                break; }
+            case 'B':
+                part = base::get_mnemonic_imm(get_arg<alu>(args));
+                break;
+            case 'C': {
+                auto cc = get_arg<condition>(args);
+                add_operand(operand_kind::condition).value =
+                    static_cast<unsigned>(cc);
+                part = base::get_condition_name(cc);
+                break; }
+            case 'O':
+                part = base::get_mnemonic(get_arg<rot>(args));
+                break;
+            case 'L':
+                part = base::get_mnemonic(get_arg<block_ld>(args));
+                break;
+            case 'M':
+                part = base::get_mnemonic(get_arg<block_cp>(args));
+                break;
+            case 'I':
+                part = base::get_mnemonic(get_arg<block_in>(args));
+                break;
+            case 'T':
+                part = base::get_mnemonic(get_arg<block_out>(args));
+                break;
+            default:
+                assert(size + 1 < decoded_instr::max_mnemonic_size);
+                instr.mnemonic[size++] = *p;
+                continue;
+            }
+            for(; *part != '\0'; ++part) {
+                assert(size + 1 < decoded_instr::max_mnemonic_size);
+                instr.mnemonic[size++] = *part;
+            }
+        }
+        instr.mnemonic[size] = '\0';
+
+        // Comma-separated operands.
+        while(*p != '\0') {
+            while(*p == ' ' || *p == ',')
+                ++p;
+            const char *end = p;
+            while(*end != '\0' && *end != ',')
+                ++end;
+            decode_operand(p, end, args);
+            p = end;
+        }
+    }
+
+    // Decodes instructions of an image mapped at the specified
+    // address the same way disasm_range() disassembles them.
+    std::size_t decode_range(const least_u8 *image, std::size_t image_size,
+                             fast_u16 base_addr, decoded_instr *instrs,
+                             std::size_t max_instrs) {
+        return base::disasm_records(image, image_size, base_addr, instrs,
+                                    max_instrs);
+    }
+
+protected:
+    using base::self;
+
+private:
+    template<typename T>
+    static T get_arg(const void **&args) {
+        return base::template get_arg<T>(args);
+    }
+
+    instr_operand &add_operand(operand_kind kind) {
+        decoded_instr &instr = base::get_record();
+        assert(instr.num_of_operands < decoded_instr::max_num_of_operands);
+        instr_operand &op = instr.operands[instr.num_of_operands++];
+        op.kind = kind;
+        op.irp = iregp::hl;
+        return op;
+    }
+
+    void decode_operand(const char *begin, const char *end,
+                        const void **&args) {
+        bool indirect = *begin == '(';
+        if(indirect) {
+            assert(end[-1] == ')');
+            ++begin;
+            --end;
+        }
+
+        std::size_t size = static_cast<std::size_t>(end - begin);
+        bool z80 = self().on_is_z80();
+        if(size != 1 || *begin < 'A' || *begin > 'Z') {
+            add_literal_operand(begin, size).indirect = indirect;
+            return;
+        }
+
+        instr_operand *op;
+        switch(*begin) {
+        case 'C': {  // A condition.
+            op = &add_operand(operand_kind::condition);
+            op->value = static_cast<unsigned>(get_arg<condition>(args));
+            break; }
+        case 'D': {  // A relative address.
+            int d = get_arg<int>(args);
+            op = &add_operand(operand_kind::rel);
+            op->value = static_cast<unsigned>(add16(
+                base::get_record().addr, static_cast<fast_u16>(d)));
+            op->disp = d;
+            break; }
+        case 'G': {  // An alternative register pair.
+            auto rp = get_arg<regp2>(args);
+            auto irp = !z80 ? iregp::hl : get_arg<iregp>(args);
+            op = &add_operand(operand_kind::regp2);
+            op->value = static_cast<unsigned>(rp);
+            op->irp = rp == regp2::hl ? irp : iregp::hl;
+            break; }
+        case 'N':  // An 8-bit immediate.
+            op = &add_operand(operand_kind::imm8);
+            op->value = static_cast<unsigned>(get_arg<fast_u8>(args));
+            break;
+        case 'P': {  // A register pair.
+            auto rp = get_arg<regp>(args);
+            auto irp = !z80 ? iregp::hl : get_arg<iregp>(args);
+            op = &add_operand(operand_kind::regp);
+            op->value = static_cast<unsigned>(rp);
+            op->irp = rp == regp::hl ? irp : iregp::hl;
+            break; }
+        case 'R': {  // A register.
+            auto r = get_arg<reg>(args);
+            auto irp = !z80 ? iregp::hl : get_arg<iregp>(args);
+            auto d = !z80 ? 0 : get_arg<fast_u8>(args);
+            op = &add_operand(operand_kind::reg);
+            op->value = static_cast<unsigned>(r);
+            if(base::is_indexable(r))
+                op->irp = irp;
+            if(r == reg::at_hl && op->irp != iregp::hl)
+                op->disp = sign_extend8(d);
+            break; }
+        case 'W':  // A 16-bit immediate.
+            op = &add_operand(operand_kind::imm16);
+            op->value = static_cast<unsigned>(get_arg<fast_u16>(args));
+            break;
+        case 'U':  // A decimal number.
+            op = &add_operand(operand_kind::number);
+            op->value = get_arg<unsigned>(args);
+            break;
+        default:
+            unreachable("Unknown operand specifier.");
+        }
+        op->indirect = indirect;
+    }
+
+    instr_operand &add_literal_operand(const char *text, std::size_t size) {
+        struct named_operand {
+            const char *name;
+            operand_kind kind;
+            unsigned value;
+        };
+
+        static const named_operand named_operands[] = {
+            { "a", operand_kind::reg, static_cast<unsigned>(reg::a) },
+            { "c", operand_kind::reg, static_cast<unsigned>(reg::c) },
+            { "bc", operand_kind::regp, static_cast<unsigned>(regp::bc) },
+            { "de", operand_kind::regp, static_cast<unsigned>(regp::de) },
+            { "hl", operand_kind::regp, static_cast<unsigned>(regp::hl) },
+            { "sp", operand_kind::regp, static_cast<unsigned>(regp::sp) },
+            { "af", operand_kind::regp2, static_cast<unsigned>(regp2::af) },
+        };
+
+        for(const named_operand &n : named_operands) {
+            std::size_t i = 0;
+            while(i != size && n.name[i] == text[i])
+                ++i;
+            if(i == size && n.name[i] == '\0') {
+                instr_operand &op = add_operand(n.kind);
+                op.value = n.value;
+                return op;
+            }
+        }
+
+        instr_operand &op = add_operand(operand_kind::literal);
+        assert(size < instr_operand::max_text_size);
+        std::size_t i = 0;
+        for(; i != size && i + 1 < instr_operand::max_text_size; ++i)
+            op.text[i] = text[i];
+        op.text[i] = '\0';
+        return op;
+    }
+};
+
+// Kinds of control flow of traced instructions.
+class instr_flow {
+public:
+    typedef least_u8 type;
+
+    static const type falls_through = 1 << 0;  // Continues with the next
+                                               // instruction.
+    static const type jump = 1 << 1;           // To a known address.
+    static const type call = 1 << 2;           // Ditto.
+    static const type indirect = 1 << 3;       // JP (HL) and the like.
+    static const type ret = 1 << 4;            // Including conditional
+                                               // returns.
+};
+
+// A sequence of instructions entered only at its start and only
+// left after its last instruction.
+struct basic_block {
+    fast_u16 addr;
+    unsigned size;  // In bytes.
+    unsigned num_of_instrs;
+    fast_u16 last_instr_addr;
+
+    // The flow of the last instruction. Blocks that end because
+    // the next instruction starts another block fall through.
+    instr_flow::type flow;
+
+    // The jump or call target, if any and within the address
+    // space.
+    bool has_target;
+    fast_u16 target;
+};
+
+// Follows control flow from entry points to find instructions
+// reachable from them. Jumps, calls, relative branches and
+// restarts are followed; returns and indirect jumps end flows.
+// Only bytes set with set_byte() are decoded and, like with the
+// rest of the tracing, addresses do not wrap around. Meant to be
+// used on top of i8080_disasm or z80_disasm. The tracer is large
+// enough to not be allocated on the stack.
+template<typename B>
+class code_tracer : public B {
+public:
+    typedef B base;
+
+    // Marks of memory bytes.
+    static const least_u8 defined_mark = 1 << 0;  // Set with set_byte().
+    static const least_u8 instr_mark = 1 << 1;    // Starts an instruction.
+    static const least_u8 code_mark = 1 << 2;     // Belongs to one.
+    static const least_u8 overlap_mark = 1 << 3;  // Starts an instruction
+                                                  // within another one.
+    static const least_u8 block_mark = 1 << 4;    // Starts a basic block.
+    static const least_u8 entry_mark = 1 << 5;    // Set with add_entry().
+
+    code_tracer() {}
+
+    fast_u8 get_byte(fast_u16 addr) const {
+        return memory[addr];
+    }
+
+    void set_byte(fast_u16 addr, fast_u8 n) {
+        memory[addr] = static_cast<least_u8>(n);
+        marks[addr] |= defined_mark;
+    }
+
+    least_u8 get_marks(fast_u16 addr) const {
+        return marks[addr];
+    }
+
+    // Returns zero for addresses that do not start instructions.
+    unsigned get_instr_size(fast_u16 addr) const {
+        return instr_sizes[addr];
+    }
+
+    instr_flow::type get_instr_flow(fast_u16 addr) const {
+        return instr_flows[addr];
+    }
+
+    // Returns whether the instruction jumps to or calls a known
+    // address within the address space.
+    bool get_instr_target(fast_u16 addr, fast_u16 &target) const {
+        target = targets[addr];
+        return (instr_flows[addr] & (instr_flow::jump | instr_flow::call)) &&
+               (marks[addr] & target_mark);
+    }
+
+    // Returns false for addresses that do not start basic
+    // blocks.
+    bool get_block(fast_u16 addr, basic_block &block) const {
+        if((marks[addr] & (instr_mark | block_mark)) !=
+               (instr_mark | block_mark))
+            return false;
+
+        block.addr = addr;
+        block.size = 0;
+        block.num_of_instrs = 0;
+        for(;;) {
+            auto last = static_cast<fast_u16>(addr + block.size);
+            instr_flow::type flow = instr_flows[last];
+            block.size += instr_sizes[last];
+            ++block.num_of_instrs;
+
+            fast_u32 next = addr + block.size;
+            if(ends_block(flow) || next >= address_space_size ||
+                   (marks[next] & (instr_mark | block_mark)) != instr_mark) {
+                block.last_instr_addr = last;
+                block.flow = flow;
+                block.has_target = get_instr_target(last, block.target);
+                return true;
+            }
+        }
+    }
+
+    void add_entry(fast_u16 addr) {
+        marks[addr] |= entry_mark;
+        queue(addr);
+    }
+
+    // Traces instructions reachable from the entry points added
+    // since the last call.
+    void trace() {
+        while(queue_size != 0) {
+            fast_u16 addr = work_queue[--queue_size];
+
+            instr_addr = addr;
+            instr_size = 0;
+            is_truncated = false;
+            falls_through = true;
+            has_target = false;
+            flow = 0;
+
+            self().on_set_iregp_kind(iregp::hl);
+            self().on_disassemble();
+
+            // Instructions that extend past the defined bytes
+            // cannot be decoded.
+            if(is_truncated)
+                continue;
+
+            instr_sizes[addr] = static_cast<least_u8>(instr_size);
+            marks[addr] |= instr_mark;
+            for(unsigned i = 0; i != instr_size; ++i)
+                marks[addr + i] |= code_mark;
+
+            if(falls_through)
+                flow |= instr_flow::falls_through;
+            instr_flows[addr] = flow;
+
+            if(falls_through)
+                queue(addr + instr_size);
+            if(has_target && target < address_space_size) {
+                marks[addr] |= target_mark;
+                targets[addr] = static_cast<least_u16>(target);
+                queue(target);
+            }
+        }
+
+        mark_overlaps();
+        mark_blocks();
+    }
+
+    // Forgets traced instructions and loaded bytes.
+    void clear() {
+        for(fast_u32 addr = 0; addr != address_space_size; ++addr) {
+            marks[addr] = 0;
+            instr_sizes[addr] = 0;
+            instr_flows[addr] = 0;
+        }
+        queue_size = 0;
+    }
+
+    // Adds instructions traced by another tracer from the same
+    // image, e.g., one that traced other entry points in parallel.
+    // The result is the same as if all the entry points were
+    // traced by this tracer.
+    void merge(const code_tracer &other) {
+        const least_u8 traced_marks = instr_mark | code_mark | entry_mark |
+                                      target_mark | queued_mark;
+        for(fast_u32 addr = 0; addr != address_space_size; ++addr) {
+            if(other.instr_sizes[addr] != 0) {
+                instr_sizes[addr] = other.instr_sizes[addr];
+                instr_flows[addr] = other.instr_flows[addr];
+                targets[addr] = other.targets[addr];
+            }
+            marks[addr] |= other.marks[addr] & traced_marks;
+        }
+        mark_overlaps();
+        mark_blocks();
+    }
+
+    fast_u8 on_read_next_byte() {
+        fast_u32 addr = instr_addr + instr_size++;
+        if(addr >= address_space_size || !(marks[addr] & defined_mark)) {
+            is_truncated = true;
+            return 0;
+        }
+        return memory[addr];
+    }
+
+    bool on_peek_next_byte(fast_u8 &n) {
+        fast_u32 addr = instr_addr + instr_size;
+        if(addr >= address_space_size || !(marks[addr] & defined_mark))
+            return false;
+        n = memory[addr];
+        return true;
+    }
+
+    // Only sizes and control flow of instructions are of interest.
+    void on_format_impl(const char *fmt, const void *args[]) {
+        unused(fmt, args);
+    }
+
+    void on_call_nn(fast_u16 nn) { call(nn); }
+    void on_xcall_nn(fast_u8 op, fast_u16 nn) {
+        unused(op);
+        call(nn); }
+    void on_call_cc_nn(condition cc, fast_u16 nn) {
+        unused(cc);
+        call(nn); }
+    void on_rst(fast_u16 nn) { call(nn); }
+
+    void on_jp_nn(fast_u16 nn) { jump(nn, /* conditional= */ false); }
+    void on_xjp_nn(fast_u16 nn) { jump(nn, /* conditional= */ false); }
+    void on_jp_cc_nn(condition cc, fast_u16 nn) {
+        unused(cc);
+        jump(nn, /* conditional= */ true); }
+    void on_jp_irp() {
+        flow = instr_flow::indirect;
+        falls_through = false; }
+
+    void on_jr(fast_u8 d) { jump_rel(d, /* conditional= */ false); }
+    void on_jr_cc(condition cc, fast_u8 d) {
+        unused(cc);
+        jump_rel(d, /* conditional= */ true); }
+    void on_djnz(fast_u8 d) { jump_rel(d, /* conditional= */ true); }
+
+    void on_ret() { ret(/* conditional= */ false); }
+    void on_xret() { ret(/* conditional= */ false); }
+    void on_ret_cc(condition cc) {
+        unused(cc);
+        ret(/* conditional= */ true); }
+    void on_reti() { ret(/* conditional= */ false); }
+    void on_retn() { ret(/* conditional= */ false); }
+    void on_xretn(fast_u8 op) {
+        unused(op);
+        ret(/* conditional= */ false); }
+
+protected:
+    using base::self;
+
+private:
+    // Marks instructions starting within other instructions.
+    void mark_overlaps() {
+        for(fast_u32 addr = 0; addr != address_space_size; ++addr) {
+            for(unsigned i = 1; i < instr_sizes[addr]; ++i) {
+                if(marks[addr + i] & instr_mark)
+                    marks[addr + i] |= overlap_mark;
+            }
+        }
+    }
+
+    static bool ends_block(instr_flow::type flow) {
+        return flow != instr_flow::falls_through;
+    }
+
+    // Marks instructions that start basic blocks: entry points,
+    // targets of jumps and calls, overlapping instructions and
+    // instructions following ones that end blocks or overlap.
+    // The latter makes sure instructions two others fall through
+    // to start their own blocks.
+    void mark_blocks() {
+        for(fast_u32 addr = 0; addr != address_space_size; ++addr) {
+            marks[addr] &= static_cast<least_u8>(~block_mark);
+            if(marks[addr] & (entry_mark | overlap_mark))
+                marks[addr] |= block_mark;
+        }
+
+        for(fast_u32 addr = 0; addr != address_space_size; ++addr) {
+            if(!(marks[addr] & instr_mark))
+                continue;
+
+            if(marks[addr] & target_mark)
+                marks[targets[addr]] |= block_mark;
+
+            instr_flow::type flow = instr_flows[addr];
+            fast_u32 next = addr + instr_sizes[addr];
+            if(!(flow & instr_flow::falls_through) ||
+                   next >= address_space_size)
+                continue;
+
+            if(ends_block(flow) || (marks[addr] & overlap_mark))
+                marks[next] |= block_mark;
+        }
+    }
+
+    void queue(fast_u32 addr) {
+        if(addr >= address_space_size || !(marks[addr] & defined_mark) ||
+               (marks[addr] & queued_mark))
+            return;
+
+        marks[addr] |= queued_mark;
+        work_queue[queue_size++] = static_cast<least_u16>(addr);
+    }
+
+    void jump(fast_u16 nn, bool conditional) {
+        flow = instr_flow::jump;
+        falls_through = conditional;
+        has_target = true;
+        target = nn;
+    }
+
+    void call(fast_u16 nn) {
+        jump(nn, /* conditional= */ true);
+        flow = instr_flow::call;
+    }
+
+    void jump_rel(fast_u8 d, bool conditional) {
+        int addr = static_cast<int>(instr_addr) + sign_extend8(d) + 2;
+        flow = instr_flow::jump;
+        falls_through = conditional;
+        if(addr >= 0) {
+            has_target = true;
+            target = static_cast<fast_u32>(addr);
+        }
+    }
+
+    void ret(bool conditional) {
+        flow = instr_flow::ret;
+        falls_through = conditional;
+    }
+
+    // Set for instructions with known targets.
+    static const least_u8 target_mark = 1 << 6;
+
+    // Set for addresses that have ever been queued.
+    static const least_u8 queued_mark = 1 << 7;
+
+    least_u8 memory[address_space_size] = {};
+    least_u8 marks[address_space_size] = {};
+    least_u8 instr_sizes[address_space_size] = {};
+    instr_flow::type instr_flows[address_space_size] = {};
+    least_u16 targets[address_space_size] = {};
+
+    least_u16 work_queue[address_space_size];
+    std::size_t queue_size = 0;
+
+    fast_u16 instr_addr = 0;
+    unsigned instr_size = 0;
+    bool is_truncated = false;
+    bool falls_through = false;
+    bool has_target = false;
+    fast_u32 target = 0;
+    instr_flow::type flow = 0;
+};
+
 // Provides access to the value of a 16-bit register. Supposed to
 // be as efficient as possible.
 class reg16_value {
@@ -2659,7 +3595,8 @@ protected:
                 return ((flags >> (cf_bit + 8)) ^ n ^ 1) & 0x1;
             case condition::po:
             case condition::pe:
-                return ((pf_log(res8) | (flags >> (pf_bit + 8))) ^ n ^ 1) & 0x1;
+                return (((pf_log(res8) | (flags >> 8)) >> pf_bit) ^
+                            n ^ 1) & 0x1;
             case condition::p:
             case condition::m:
                 return (((flags >> (sf_bit + 8)) |
@@ -3889,8 +4826,6 @@ template<typename D>
 class z80_cpu : public z80_executor<z80_decoder<z80_state<root<D>>>>
 {};
 
-static const fast_u32 address_space_size = 0x10000;  // 64K bytes.
-
 template<typename B>
 class machine_memory : public B {
 public:
@@ -3987,6 +4922,23 @@ public:
         unmark_addr(addr, state_fields::breakpoint_mark);
     }
 
+    // For saving and restoring the state.
+    ticks_type get_frame_tick() const {
+        return fields.frame_tick;
+    }
+
+    void set_frame_tick(ticks_type tick) {
+        fields.frame_tick = tick % state_fields::ticks_per_frame;
+    }
+
+    const least_u8 *get_address_marks() const {
+        return fields.address_marks;
+    }
+
+    least_u8 *get_address_marks() {
+        return fields.address_marks;
+    }
+
     void on_tick(unsigned t) {
         base::on_tick(t);
 
@@ -4044,6 +4996,97 @@ template<typename D>
 class z80_machine : public machine_memory<machine_state<z80_cpu<D>>>
 {};
 
+// The number of ticks an instruction takes and the address
+// execution continues at.
+struct instr_timing {
+    fast_u16 next_pc;
+    unsigned ticks;
+};
+
+// Measures timings of single instructions by executing them in
+// register setups that exercise both outcomes of conditional
+// jumps, calls and returns, as well as both terminating and
+// repeating iterations of DJNZ and block instructions.
+template<typename B>
+class instr_timer : public B {
+public:
+    typedef B base;
+
+    static const unsigned num_of_setups = 4;
+
+    instr_timer() {}
+
+    fast_u8 on_read(fast_u16 addr) {
+        return memory[addr];
+    }
+
+    void on_write(fast_u16 addr, fast_u8 n) {
+        memory[addr] = static_cast<least_u8>(n);
+    }
+
+    void on_tick(unsigned t) {
+        ticks += t;
+    }
+
+    // Executes the instruction of the specified size mapped at
+    // the specified address once in every setup and stores the
+    // results in the given array of num_of_setups timings.
+    void time_instr(const least_u8 *bytes, unsigned size, fast_u16 addr,
+                    instr_timing *timings) {
+        static const fast_u8 flags[] = { 0x00, 0xff };
+        static const fast_u16 counters[] = { 0x0001, 0x0101 };
+
+        // Keep the data and the stack away from the instruction.
+        // Returns go to an address that cannot be that of the
+        // next instruction.
+        fast_u16 data_addr = addr ^ 0x4000;
+        fast_u16 stack_addr = addr ^ 0x8000;
+        fast_u16 end_addr = mask16(addr + size);
+
+        unsigned n = 0;
+        for(fast_u8 f : flags) {
+            for(fast_u16 counter : counters) {
+                self().on_reset();
+                for(unsigned i = 0; i != size; ++i)
+                    memory[mask16(addr + i)] = bytes[i];
+
+                // Make sure CPIR and friends do not match.
+                self().on_set_a(0x00);
+                memory[data_addr] = 0xff;
+
+                on_write(stack_addr, get_low8(stack_addr));
+                on_write(mask16(stack_addr + 1), get_high8(stack_addr));
+
+                self().on_set_f(f);
+                self().on_set_bc(counter);
+                self().on_set_de(data_addr);
+                self().on_set_hl(data_addr);
+                self().on_set_sp(stack_addr);
+                self().on_set_pc(addr);
+
+                // Prefixes are executed as separate steps, unless
+                // they are standalone instructions.
+                ticks = 0;
+                do {
+                    self().on_step();
+                } while(self().on_get_iregp_kind() != iregp::hl &&
+                            self().on_get_pc() != end_addr);
+
+                timings[n].next_pc = self().on_get_pc();
+                timings[n].ticks = ticks;
+                ++n;
+            }
+        }
+    }
+
+protected:
+    using base::self;
+
+private:
+    unsigned ticks = 0;
+    least_u8 memory[address_space_size] = {};
+};
+
 }  // namespace z80
 
 #endif  // Z80_H
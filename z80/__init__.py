@@ -7,6 +7,7 @@
 #
 #   Published under the MIT license.
 
+from ._cfg import BasicBlock, ControlFlowGraph
 from ._disasm import _Disasm, Z80InstrBuilder
 from ._error import Error
 from ._instr import (ADD, ADC, AND, CP, OR, SBC, SUB, XOR, BIT, CALL, CCF, CPL,
@@ -18,7 +19,8 @@ from ._instr import (ADD, ADC, AND, CP, OR, SBC, SUB, XOR, BIT, CALL, CCF, CPL,
                      RST, SCF, SET, A, AF, AF2, CF, M, NC, NZ, PO, P, Z, DE,
                      BC, HL, IReg, IY, IX, SP, B, C, D, E, H, L, UnknownInstr,
                      JumpInstr, CallInstr, RetInstr, At, IndexReg, Add)
-from ._machine import I8080Machine, Z80Machine
+from ._machine import I8080Machine, Z80Machine, run_machines
 from ._main import main
 from ._source import _SourceFile
+from ._timing import RoutineTiming, TimingAnalyser
 from ._disasm_parser import _DisasmTagParser
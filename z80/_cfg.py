@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+#   Z80 CPU Emulator.
+#   https://github.com/kosarev/z80
+#
+#   Copyright (C) 2017-2021 Ivan Kosarev.
+#   ivan@kosarev.info
+#
+#   Published under the MIT license.
+
+from ._machine import Z80Machine
+
+_ADDRESS_SPACE_SIZE = 0x10000
+
+
+class BasicBlock(object):
+    # Kinds of control flow, as in z80::instr_flow.
+    _FALLS_THROUGH = 1 << 0
+    _JUMP = 1 << 1
+    _CALL = 1 << 2
+    _INDIRECT = 1 << 3
+    _RET = 1 << 4
+
+    def __init__(self, addr, size, num_of_instrs, last_instr_addr, flow,
+                 target):
+        self.addr = addr
+        self.size = size
+        self.num_of_instrs = num_of_instrs
+        self.last_instr_addr = last_instr_addr
+        self.flow = flow
+
+        # The jump or call target of the last instruction, if
+        # known.
+        self.target = target
+
+    def __repr__(self):
+        return 'BasicBlock(%#06x, %d)' % (self.addr, self.size)
+
+    @property
+    def falls_through(self):
+        return bool(self.flow & self._FALLS_THROUGH)
+
+    @property
+    def is_call(self):
+        return bool(self.flow & self._CALL)
+
+    @property
+    def is_indirect_jump(self):
+        return bool(self.flow & self._INDIRECT)
+
+    @property
+    def is_return(self):
+        return bool(self.flow & self._RET)
+
+    # Addresses control may pass to within the routine. Called
+    # routines are not successors; they are expected to return
+    # to the next block.
+    @property
+    def successors(self):
+        succs = []
+        if self.flow & self._JUMP and self.target is not None:
+            succs.append(self.target)
+        if self.falls_through and self.addr + self.size < _ADDRESS_SPACE_SIZE:
+            succs.append(self.addr + self.size)
+        return succs
+
+    @property
+    def callee(self):
+        return self.target if self.is_call else None
+
+
+# The basic-block control flow graph of code reachable from the
+# given entry points of an image mapped at the specified
+# address. Control is supposed to return from calls.
+class ControlFlowGraph(object):
+    def __init__(self, image, entries, base_addr=0, machine=Z80Machine):
+        self.__machine = machine
+
+        self.__image = bytearray(_ADDRESS_SPACE_SIZE)
+        defined = bytearray(_ADDRESS_SPACE_SIZE)
+        for i, b in enumerate(image):
+            addr = (base_addr + i) % _ADDRESS_SPACE_SIZE
+            self.__image[addr] = b
+            defined[addr] = 1
+
+        # Maps start addresses to blocks in address order.
+        self.blocks = dict()
+        for block in machine._build_cfg(bytes(self.__image), bytes(defined),
+                                        entries):
+            self.blocks[block[0]] = BasicBlock(*block)
+
+    def get_block(self, addr):
+        return self.blocks.get(addr)
+
+    def get_instrs(self, block):
+        addr = block.addr
+        for _ in range(block.num_of_instrs):
+            text, size = self.__machine._disasm_text(
+                bytes(self.__image[addr:addr + 4]))
+            yield addr, size, text
+            addr += size
+
+    # Returns the graph in the DOT language of Graphviz. Calls
+    # and indirect jumps are shown with dashed edges.
+    def to_dot(self, name='cfg'):
+        def g():
+            yield 'digraph %s {\n' % name
+            yield '  node [shape=box, fontname=monospace];\n'
+
+            for addr, block in self.blocks.items():
+                label = ''.join('%04x  %s\\l' % (a, text)
+                                for a, _, text in self.get_instrs(block))
+                yield '  b%04x [label="%s"];\n' % (addr, label)
+
+            for addr, block in self.blocks.items():
+                for succ in block.successors:
+                    if succ in self.blocks:
+                        yield '  b%04x -> b%04x;\n' % (addr, succ)
+
+                callee = block.callee
+                if callee is not None and callee in self.blocks:
+                    yield ('  b%04x -> b%04x [style=dashed, label=call];\n' %
+                           (addr, callee))
+
+                if block.is_indirect_jump:
+                    yield '  i%04x [shape=point];\n' % addr
+                    yield '  b%04x -> i%04x [style=dashed];\n' % (addr, addr)
+
+            yield '}\n'
+
+        return ''.join(g())
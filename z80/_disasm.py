@@ -24,6 +24,8 @@ from ._instr import (ADD, ADC, AND, CP, OR, SBC, SUB, XOR, BIT, CALL, CCF, CPL,
                      JumpInstr, CallInstr, RetInstr, At, IndexReg, Add)
 from ._machine import Z80Machine
 
+_ADDRESS_SPACE_SIZE = 0x10000
+
 
 class _DisasmError(Error):
     def __init__(self, subject, message, *notes):
@@ -132,19 +134,13 @@ class _UnknownInstrError(Exception):
 
 class Z80InstrBuilder(object):
     __INSTRS = {
-        'Aadd': ADD,
-        'Aadc': ADC,
-        'Aand': AND,
-        'Acp': CP,
         'add': ADD,
         'adc': ADC,
-        'Aor': OR,
-        'Asbc': SBC,
-        'Asub': SUB,
-        'Axor': XOR,
+        'and': AND,
         'bit': BIT,
         'call': CALL,
         'ccf': CCF,
+        'cp': CP,
         'cpl': CPL,
         'daa': DAA,
         'dec': DEC,
@@ -160,18 +156,20 @@ class Z80InstrBuilder(object):
         'jp': JP,
         'jr': JR,
         'ld': LD,
-        'Llddr': LDDR,
-        'Lldir': LDIR,
+        'lddr': LDDR,
+        'ldir': LDIR,
         'neg': NEG,
         'nop': NOP,
-        'Orlc': RLC,
-        'Orl': RL,
-        'Orr': RR,
-        'Orrc': RRC,
-        'Osla': SLA,
-        'Osll': SLL,
-        'Osra': SRA,
-        'Osrl': SRL,
+        'or': OR,
+        'outi': OUTI,
+        'rlc': RLC,
+        'rl': RL,
+        'rr': RR,
+        'rrc': RRC,
+        'sla': SLA,
+        'sll': SLL,
+        'sra': SRA,
+        'srl': SRL,
         'out': OUT,
         'pop': POP,
         'push': PUSH,
@@ -186,131 +184,127 @@ class Z80InstrBuilder(object):
         'sbc': SBC,
         'scf': SCF,
         'set': SET,
-        'Touti': OUTI,
+        'sub': SUB,
+        'xor': XOR,
     }
 
-    __OPS = {
-        'a': A,
-        'af': AF,
+    # Indexed by the values of the z80::reg, z80::regp, z80::regp2
+    # and z80::condition enumerators.
+    __REGS = (B, C, D, E, H, L, None, A)
+    __REGPS = (BC, DE, None, SP)
+    __REGP2S = (BC, DE, None, AF)
+    __CONDS = (NZ, Z, NC, CF, PO, None, P, M)
+
+    # Indexed by z80::iregp values.
+    __IREGPS = (HL, IX, IY)
+
+    __LITERALS = {
         'af\'': AF2,
-        'c': C,
-        'Cc': CF,
-        'Cm': M,
-        'Cnc': NC,
-        'Cnz': NZ,
-        'Cpo': PO,
-        'Cp': P,
-        'Cz': Z,
-        'de': DE,
-        'Gaf': AF,
-        'Gbc': BC,
-        'Gde': DE,
-        'Ghl': HL,
-        'Gix': IX,
-        'Giy': IY,
-        'hl': HL,
         'i': IReg,
-        'ix': IX,
-        'iy': IY,
-        'Pbc': BC,
-        'Pde': DE,
-        'Phl': HL,
-        'Pix': IX,
-        'Piy': IY,
-        'Psp': SP,
-        'Ra': A,
-        'Rb': B,
-        'Rc': C,
-        'Rd': D,
-        'Re': E,
-        'Rh': H,
-        'Rl': L,
-        'sp': SP,
     }
 
-    def __build_op(self, addr, text):
-        if text.startswith('R('):
-            text = text[1:]
-
-        if text.startswith('('):
-            assert text[-1] == ')'
-            return At(self.__build_op(addr, text[1:-1]))
-
-        # Base operand.
-        if text in self.__OPS:
-            op = self.__OPS[text]
-            text = ''
-        elif text.startswith(('W', 'N', 'U')):
-            text = text.split()
-            op = int(text[0][1:], base=0)
-            text = ' '.join(text[1:])
-        elif text.startswith('D$'):
-            op = addr
-            text = text[2:].strip()
-        elif text.startswith(('ix', 'iy')):
-            op = self.__OPS[text[:2]]
-            text = text[2:].strip()
-        else:
-            raise _UnknownInstrError()
-
-        # Offset.
-        if text != '' and text[0] in ('+', '-'):
-            sign = text[0]
-            text = text[1:].strip()
-
-            offset = int(text, base=0)
-            text = ''
-
-            if sign == '-':
-                offset = -offset
+    def __build_op(self, addr, op):
+        kind, value, irp, disp, indirect = op
 
-            if isinstance(op, int):
-                op += offset
-            elif isinstance(op, IndexReg):
-                op = Add(op, offset)
-            else:
+        if kind == 'reg':
+            if value == 6:  # at_hl
+                op = self.__IREGPS[irp]
+                if irp != 0:
+                    op = Add(op, disp)
+                indirect = True
+            elif irp != 0:
                 raise _UnknownInstrError()
+            else:
+                op = self.__REGS[value]
+        elif kind == 'regp':
+            op = self.__REGPS[value] or self.__IREGPS[irp]
+        elif kind == 'regp2':
+            op = self.__REGP2S[value] or self.__IREGPS[irp]
+        elif kind == 'condition':
+            op = self.__CONDS[value]
+        elif kind in ('imm8', 'imm16', 'number'):
+            op = value
+        elif kind == 'rel':
+            op = addr + disp
+        elif kind == 'literal':
+            op = self.__LITERALS.get(value)
+        else:
+            op = None
+
+        if op is None:
+            raise _UnknownInstrError()
 
-        assert text == '', text
+        if indirect:
+            op = At(op)
 
         return op
 
-    def build_instr(self, addr, image):
-        original_text, size = Z80Machine._disasm(image)
+    def __init__(self):
+        # Maps instruction bytes to shared instruction objects.
+        # Relative forms are keyed by their bytes and address.
+        self.__cache = dict()
+        self.__relative_instrs = set()
+        self.cache_hits = 0
+        self.cache_misses = 0
+
+    def __build_instr(self, addr, image, decoded):
+        _, size, name, ops = decoded
         if size > len(image):
             # TODO: Too few bytes to disassemble this instruction.
             assert 0, image
 
         try:
-            text = original_text.split(maxsplit=1)
-
-            assert len(text) > 0, (original_text, image)
-            name = text.pop(0)
-
             if name not in self.__INSTRS:
                 raise _UnknownInstrError()
 
-            # Parse operands.
-            ops = []
-            if text:
-                text = text[0].split(',')
-                while text:
-                    op_text = text.pop(0).strip()
-                    op = self.__build_op(addr, op_text)
-
-                    if op is not None:
-                        ops.append(op)
-
+            ops = [self.__build_op(addr, op) for op in ops]
             instr = self.__INSTRS[name](*ops)
-            instr.addr = addr
             instr.size = size
         except _UnknownInstrError:
-            instr = UnknownInstr(addr, image[0])
-            instr.text = original_text
+            instr = UnknownInstr(None, image[0])
+            instr.text, _ = Z80Machine._disasm(image)
+
+        return instr
+
+    def build_instr(self, addr, image):
+        instr = self.__build_instr(addr, image,
+                                   Z80Machine._decode(image, addr))
+        instr.addr = addr
+        return instr
+
+    # Same as build_instr(), but returns an instruction object
+    # shared between all the places where the same bytes are
+    # decoded. Such objects do not have their 'addr' field set
+    # and shall not be modified.
+    def get_instr(self, addr, image):
+        # Only decode instructions not seen before.
+        key = bytes(image[:Z80Machine._instr_size(image)])
+        if key in self.__relative_instrs:
+            key = key, addr
+
+        instr = self.__cache.get(key)
+        if instr is not None:
+            self.cache_hits += 1
             return instr
 
+        self.cache_misses += 1
+        decoded = Z80Machine._decode(image, addr)
+        _, size, name, ops = decoded
+        if (isinstance(key, bytes) and
+                any(kind == 'rel' for kind, *_ in ops)):
+            self.__relative_instrs.add(key)
+            key = key, addr
+
+        instr = self.__build_instr(addr, image, decoded)
+        self.__cache[key] = instr
         return instr
 
+    def clear_cache(self):
+        self.__cache.clear()
+        self.__relative_instrs.clear()
+        self.cache_hits = 0
+        self.cache_misses = 0
+
 
 class _TagSet(object):
     def __init__(self):
@@ -457,44 +451,37 @@ class _Disasm(object):
         self.__tags[tag.addr].inline_tags.append(tag)
         self.add_tags(_DisasmTag(tag.origin, tag.addr))
 
-    def __process_disasm_tag(self, tag):
-        tags = self.__tags[tag.addr]
-        if tags.disasm_tag is not None:
-            return
-
-        MAX_INSTR_SIZE = 4
-
-        instr_image = []
-        assert isinstance(tag.addr, int), tag.addr
-        for i in range(tag.addr, tag.addr + MAX_INSTR_SIZE):
-            if self.__tags[i].byte_tag is None:
-                break
-
-            instr_image.append(self.__tags[i].byte_tag.value)
+    def __trace_code(self, disasm_tags):
+        # Let the native tracer follow control flow from the
+        # tagged addresses.
+        image = bytearray(_ADDRESS_SPACE_SIZE)
+        defined = bytearray(_ADDRESS_SPACE_SIZE)
+        for addr, tags in self.__tags.items():
+            if (tags.byte_tag is not None and
+                    0 <= addr < _ADDRESS_SPACE_SIZE):
+                image[addr] = tags.byte_tag.value
+                defined[addr] = 1
+
+        entry_tags = dict()
+        for tag in disasm_tags:
+            assert isinstance(tag.addr, int), tag.addr
+            if self.__tags[tag.addr].disasm_tag is None:
+                entry_tags.setdefault(tag.addr, tag)
+
+        instrs = Z80Machine._trace_code(bytes(image), bytes(defined),
+                                        entry_tags)
+        for addr, size in instrs:
+            tags = self.__tags[addr]
+            if tags.disasm_tag is not None:
+                continue
 
-        if len(instr_image) == 0:
-            return
+            tag = entry_tags.get(addr)
+            if tag is None:
+                tag = _DisasmTag(None, addr)
 
-        instr = self.__instr_builder.build_instr(tag.addr,
-                                                 bytes(instr_image))
-        tag.instr = instr
-        self.__tags[tag.addr].disasm_tag = tag
-
-        if not isinstance(instr, UnknownInstr):
-            # Disassemble the following instruction.
-            if (not isinstance(instr, JumpInstr) or
-                    isinstance(instr, CallInstr) or
-                    instr.conditional):
-                target = instr.addr + instr.size
-                self.add_tags(_DisasmTag(instr.origin, target))
-
-            # Disassemble jump targets.
-            if (isinstance(instr, JumpInstr) and
-                    not isinstance(instr, RetInstr)):
-                target = instr.target
-                if not isinstance(target, At):
-                    assert isinstance(target, int)
-                    self.add_tags(_DisasmTag(instr.origin, target))
+            tag.instr = self.__instr_builder.get_instr(
+                addr, bytes(image[addr:addr + size]))
+            tags.disasm_tag = tag
 
     __TAG_PROCESSORS = {
         _ByteTag: __process_byte_tag,
@@ -502,7 +489,6 @@ class _Disasm(object):
         _IncludeBinaryTag: __process_include_binary_tag,
         _InlineCommentTag: __process_inline_comment_tag,
         _InstrTag: __process_instr_tag,
-        _DisasmTag: __process_disasm_tag,
     }
 
     def __process_tag(self, tag):
@@ -514,6 +500,13 @@ class _Disasm(object):
         while self.__worklists:
             priority = min(self.__worklists)
             worklist = self.__worklists[priority]
+
+            # Disassembly tags are processed all at once.
+            if priority == self.__TAG_PRIORITIES[_DisasmTag]:
+                del self.__worklists[priority]
+                self.__trace_code(worklist)
+                continue
+
             tag = worklist.popleft()
 
             if len(worklist) == 0:
@@ -558,9 +551,9 @@ class _Disasm(object):
 
         return True
 
-    def __get_instr_lines(self, instr):
+    def __get_instr_lines(self, instr_addr, instr):
         command = str(instr)
-        addr = instr.addr
+        addr = instr_addr
         xbytes = [self.__tags[addr].byte_tag.value]
 
         end_addr = addr + instr.size
@@ -577,7 +570,7 @@ class _Disasm(object):
             for tag in self.__tags[addr].infront_tags:
                 yield _AsmLine(addr=addr, command=tag)
 
-            first_instr_byte = addr == instr.addr
+            first_instr_byte = addr == instr_addr
             inline_comments = list(
                 self.__get_inline_comments(addr, first_instr_byte))
             while len(xbytes) > 0 or len(inline_comments) > 0:
@@ -642,7 +635,7 @@ class _Disasm(object):
     def __get_lines_for_addr(self, addr):
         disasm_tag = self.__tags[addr].disasm_tag
         if disasm_tag is not None:
-            yield from self.__get_instr_lines(disasm_tag.instr)
+            yield from self.__get_instr_lines(addr, disasm_tag.instr)
         else:
             yield from self.__get_data_lines(addr)
 
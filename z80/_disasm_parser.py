@@ -6,138 +6,71 @@
 #
 #   Published under the MIT license.
 
-import re
-from ._disasm import (_Disasm, _IncludeBinaryTag, _InstrTag, _CommentTag,
-                      _ByteTag, _InlineCommentTag, _AsmLine)
-from ._token import _Tokeniser
+from ._disasm import (_DisasmError, _IncludeBinaryTag, _InstrTag,
+                      _CommentTag, _ByteTag, _InlineCommentTag, _AsmLine)
+from ._source import _SourcePos
+from ._token import _Token
+from ._z80 import _parse_tags
 
 
+# Tags are scanned natively and then turned into tag objects
+# here.
 class _DisasmTagParser(object):
-    __TAG_LEADER = re.compile('@@')
-
-    __TOKENS = re.compile(
-        r'([_0-9a-zA-Z]+)|'           # A number or identifier.
-        r"'(\\'|\\\\|[^'\\\n])*'|"    # A string.
-        r'(--)|'                      # The tag comment leader.
-        r'.')                         # Or any other single character.
-
     def __init__(self, source_file):
-        self.__toks = _Tokeniser(source_file)
-        self.__tok = None
-
-    def __fetch_token(self, error=None):
-        self.__toks.skip_whitespace()
-
-        self.__toks.start_token()
-        self.__toks.skip(self.__TOKENS)
-        tok = self.__toks.end_token()
+        self.__source_file = source_file
 
-        if tok.literal == '\n':
-            tok.literal = None
+    def __get_pos(self, offset):
+        return _SourcePos(offset, self.__source_file)
 
-        if tok.literal is None:
-            if error is not None:
-                raise _DisasmError(tok.pos, error)
+    def __get_token(self, literal, offset):
+        return _Token(literal, self.__get_pos(offset))
 
-            tok = None
-        else:
-            # Translate escape sequences.
-            if tok.literal.startswith("'"):
-                if tok.literal == "'":
-                    raise _DisasmError(tok.pos, 'Unterminated string.')
+    def __make_byte_tag(self, offset, addr, value):
+        return _ByteTag(self.__get_pos(offset), addr, value)
 
-                tok.literal = (tok.literal[1:-1].
-                               replace('\\\\', '\\').
-                               replace("\\'", "'"))
+    def __make_comment_tag(self, offset, addr, comment):
+        return _CommentTag(self.__get_pos(offset), addr, comment)
 
-        self.__tok = tok
+    def __make_inline_comment_tag(self, offset, addr, comment):
+        return _InlineCommentTag(self.__get_pos(offset), addr, comment)
 
-        return self.__tok
-
-    def __evaluate_numeric_literal(self, literal, base=0):
-        try:
-            return int(literal, base)
-        except ValueError:
-            return None
-
-    def __parse_include_binary_tag(self, addr, name):
-        filename = self.__fetch_token('A filename expected.')
-        self.__fetch_token()
+    def __make_instr_tag(self, offset, addr, comment_offset, comment):
+        tag = _InstrTag(self.__get_pos(offset), addr)
+        if comment is not None:
+            tag.comment = self.__get_token(comment, comment_offset)
+        return tag
 
+    def __make_include_binary_tag(self, offset, addr, filename_offset,
+                                  filename, comment_offset, comment):
+        filename = self.__get_token(filename, filename_offset)
         with open(filename.literal, 'rb') as f:
             image = f.read()
 
-        return _IncludeBinaryTag(name.pos, addr, filename, image)
-
-    def __parse_instr_tag(self, addr, name):
-        self.__fetch_token()
-        return _InstrTag(name.pos, addr)
-
-    __TAG_PARSERS = {
-        _IncludeBinaryTag.ID: __parse_include_binary_tag,
-        _InstrTag.ID: __parse_instr_tag,
+        tag = _IncludeBinaryTag(self.__get_pos(offset), addr, filename,
+                                image)
+        if comment is not None:
+            tag.comment = self.__get_token(comment, comment_offset)
+        return tag
+
+    def __raise_error(self, offset, literal, message):
+        raise _DisasmError(self.__get_token(literal, offset), message)
+
+    __TAG_MAKERS = {
+        _ByteTag.ID: __make_byte_tag,
+        _CommentTag.ID: __make_comment_tag,
+        _InlineCommentTag.ID: __make_inline_comment_tag,
+        _InstrTag.ID: __make_instr_tag,
+        _IncludeBinaryTag.ID: __make_include_binary_tag,
+        'error': __raise_error,
     }
 
     # Parses and returns a subsequent tag.
     def __iter__(self):
-        while self.__toks.skip_next(self.__TAG_LEADER):
-            tok = self.__fetch_token()
-
-            # Parse optional tag address.
-            addr = self.__evaluate_numeric_literal(tok.literal)
-            if addr is not None:
-                tok = self.__fetch_token()
-
-            tags = []
-
-            # Collect bytes, if any specified.
-            byte_offset = 0
-            while tok is not None:
-                value = self.__evaluate_numeric_literal(tok.literal, base=16)
-                if value is None:
-                    break
-
-                tags.append(_ByteTag(tok.pos, addr + byte_offset, value))
-                byte_offset += 1
-
-                tok = self.__fetch_token()
-
-            # Parse regular tag.
-            subject_tag = None
-            if tok == '.':
-                tok = self.__fetch_token()
-                parser = self.__TAG_PARSERS.get(tok.literal, None)
-                if not parser:
-                    raise _DisasmError(tok, 'Unknown tag.')
-
-                subject_tag = parser(self, addr, tok)
-                tags.append(subject_tag)
-                tok = self.__tok
-
-                if tok is not None and tok != '--':
-                    raise _DisasmError(tok,
-                                       'End of line or a comment expected.')
-
-            # Parse comment, if specified.
-            if tok == '--':
-                tok = self.__fetch_token()
-
-            if tok is not None:
-                self.__toks.skip_rest_of_line()
-                comment = self.__toks.end_token()
-
-                if subject_tag is None:
-                    if comment.pos.column_no < _AsmLine._BYTES_INDENT:
-                        tags.append(_CommentTag(tok.pos, addr,
-                                                comment.literal))
-                    else:
-                        tags.append(_InlineCommentTag(tok.pos, addr,
-                                                      comment.literal))
-                else:
-                    assert subject_tag.comment is None
-                    subject_tag.comment = comment
-
-            yield from tags
+        # Comments from the bytes column on are inline comments.
+        records = _parse_tags(self.__source_file.get_image(),
+                              _AsmLine._BYTES_INDENT)
+        for kind, *fields in records:
+            yield self.__TAG_MAKERS[kind](self, *fields)
 
     def parse(self):
         tags = []
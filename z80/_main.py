@@ -10,10 +10,12 @@
 #   Published under the MIT license.
 
 import sys
+from ._cfg import ControlFlowGraph
 from ._disasm import _Disasm
 from ._disasm_parser import _DisasmTagParser
 from ._error import Error
 from ._source import _SourceFile
+from ._timing import TimingAnalyser
 
 
 def _pop_argument(args, error):
@@ -38,6 +40,66 @@ def _disasm(args):
     d.save_output(filename)
 
 
+def _parse_number(text, what):
+    try:
+        return int(text, 0)
+    except ValueError:
+        raise Error('Bad %s %r.' % (what, text))
+
+
+def _parse_loop_bound(text):
+    addr, sep, bound = text.partition('=')
+    if not sep:
+        raise Error('Loop bound %r is not of the form addr=[min:]max.' %
+                    text)
+
+    least, sep, most = bound.rpartition(':')
+    most = _parse_number(most, 'loop bound')
+    if sep:
+        most = _parse_number(least, 'loop bound'), most
+
+    return _parse_number(addr, 'loop address'), most
+
+
+def _timing(args):
+    filename = _pop_argument(args, 'The binary file is not specified.')
+    base_addr = _parse_number(
+        _pop_argument(args, 'The load address is not specified.'),
+        'load address')
+    entry = _parse_number(
+        _pop_argument(args, 'The entry address is not specified.'),
+        'entry address')
+    loop_bounds = dict(_parse_loop_bound(arg) for arg in args)
+
+    with open(filename, 'rb') as f:
+        image = f.read()
+
+    analyser = TimingAnalyser(image, base_addr, loop_bounds)
+    routine = analyser.analyse(entry)
+
+    print('%#06x: best %d, worst %d ticks' % (entry, routine.best,
+                                                routine.worst))
+    print('critical path:')
+    for addr, count, ticks in routine.critical_path:
+        print('  %#06x  %-24s %6d x %d' % (
+            addr, analyser.get_instr_text(addr), count, ticks))
+
+
+def _cfg(args):
+    filename = _pop_argument(args, 'The binary file is not specified.')
+    base_addr = _parse_number(
+        _pop_argument(args, 'The load address is not specified.'),
+        'load address')
+    if not args:
+        raise Error('No entry addresses specified.')
+    entries = [_parse_number(arg, 'entry address') for arg in args]
+
+    with open(filename, 'rb') as f:
+        image = f.read()
+
+    sys.stdout.write(ControlFlowGraph(image, entries, base_addr).to_dot())
+
+
 def _handle_command_line(args):
     if not args:
         raise Error('Nothing to do.')
@@ -47,6 +109,14 @@ def _handle_command_line(args):
         _disasm(args)
         return
 
+    if command == 'cfg':
+        _cfg(args)
+        return
+
+    if command == 'timing':
+        _timing(args)
+        return
+
     raise Error('Unknown command %r.' % command)
 
 
@@ -10,6 +10,7 @@
 #   Published under the MIT license.
 
 import bisect
+import re
 
 
 class _SourcePos(object):
@@ -50,8 +51,9 @@ class _SourceFile(object):
 
         self.__image = image
 
-        self.__line_breaks = tuple(
-            i for i, c in enumerate(self.__image) if c == '\n')
+        # Only needed for reporting positions, so computed on
+        # demand.
+        self.__line_breaks = None
 
     def __repr__(self):
         return self.__filename
@@ -60,6 +62,10 @@ class _SourceFile(object):
         return self.__image
 
     def get_coordinates(self, offset):
+        if self.__line_breaks is None:
+            self.__line_breaks = tuple(
+                m.start() for m in re.finditer('\n', self.__image))
+
         i = bisect.bisect_left(self.__line_breaks, offset)
 
         line_start = self.__line_breaks[i - 1] + 1 if i > 0 else 0
@@ -0,0 +1,337 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+#   Z80 CPU Emulator.
+#   https://github.com/kosarev/z80
+#
+#   Copyright (C) 2017-2021 Ivan Kosarev.
+#   ivan@kosarev.info
+#
+#   Published under the MIT license.
+
+from ._error import Error
+from ._machine import I8080Machine, Z80Machine
+
+_ADDRESS_SPACE_SIZE = 0x10000
+_MAX_INSTR_SIZE = 4
+
+
+class _Edge(object):
+    def __init__(self, target, best, worst, path):
+        # None for returns from the routine.
+        self.target = target
+        self.best = best
+        self.worst = worst
+
+        # The worst-case sequence of (addr, count, ticks) steps.
+        self.path = path
+
+
+class RoutineTiming(object):
+    def __init__(self, entry, best, worst, critical_path):
+        self.entry = entry
+        self.best = best
+        self.worst = worst
+        self.critical_path = critical_path
+
+    def __repr__(self):
+        return 'RoutineTiming(%#06x, %d, %d)' % (self.entry, self.best,
+                                                 self.worst)
+
+
+# Computes the best- and worst-case numbers of ticks routines
+# take from their entry points to returning, without running
+# them. Instruction timings come from executing every
+# instruction once for each of its outcomes.
+#
+# Loops have to be bounded with the maximum, or a (minimum,
+# maximum) pair of numbers of their iterations, keyed by the
+# address of either the loop header or the instruction closing
+# the loop, such as DJNZ or LDIR. A single number as the bound
+# means at least one iteration.
+class TimingAnalyser(object):
+    __CALLS = {
+        I8080Machine: {'call', 'xcall', 'rst', 'cnz', 'cz', 'cnc', 'cc',
+                       'cpo', 'cpe', 'cp', 'cm'},
+        Z80Machine: {'call', 'rst'},
+    }
+
+    __RETURNS = {
+        I8080Machine: {'ret', 'xret', 'rnz', 'rz', 'rnc', 'rc',
+                       'rpo', 'rpe', 'rp', 'rm'},
+        Z80Machine: {'ret', 'reti', 'retn', 'xret', 'xretn'},
+    }
+
+    __HALTS = {
+        I8080Machine: {'hlt'},
+        Z80Machine: {'halt'},
+    }
+
+    def __init__(self, image, base_addr=0, loop_bounds=None,
+                 machine=Z80Machine):
+        self.__image = image
+        self.__base_addr = base_addr
+        self.__machine = machine
+
+        self.__loop_bounds = dict()
+        for addr, bound in (loop_bounds or dict()).items():
+            if isinstance(bound, int):
+                bound = 1, bound
+            least, most = bound
+            if not 1 <= least <= most:
+                raise Error('%#06x: bad loop bound %r.' % (addr, bound))
+            self.__loop_bounds[addr] = least, most
+
+        # Maps addresses to lists of outgoing edges.
+        self.__instrs = dict()
+
+        # Maps entry points to analysed routines. None marks
+        # routines being analysed.
+        self.__routines = dict()
+
+    def __get_instr_bytes(self, addr, size=_MAX_INSTR_SIZE):
+        offset = (addr - self.__base_addr) % _ADDRESS_SPACE_SIZE
+        return bytes(self.__image[offset:offset + size])
+
+    def get_instr_text(self, addr):
+        text, _ = self.__machine._disasm_text(self.__get_instr_bytes(addr))
+        return text
+
+    def __get_edges(self, addr):
+        edges = self.__instrs.get(addr)
+        if edges is not None:
+            return edges
+
+        machine = self.__machine
+        image = self.__get_instr_bytes(addr)
+        _, size, name, ops = machine._decode(image, addr)
+        if size > len(image):
+            raise Error('%#06x: Instruction is outside of the image.' % addr)
+
+        if name in self.__HALTS[machine]:
+            raise Error('%#06x: Cannot analyse halting.' % addr)
+
+        fall = (addr + size) % _ADDRESS_SPACE_SIZE
+        targets = [value for kind, value, *_ in ops
+                   if kind in ('imm16', 'rel')]
+
+        # Group the outcomes by successors.
+        ticks = dict()
+        for next_pc, t in machine._time_instr(image[:size], addr):
+            if name in self.__CALLS[machine] and next_pc in targets:
+                succ = fall, next_pc
+            elif next_pc == fall:
+                succ = fall, None
+            elif name in self.__RETURNS[machine]:
+                succ = None, None
+            elif next_pc in targets or next_pc == addr:
+                succ = next_pc, None
+            else:
+                raise Error('%#06x: Cannot follow indirect jump.' % addr)
+
+            ticks.setdefault(succ, []).append(t)
+
+        edges = []
+        for (target, callee), t in ticks.items():
+            best, worst = min(t), max(t)
+            path = [(addr, 1, worst)]
+            if callee is not None:
+                routine = self.analyse(callee)
+                best += routine.best
+                worst += routine.worst
+                path += routine.critical_path
+            edges.append(_Edge(target, best, worst, path))
+
+        self.__instrs[addr] = edges
+        return edges
+
+    def __get_loop_bound(self, header, latches):
+        for addr in sorted(latches) + [header]:
+            bound = self.__loop_bounds.get(addr)
+            if bound is not None:
+                return bound
+
+        raise Error('%#06x: The loop is not bounded.' % header)
+
+    # Returns addresses of instructions reachable within the
+    # routine in reverse postorder.
+    def __get_routine_instrs(self, entry):
+        order = []
+        visited = {entry}
+        stack = [(entry, iter(self.__get_edges(entry)))]
+        while stack:
+            addr, edges = stack[-1]
+            for e in edges:
+                if e.target is not None and e.target not in visited:
+                    visited.add(e.target)
+                    stack.append((e.target,
+                                  iter(self.__get_edges(e.target))))
+                    break
+            else:
+                stack.pop()
+                order.append(addr)
+
+        order.reverse()
+        return order
+
+    @staticmethod
+    def __get_dominators(order, preds):
+        index = {addr: i for i, addr in enumerate(order)}
+        idoms = {order[0]: order[0]}
+
+        def intersect(a, b):
+            while a != b:
+                while index[a] > index[b]:
+                    a = idoms[a]
+                while index[b] > index[a]:
+                    b = idoms[b]
+            return a
+
+        changed = True
+        while changed:
+            changed = False
+            for addr in order[1:]:
+                idom = None
+                for p in preds[addr]:
+                    if p in idoms:
+                        idom = p if idom is None else intersect(p, idom)
+                if idoms.get(addr) != idom:
+                    idoms[addr] = idom
+                    changed = True
+
+        return idoms
+
+    @staticmethod
+    def __dominates(idoms, a, b):
+        while True:
+            if a == b:
+                return True
+            if idoms[b] == b:
+                return False
+            b = idoms[b]
+
+    # Computes the best and worst distances from the start node
+    # over acyclic edges within the given nodes, which are to be
+    # in topological order. Returns targets of edges that leave
+    # the nodes or go back to the start node, along with the
+    # distances to them.
+    @staticmethod
+    def __get_distances(start, nodes, succs):
+        node_set = set(nodes)
+        best = {start: 0}
+        worst = {start: (0, [])}
+        leaving = []
+        for addr in nodes:
+            if addr not in worst:
+                continue
+
+            b = best[addr]
+            w, path = worst[addr]
+            for e in succs[addr]:
+                eb, ew = b + e.best, w + e.worst
+                epath = path + e.path
+                if e.target == start or e.target not in node_set:
+                    leaving.append((e.target, eb, ew, epath))
+                    continue
+
+                best[e.target] = min(best.get(e.target, eb), eb)
+                if e.target not in worst or worst[e.target][0] < ew:
+                    worst[e.target] = ew, epath
+
+        return leaving
+
+    def analyse(self, entry):
+        if entry in self.__routines:
+            routine = self.__routines[entry]
+            if routine is None:
+                raise Error('%#06x: Cannot analyse recursive calls.' % entry)
+            return routine
+
+        self.__routines[entry] = None
+        order = self.__get_routine_instrs(entry)
+
+        succs = {addr: list(self.__get_edges(addr)) for addr in order}
+        preds = {addr: [] for addr in order}
+        for addr in order:
+            for e in succs[addr]:
+                if e.target is not None:
+                    preds[e.target].append(addr)
+
+        # Find natural loops. Edges that go back in the reverse
+        # postorder and are not back edges make the control flow
+        # irreducible.
+        idoms = self.__get_dominators(order, preds)
+        index = {addr: i for i, addr in enumerate(order)}
+        loops = dict()
+        for addr in order:
+            for p in preds[addr]:
+                if index[p] < index[addr]:
+                    continue
+                if not self.__dominates(idoms, addr, p):
+                    raise Error('%#06x: Irreducible control flow.' % addr)
+                loops.setdefault(addr, set()).add(p)
+
+        bodies = dict()
+        for header, latches in loops.items():
+            body = {header}
+            worklist = list(latches)
+            while worklist:
+                addr = worklist.pop()
+                if addr not in body:
+                    body.add(addr)
+                    worklist.extend(preds[addr])
+            bodies[header] = body
+
+        # Replace loops with their headers, inner loops first.
+        for header in sorted(loops, key=lambda h: len(bodies[h])):
+            nodes = [addr for addr in order
+                     if addr in bodies[header] and addr in succs]
+            least, most = self.__get_loop_bound(header, loops[header])
+
+            iter_best = iter_worst = None
+            exits = dict()
+            for target, b, w, path in self.__get_distances(header, nodes,
+                                                           succs):
+                if target == header:
+                    if iter_best is None or b < iter_best:
+                        iter_best = b
+                    if iter_worst is None or w > iter_worst[0]:
+                        iter_worst = w, path
+                    continue
+
+                exit_best, exit_worst = exits.get(target, (b, (w, path)))
+                exits[target] = (min(exit_best, b),
+                                 max(exit_worst, (w, path),
+                                     key=lambda x: x[0]))
+
+            if not exits:
+                raise Error('%#06x: The loop never exits.' % header)
+
+            iter_path = [(addr, count * (most - 1), ticks)
+                         for addr, count, ticks in iter_worst[1]]
+            edges = []
+            for target, (b, (w, path)) in exits.items():
+                edges.append(_Edge(target,
+                                   (least - 1) * iter_best + b,
+                                   (most - 1) * iter_worst[0] + w,
+                                   iter_path + path))
+
+            for addr in nodes:
+                del succs[addr]
+            succs[header] = edges
+
+        nodes = [addr for addr in order if addr in succs]
+        best = worst = None
+        for target, b, w, path in self.__get_distances(entry, nodes, succs):
+            if target is None:
+                if best is None or b < best:
+                    best = b
+                if worst is None or w > worst[0]:
+                    worst = w, path
+
+        if worst is None:
+            raise Error('%#06x: The routine never returns.' % entry)
+
+        routine = RoutineTiming(entry, best, worst[0], worst[1])
+        self.__routines[entry] = routine
+        return routine
@@ -10,9 +10,25 @@
 
 #include <Python.h>
 
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
 #include <cstring>
+#include <deque>
+#include <map>
 #include <new>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include "../z80.h"
 
@@ -36,6 +52,35 @@ static inline void split16(least_u8 &h, least_u8 &l, fast_u16 n) {
     l = get_low8(n);
 }
 
+// Serialises accesses to an object in free-threaded builds. In
+// builds with the GIL, holding the GIL is enough. The lock is
+// suspended while the thread is detached, e.g., while a machine
+// runs with the GIL released.
+class object_lock {
+public:
+    explicit object_lock(PyObject *object) {
+#ifdef Py_GIL_DISABLED
+        PyCriticalSection_Begin(&section, object);
+#else
+        unused(object);
+#endif
+    }
+
+    ~object_lock() {
+#ifdef Py_GIL_DISABLED
+        PyCriticalSection_End(&section);
+#endif
+    }
+
+    object_lock(const object_lock &) = delete;
+    object_lock &operator = (const object_lock &) = delete;
+
+private:
+#ifdef Py_GIL_DISABLED
+    PyCriticalSection section;
+#endif
+};
+
 class decref_guard {
 public:
     decref_guard(PyObject *object)
@@ -55,10 +100,91 @@ public:
         return object;
     }
 
+    PyObject *release() {
+        PyObject *p = object;
+        object = nullptr;
+        return p;
+    }
+
 private:
     PyObject *object;
 };
 
+static const unsigned max_instr_size = 4;
+
+// Describes a field of the machine state for the generic
+// getters and setters and for tracing conditions.
+struct state_field {
+    enum kind_type { u8, u8_pair, u16, u32 };
+
+    std::size_t offset;
+    kind_type kind;
+};
+
+static unsigned long get_state_field_value(const void *state,
+                                           const state_field &field) {
+    auto *p = static_cast<const char*>(state) + field.offset;
+    switch(field.kind) {
+    case state_field::u8:
+        return static_cast<unsigned char>(p[0]);
+    case state_field::u8_pair:
+        return make16(static_cast<unsigned char>(p[1]),
+                      static_cast<unsigned char>(p[0]));
+    case state_field::u16: {
+        least_u16 v;
+        std::memcpy(&v, p, sizeof(v));
+        return v; }
+    case state_field::u32: {
+        least_u32 v;
+        std::memcpy(&v, p, sizeof(v));
+        return v; }
+    }
+    return 0;
+}
+
+// Writes all the data unless an error occurs.
+static bool write_to_fd(int fd, const char *data, std::size_t size) {
+    while(size != 0) {
+#ifdef _WIN32
+        int n = _write(fd, data, static_cast<unsigned>(size));
+#else
+        ssize_t n = ::write(fd, data, size);
+#endif
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+        data += n;
+        size -= static_cast<std::size_t>(n);
+    }
+    return true;
+}
+
+// Events the Python machines raise in addition to the ones
+// defined in z80::events_mask.
+class machine_events {
+public:
+    typedef z80::events_mask::type type;
+
+    static const type callback_failed = z80::events_mask::end;
+
+    // Stop conditions specified for a run.
+    static const type pc_reached = callback_failed << 1;
+    static const type steps_done = callback_failed << 2;
+    static const type routine_finished = callback_failed << 3;
+    static const type port_accessed = callback_failed << 4;
+
+    // Raised on request from other threads.
+    static const type stop_requested = callback_failed << 5;
+
+    // Raised on accessing watched addresses when there is no
+    // watch callback.
+    static const type addr_accessed = callback_failed << 6;
+
+    static const type end = callback_failed << 7;
+};
+
 template<typename B, typename S>
 class machine : public B {
 public:
@@ -71,35 +197,85 @@ public:
         return state;
     }
 
+    // Watched reads include instruction fetches.
     fast_u8 on_read(fast_u16 addr) {
         assert(addr < z80::address_space_size);
-        return state.memory[addr];
+        fast_u8 n = state.memory[addr];
+        if(watching && self().is_marked_addr(addr, read_mark))
+            n = on_watched_access(addr, n, read_mark);
+        return n;
     }
 
     void on_write(fast_u16 addr, fast_u8 n) {
         assert(addr < z80::address_space_size);
+        if(watching && self().is_marked_addr(addr, write_mark))
+            n = on_watched_access(addr, n, write_mark);
         state.memory[addr] = n;
     }
 
+    // Address marks for watching memory accesses, in addition
+    // to the breakpoint mark. Accesses to marked addresses call
+    // the watch callback or, if there is none, stop the run
+    // after the instruction.
+    static const fast_u8 read_mark = 1u << 1;
+    static const fast_u8 write_mark = 1u << 2;
+    static const fast_u8 exec_mark = 1u << 3;
+    static const fast_u8 watch_marks = read_mark | write_mark | exec_mark;
+
+    // Watching is enabled on marking addresses for the first
+    // time, so machines not watching memory do not check marks
+    // on every access.
+    void enable_watching() {
+        watching = true;
+        step_hooks = true;
+    }
+
+    PyObject *set_watch_callback(PyObject *callback) {
+        PyObject *old_callback = on_watch_callback;
+        on_watch_callback = callback;
+        if(!running)
+            watch_callback = callback;
+        return old_callback;
+    }
+
+    // The first access that stopped the last run.
+    struct watched_access {
+        fast_u16 addr;
+        fast_u8 value;
+        fast_u8 kind;
+    };
+
+    const watched_access *get_watch_hit() const {
+        return has_watch_hit ? &watch_hit : nullptr;
+    }
+
     fast_u8 on_input(fast_u16 addr) {
+        check_stop_port(addr);
+
+        fast_u8 value;
+        if(get_native_input(addr, value))
+            return value;
+
         const fast_u8 default_value = 0xff;
-        if(!on_input_callback)
+        if(!input_callback)
             return default_value;
 
+        callback_scope scope(*this);
         PyObject *arg = Py_BuildValue("(i)", addr);
         decref_guard arg_guard(arg);
 
-        PyObject *result = PyObject_CallObject(on_input_callback, arg);
+        PyObject *result = arg ? PyObject_CallObject(input_callback, arg) :
+                                 nullptr;
         decref_guard result_guard(result);
 
         if(!result) {
-            assert(0);  // TODO: stop();
+            on_callback_failed();
             return default_value;
         }
 
         if(!PyLong_Check(result)) {
             PyErr_SetString(PyExc_TypeError, "returning value must be integer");
-            assert(0);  // TODO: stop();
+            on_callback_failed();
             return default_value;
         }
 
@@ -109,26 +285,374 @@ public:
     PyObject *set_input_callback(PyObject *callback) {
         PyObject *old_callback = on_input_callback;
         on_input_callback = callback;
+        if(!running)
+            input_callback = callback;
         return old_callback;
     }
 
+    // Inputs from ports with queued values are served from the
+    // queues. Otherwise, values set for ports are used. Python
+    // callbacks are only called for the rest of ports.
+    void queue_port_input(fast_u16 port, const least_u8 *values,
+                          std::size_t size) {
+        if(size != 0)
+            queued_inputs[port].insert(queued_inputs[port].end(), values,
+                                       values + size);
+    }
+
+    void set_port_input(fast_u16 port, fast_u8 value) {
+        if(port_inputs.empty())
+            port_inputs.resize(z80::address_space_size);
+        port_inputs[port] = static_cast<least_u16>(defined_input | value);
+    }
+
+    void unset_port_input(fast_u16 port) {
+        if(!port_inputs.empty())
+            port_inputs[port] = 0;
+    }
+
+    // In the queuing mode, outputs are recorded along with the
+    // number of ticks since the mode was enabled instead of
+    // being passed to the output callback.
+    struct output_record {
+        std::uint_fast64_t ticks;
+        fast_u16 port;
+        fast_u8 value;
+    };
+
+    void set_output_queuing(bool enable) {
+        queue_outputs = enable;
+        output_ticks = 0;
+        queued_outputs.clear();
+    }
+
+    std::vector<output_record> &get_queued_outputs() {
+        return queued_outputs;
+    }
+
     void on_output(fast_u16 addr, fast_u8 value) {
-        if(!on_output_callback)
+        check_stop_port(addr);
+
+        if(queue_outputs) {
+            queued_outputs.push_back({output_ticks, addr, value});
             return;
+        }
 
+        if(!output_callback)
+            return;
+
+        callback_scope scope(*this);
         PyObject *args = Py_BuildValue("(i, i)", addr, value);
         decref_guard arg_guard(args);
 
-        PyObject *result = PyObject_CallObject(on_output_callback, args);
+        PyObject *result = args ? PyObject_CallObject(output_callback, args) :
+                                  nullptr;
         decref_guard result_guard(result);
+
+        if(!result)
+            on_callback_failed();
     }
 
     PyObject *set_output_callback(PyObject *callback) {
         PyObject *old_callback = on_output_callback;
         on_output_callback = callback;
+        if(!running)
+            output_callback = callback;
         return old_callback;
     }
 
+    bool is_running() const {
+        return running;
+    }
+
+    // Running machines can only be accessed from their
+    // callbacks, while the run is paused.
+    bool is_busy() const {
+        return running && !in_callback;
+    }
+
+    // Lets the garbage collector see the callbacks. The ones in
+    // effect for the current run hold their own references.
+    int traverse_callbacks(visitproc visit, void *arg) {
+        Py_VISIT(on_input_callback);
+        Py_VISIT(on_output_callback);
+        Py_VISIT(on_watch_callback);
+        if(running) {
+            Py_VISIT(input_callback);
+            Py_VISIT(output_callback);
+            Py_VISIT(watch_callback);
+        }
+        return 0;
+    }
+
+    void clear_callbacks() {
+        assert(!running);
+        input_callback = nullptr;
+        output_callback = nullptr;
+        watch_callback = nullptr;
+        Py_CLEAR(on_input_callback);
+        Py_CLEAR(on_output_callback);
+        Py_CLEAR(on_watch_callback);
+    }
+
+    // Stop conditions for the next run. They are checked after
+    // every instruction and reset on return from run().
+    void add_stop_pc(fast_u16 pc) {
+        if(stop_pcs.empty())
+            stop_pcs.resize(z80::address_space_size);
+        stop_pcs[pc] = 1;
+        has_stop_conditions = true;
+    }
+
+    // With step_over, instructions executed in called routines
+    // are not counted and the run stops in the routine the
+    // counting started in.
+    void set_steps_to_stop(unsigned long n, bool step_over) {
+        steps_to_stop = n;
+        step_over_calls = step_over;
+        counting_steps = true;
+        has_stop_conditions = true;
+    }
+
+    // Stops on return from the routine being executed.
+    void set_stop_on_finish() {
+        stop_on_finish = true;
+        has_stop_conditions = true;
+    }
+
+    // Stops after instructions accessing ports with the
+    // specified low 8 bits of the address.
+    void add_stop_port(fast_u8 port) {
+        stop_ports[port] = 1;
+        has_stop_ports = true;
+    }
+
+    // Stops the current run after the instruction being
+    // executed. Can be called from any thread. Does nothing if
+    // the machine is not running.
+    void request_stop() {
+        if(running)
+            stop_request.store(true, std::memory_order_relaxed);
+    }
+
+    // Instructions passing all the filters are traced before
+    // they are executed, as text lines written to a file
+    // descriptor and as records in a ring buffer. Traced
+    // instructions are counted from the start of tracing.
+    static const std::size_t trace_record_size = 20;
+
+    void add_trace_range(fast_u16 begin, fast_u32 end) {
+        if(trace_pcs.empty())
+            trace_pcs.resize(z80::address_space_size);
+        for(fast_u32 pc = begin; pc < end; ++pc)
+            trace_pcs[pc] = 1;
+    }
+
+    // Opcodes are identified by the first byte of the
+    // instruction or, for prefixed instructions, by the prefix
+    // in the high byte and the next byte in the low byte.
+    void add_trace_opcode(fast_u16 opcode) {
+        if(trace_opcodes.empty())
+            trace_opcodes.resize(z80::address_space_size);
+        trace_opcodes[opcode] = 1;
+    }
+
+    // Instructions are only traced when (field & mask) == value.
+    void add_trace_condition(const state_field &field, unsigned long mask,
+                             unsigned long value) {
+        trace_conditions.push_back({&field, mask, value});
+    }
+
+    void set_trace_fd(int fd) {
+        trace_fd = fd;
+    }
+
+    // Takes a reference to the bytearray the records are
+    // written to. The bytearray cannot be resized while
+    // tracing.
+    bool set_trace_ring(PyObject *ring) {
+        if(PyObject_GetBuffer(ring, &trace_ring_view, PyBUF_WRITABLE) < 0)
+            return false;
+        Py_INCREF(ring);
+        trace_ring = ring;
+        trace_ring_size = static_cast<std::size_t>(trace_ring_view.len) /
+                          trace_record_size;
+        return true;
+    }
+
+    PyObject *get_trace_ring() const {
+        return trace_ring;
+    }
+
+    std::uint_fast64_t get_trace_count() const {
+        return trace_count;
+    }
+
+    void start_tracing() {
+        trace_count = 0;
+        tracing = true;
+        step_hooks = true;
+    }
+
+    // Flushes the traced lines. Sets errno and returns false
+    // if writing fails.
+    bool stop_tracing() {
+        bool flushed = flush_trace_lines();
+        tracing = false;
+        step_hooks = watching;
+
+        trace_pcs.clear();
+        trace_opcodes.clear();
+        trace_conditions.clear();
+        trace_fd = -1;
+
+        if(trace_ring) {
+            PyBuffer_Release(&trace_ring_view);
+            Py_CLEAR(trace_ring);
+            trace_ring_size = 0;
+        }
+
+        if(!flushed)
+            errno = trace_errno;
+        trace_errno = 0;
+        return flushed;
+    }
+
+    void reset_stop_conditions() {
+        if(!stop_pcs.empty())
+            std::fill(stop_pcs.begin(), stop_pcs.end(), 0);
+        steps_to_stop = 0;
+        step_over_calls = false;
+        counting_steps = false;
+        stop_on_finish = false;
+        has_stop_conditions = false;
+
+        std::fill(std::begin(stop_ports), std::end(stop_ports), 0);
+        has_stop_ports = false;
+    }
+
+    void set_pc_on_call(fast_u16 pc) {
+        ++call_depth;
+        base::set_pc_on_call(pc);
+    }
+
+    void set_pc_on_return(fast_u16 pc) {
+        --call_depth;
+        base::set_pc_on_return(pc);
+    }
+
+    // Per-instruction watching and tracing. Kept out of
+    // on_step() behind a single flag, so machines doing neither
+    // run at full speed.
+    void on_step_hooks() {
+        if(watching && self().is_marked_addr(state.pc, exec_mark))
+            on_watched_access(state.pc, state.memory[state.pc], exec_mark);
+
+        if(tracing)
+            trace_instr();
+    }
+
+    void on_step() {
+        if(step_hooks)
+            on_step_hooks();
+
+        if(!has_stop_conditions) {
+            base::on_step();
+            check_stop_request();
+            return;
+        }
+
+        bool counted = !step_over_calls || call_depth <= 0;
+        base::on_step();
+        check_stop_request();
+
+        if(!stop_pcs.empty() && stop_pcs[state.pc])
+            self().on_raise_events(machine_events::pc_reached);
+
+        if(counting_steps) {
+            if(counted && steps_to_stop)
+                --steps_to_stop;
+            if(!steps_to_stop && (!step_over_calls || call_depth <= 0))
+                self().on_raise_events(machine_events::steps_done);
+        }
+
+        if(stop_on_finish && call_depth < 0)
+            self().on_raise_events(machine_events::routine_finished);
+    }
+
+    // Runs the machine with the GIL released, so machines in
+    // other threads can run at the same time. The GIL is only
+    // re-acquired for calling Python callbacks. Callbacks set
+    // while running take effect on next run. Has to be called
+    // with the GIL held.
+    z80::events_mask::type run() {
+        begin_run();
+        thread_state = PyEval_SaveThread();
+        z80::events_mask::type events = self().on_run();
+        PyEval_RestoreThread(thread_state);
+        end_run();
+        return events;
+    }
+
+    // The parts of run() that need the GIL, for running
+    // several machines at once. The machine has to not be
+    // running.
+    void begin_run() {
+        assert(!running);
+        running = true;
+        call_depth = 0;
+        has_watch_hit = false;
+
+        // Make sure the callbacks live till the end of the run.
+        Py_XINCREF(input_callback);
+        Py_XINCREF(output_callback);
+        Py_XINCREF(watch_callback);
+    }
+
+    // Raises the exception a callback failed with, if any.
+    void end_run() {
+        Py_XDECREF(input_callback);
+        Py_XDECREF(output_callback);
+        Py_XDECREF(watch_callback);
+        input_callback = on_input_callback;
+        output_callback = on_output_callback;
+        watch_callback = on_watch_callback;
+
+        reset_stop_conditions();
+        stop_request.store(false, std::memory_order_relaxed);
+        thread_state = nullptr;
+        running = false;
+
+        if(!flush_trace_lines() && !error_type) {
+            errno = trace_errno;
+            PyErr_SetFromErrno(PyExc_OSError);
+            return;
+        }
+
+        if(error_type) {
+            PyErr_Restore(error_type, error_value, error_traceback);
+            error_type = error_value = error_traceback = nullptr;
+        }
+    }
+
+    // Runs until an event other than the end of frame, such as
+    // hitting the ticks limit. Can be called on any thread
+    // between begin_run() and end_run() with the GIL released.
+    // Callbacks are called in the specified thread state of the
+    // calling thread.
+    z80::events_mask::type run_to_event(PyThreadState *state) {
+        thread_state = state;
+        z80::events_mask::type events = 0;
+        do {
+            events |= self().on_run();
+        } while(!(events & ~z80::events_mask::end_of_frame));
+        return events;
+    }
+
+    void set_ticks_to_stop(least_u32 ticks) {
+        state.ticks_to_stop = ticks;
+    }
+
     fast_u8 on_get_b() const { return state.b; }
     void on_set_b(fast_u8 n) { state.b = n; }
 
@@ -190,6 +714,7 @@ public:
 
     void on_tick(unsigned t) {
         base::on_tick(t);
+        output_ticks += t;
 
         // Handle stopping by hitting a specified number of ticks.
         if(state.ticks_to_stop) {
@@ -202,52 +727,308 @@ public:
         }
     }
 
-#if 0  // TODO
-    void on_step() {
-        fprintf(stderr, "PC=%04x SP=%04x BC=%04x DE=%04x HL=%04x AF=%04x %02x%02x%02x%02x\n",
-                static_cast<unsigned>(state.pc),
-                static_cast<unsigned>(state.sp),
-                static_cast<unsigned>(make16(state.b, state.c)),
-                static_cast<unsigned>(make16(state.d, state.e)),
-                static_cast<unsigned>(make16(state.h, state.l)),
-                static_cast<unsigned>(make16(state.a, state.f)),
-                static_cast<unsigned>(state.memory[(state.pc + 0) & 0xffff]),
-                static_cast<unsigned>(state.memory[(state.pc + 1) & 0xffff]),
-                static_cast<unsigned>(state.memory[(state.pc + 2) & 0xffff]),
-                static_cast<unsigned>(state.memory[(state.pc + 3) & 0xffff]));
-        base::on_step();
-    }
-#endif
-
 protected:
     using base::self;
     machine_state state;
 
 private:
+    // Re-attaches the thread running the machine to the
+    // interpreter while Python code is called during a run. The
+    // GILState API is not used, as it does not support
+    // sub-interpreters.
+    class callback_scope {
+    public:
+        callback_scope(machine &m)
+            : m(m) {
+            if(m.running) {
+                PyEval_RestoreThread(m.thread_state);
+                m.in_callback = true;
+            }
+        }
+
+        ~callback_scope() {
+            if(m.running) {
+                m.in_callback = false;
+                PyEval_SaveThread();
+            }
+        }
+
+    private:
+        machine &m;
+    };
+
+    // The raised exception is reported by end_run(). Only the
+    // first one is kept.
+    void on_callback_failed() {
+        if(running && !error_type)
+            PyErr_Fetch(&error_type, &error_value, &error_traceback);
+        else if(running)
+            PyErr_Clear();
+        self().on_raise_events(machine_events::callback_failed);
+    }
+
+    // Returns the value to read or write.
+    fast_u8 on_watched_access(fast_u16 addr, fast_u8 value, fast_u8 kind) {
+        if(!watch_callback) {
+            if(!has_watch_hit) {
+                watch_hit = {addr, value, kind};
+                has_watch_hit = true;
+            }
+            self().on_raise_events(machine_events::addr_accessed);
+            return value;
+        }
+
+        callback_scope scope(*this);
+        PyObject *args = Py_BuildValue("(i, i, i)", addr, value, kind);
+        decref_guard args_guard(args);
+
+        PyObject *result = args ? PyObject_CallObject(watch_callback, args) :
+                                  nullptr;
+        decref_guard result_guard(result);
+
+        if(!result) {
+            on_callback_failed();
+            return value;
+        }
+
+        if(result == Py_None || kind == exec_mark)
+            return value;
+
+        if(!PyLong_Check(result)) {
+            PyErr_SetString(PyExc_TypeError,
+                            "returning value must be integer or None");
+            on_callback_failed();
+            return value;
+        }
+
+        return z80::mask8(PyLong_AsUnsignedLong(result));
+    }
+
+    void trace_instr() {
+        fast_u16 pc = state.pc;
+        if(!trace_pcs.empty() && !trace_pcs[pc])
+            return;
+
+        least_u8 instr[max_instr_size];
+        for(unsigned i = 0; i != max_instr_size; ++i)
+            instr[i] = state.memory[z80::mask16(pc + i)];
+
+        if(!trace_opcodes.empty()) {
+            fast_u16 opcode = instr[0];
+            if(self().is_opcode_prefix(instr[0]))
+                opcode = make16(instr[0], instr[1]);
+            if(!trace_opcodes[opcode])
+                return;
+        }
+
+        for(const trace_condition &cond : trace_conditions) {
+            if((get_state_field_value(&state, *cond.field) & cond.mask) !=
+                   cond.value)
+                return;
+        }
+
+        fast_u16 af = make16(state.a, state.f);
+        fast_u16 bc = make16(state.b, state.c);
+        fast_u16 de = make16(state.d, state.e);
+        fast_u16 hl = make16(state.h, state.l);
+
+        if(trace_fd >= 0 &&
+               sizeof(trace_lines) - trace_lines_size < max_trace_line_size)
+            flush_trace_lines();
+
+        // After a write error, lines are dropped, but ring
+        // records are still written and counted.
+        if(trace_fd >= 0 && !trace_errno) {
+            int n = std::snprintf(
+                trace_lines + trace_lines_size, max_trace_line_size,
+                "PC=%04x SP=%04x BC=%04x DE=%04x HL=%04x AF=%04x "
+                "%02x%02x%02x%02x\n",
+                static_cast<unsigned>(pc), static_cast<unsigned>(state.sp),
+                static_cast<unsigned>(bc), static_cast<unsigned>(de),
+                static_cast<unsigned>(hl), static_cast<unsigned>(af),
+                static_cast<unsigned>(instr[0]),
+                static_cast<unsigned>(instr[1]),
+                static_cast<unsigned>(instr[2]),
+                static_cast<unsigned>(instr[3]));
+            trace_lines_size += static_cast<std::size_t>(n);
+        }
+
+        if(trace_ring_size != 0) {
+            // Little-endian (pc, sp, af, bc, de, hl) words
+            // followed by the instruction bytes and the frame
+            // tick.
+            auto *p = static_cast<least_u8*>(trace_ring_view.buf) +
+                      (trace_count % trace_ring_size) * trace_record_size;
+            for(fast_u16 n : {pc, static_cast<fast_u16>(state.sp),
+                              af, bc, de, hl}) {
+                *p++ = get_low8(n);
+                *p++ = get_high8(n);
+            }
+            for(least_u8 b : instr)
+                *p++ = b;
+            fast_u32 tick = self().get_frame_tick();
+            for(unsigned i = 0; i != 4; ++i)
+                *p++ = z80::mask8(tick >> (i * 8));
+        }
+
+        ++trace_count;
+    }
+
+    bool flush_trace_lines() {
+        if(trace_lines_size == 0 || trace_errno)
+            return !trace_errno;
+
+        if(!write_to_fd(trace_fd, trace_lines, trace_lines_size))
+            trace_errno = errno;
+        trace_lines_size = 0;
+        return !trace_errno;
+    }
+
+    void check_stop_request() {
+        if(stop_request.load(std::memory_order_relaxed))
+            self().on_raise_events(machine_events::stop_requested);
+    }
+
+    void check_stop_port(fast_u16 port) {
+        if(has_stop_ports && stop_ports[get_low8(port)])
+            self().on_raise_events(machine_events::port_accessed);
+    }
+
+    bool get_native_input(fast_u16 port, fast_u8 &value) {
+        if(!queued_inputs.empty()) {
+            auto i = queued_inputs.find(port);
+            if(i != queued_inputs.end()) {
+                value = i->second.front();
+                i->second.pop_front();
+                if(i->second.empty())
+                    queued_inputs.erase(i);
+                return true;
+            }
+        }
+
+        if(!port_inputs.empty() && (port_inputs[port] & defined_input)) {
+            value = z80::mask8(port_inputs[port]);
+            return true;
+        }
+
+        return false;
+    }
+
+    // Values set for ports, allocated on first use.
+    static const fast_u16 defined_input = 0x100;
+    std::vector<least_u16> port_inputs;
+
+    std::map<fast_u16, std::deque<least_u8>> queued_inputs;
+
+    bool queue_outputs = false;
+    std::uint_fast64_t output_ticks = 0;
+    std::vector<output_record> queued_outputs;
+
     PyObject *on_input_callback = nullptr;
     PyObject *on_output_callback = nullptr;
+
+    // The callbacks in effect for the current run.
+    PyObject *input_callback = nullptr;
+    PyObject *output_callback = nullptr;
+
+    bool running = false;
+    bool in_callback = false;
+
+    // The thread state of the thread running the machine.
+    PyThreadState *thread_state = nullptr;
+
+    PyObject *error_type = nullptr;
+    PyObject *error_value = nullptr;
+    PyObject *error_traceback = nullptr;
+
+    // Allocated on first use.
+    std::vector<least_u8> stop_pcs;
+
+    unsigned long steps_to_stop = 0;
+    bool step_over_calls = false;
+    bool counting_steps = false;
+    bool stop_on_finish = false;
+    bool has_stop_conditions = false;
+
+    least_u8 stop_ports[0x100] = {};
+    bool has_stop_ports = false;
+
+    std::atomic<bool> stop_request{false};
+
+    bool watching = false;
+    PyObject *on_watch_callback = nullptr;
+    PyObject *watch_callback = nullptr;
+    bool has_watch_hit = false;
+    watched_access watch_hit = {};
+
+    struct trace_condition {
+        const state_field *field;
+        unsigned long mask;
+        unsigned long value;
+    };
+
+    bool tracing = false;
+    bool step_hooks = false;
+    std::uint_fast64_t trace_count = 0;
+
+    // Allocated when filtering is requested.
+    std::vector<least_u8> trace_pcs;
+    std::vector<least_u8> trace_opcodes;
+    std::vector<trace_condition> trace_conditions;
+
+    int trace_fd = -1;
+    int trace_errno = 0;
+    static const std::size_t max_trace_line_size = 64;
+    char trace_lines[4096];
+    std::size_t trace_lines_size = 0;
+
+    PyObject *trace_ring = nullptr;
+    Py_buffer trace_ring_view;
+    std::size_t trace_ring_size = 0;
+
+    // Calls minus returns since the start of the run.
+    long call_depth = 0;
 };
 
-static const unsigned max_instr_size = 4;
+// Zero stands for the number of hardware threads. There is no
+// point in having more threads than tasks.
+static unsigned get_num_of_threads(unsigned requested,
+                                   std::size_t num_of_tasks) {
+    unsigned n = requested;
+    if(n == 0)
+        n = std::thread::hardware_concurrency();
+    if(n > num_of_tasks)
+        n = static_cast<unsigned>(num_of_tasks);
+    return std::max(n, 1u);
+}
+
+// Calls work(thread_index) on every of the specified number of
+// threads, including the current one, with the GIL released.
+template<typename F>
+static void run_on_threads(unsigned num_of_threads, const F &work) {
+    Py_BEGIN_ALLOW_THREADS
+    std::vector<std::thread> threads;
+    for(unsigned i = 1; i < num_of_threads; ++i)
+        threads.emplace_back(work, i);
+    work(0);
+    for(std::thread &t : threads)
+        t.join();
+    Py_END_ALLOW_THREADS
+}
 
 static constexpr inline unsigned get_char_code(char c) {
     return static_cast<unsigned char>(c);
 }
 
+// Keeps format specifiers in the output for the Python side to
+// tell apart instructions that look the same, e.g., 'Aadd a, b'
+// and 'add a, b'.
 template<typename B>
-class disasm_base : public B {
+class marking_specifiers : public B {
 public:
     typedef B base;
 
-    disasm_base() {}
-
-    const char *get_output() const {
-        return output_buff;
-    }
-
-    void on_emit(const char *out) {
-        std::snprintf(output_buff, max_output_buff_size, "%s", out);
-    }
+    marking_specifiers() {}
 
     void on_format_char(char c, const void **&args,
                         typename base::output_buff &out) {
@@ -256,18 +1037,41 @@ public:
             out.append(c);
         base::on_format_char(c, args, out);
     }
+};
+
+template<typename B>
+class disasm_base
+    : public z80::sink_disasm<marking_specifiers<B>, z80::buff_sink> {
+public:
+    typedef z80::sink_disasm<marking_specifiers<B>, z80::buff_sink> base;
+
+    disasm_base() {
+        base::set_sink(&sink);
+    }
+
+    const char *get_output() const {
+        return sink.get_buff();
+    }
 
     fast_u8 on_read_next_byte() {
-        assert(index < instr_size);
+        assert(index < max_instr_size);
         return instr_code[index++];
     }
 
+    bool on_peek_next_byte(fast_u8 &n) {
+        if(index >= instr_size)
+            return false;
+        n = instr_code[index];
+        return true;
+    }
+
     void set_instr_code(const least_u8 *code, unsigned size) {
         assert(size <= max_instr_size);
         std::memset(instr_code, 0, max_instr_size);
         std::memcpy(instr_code, code, size);
+        instr_size = size;
         index = 0;
-        output_buff[0] = '\0';
+        sink.clear();
     }
 
     unsigned get_num_of_consumed_bytes() const {
@@ -276,12 +1080,423 @@ public:
 
 private:
     unsigned index = 0;
+    unsigned instr_size = 0;
     least_u8 instr_code[max_instr_size];
 
-    static const std::size_t max_output_buff_size = 32;
+    static const std::size_t max_output_buff_size = 64;
     char output_buff[max_output_buff_size];
+    z80::buff_sink sink{output_buff, max_output_buff_size};
+};
+
+// Measures instructions without formatting them.
+template<typename B>
+class instr_sizer_base : public B {
+public:
+    typedef B base;
+
+    instr_sizer_base() {}
+
+    void on_format_impl(const char *fmt, const void *args[]) {
+        unused(fmt, args);
+    }
+
+    fast_u8 on_read_next_byte() {
+        // Bytes past the end of the code read as zeros, same as
+        // with _decode().
+        std::size_t i = index++;
+        return i < code_size ? code[i] : 0;
+    }
+
+    bool on_peek_next_byte(fast_u8 &n) {
+        if(index >= code_size)
+            return false;
+        n = code[index];
+        return true;
+    }
+
+    std::size_t get_instr_size(const least_u8 *code, std::size_t size) {
+        this->code = code;
+        code_size = size;
+        index = 0;
+        if(size != 0)
+            this->on_disassemble();
+        return index;
+    }
+
+private:
+    const least_u8 *code = nullptr;
+    std::size_t code_size = 0;
+    std::size_t index = 0;
+};
+
+static const char *get_operand_kind_name(z80::operand_kind kind) {
+    switch(kind) {
+    case z80::operand_kind::none: return "none";
+    case z80::operand_kind::literal: return "literal";
+    case z80::operand_kind::reg: return "reg";
+    case z80::operand_kind::regp: return "regp";
+    case z80::operand_kind::regp2: return "regp2";
+    case z80::operand_kind::condition: return "condition";
+    case z80::operand_kind::imm8: return "imm8";
+    case z80::operand_kind::imm16: return "imm16";
+    case z80::operand_kind::rel: return "rel";
+    case z80::operand_kind::number: return "number";
+    }
+    z80::unreachable("Unknown operand kind.");
+}
+
+static PyObject *build_decoded_instr(const z80::decoded_instr &instr) {
+    decref_guard ops(PyTuple_New(instr.num_of_operands));
+    if(!ops)
+        return nullptr;
+
+    for(unsigned i = 0; i != instr.num_of_operands; ++i) {
+        const z80::instr_operand &op = instr.operands[i];
+        const char *kind = get_operand_kind_name(op.kind);
+        unsigned irp = static_cast<unsigned>(op.irp);
+        PyObject *t;
+        if(op.kind == z80::operand_kind::literal) {
+            t = Py_BuildValue("(ssIiO)", kind, op.text, irp, op.disp,
+                              op.indirect ? Py_True : Py_False);
+        } else {
+            t = Py_BuildValue("(sIIiO)", kind, op.value, irp, op.disp,
+                              op.indirect ? Py_True : Py_False);
+        }
+        if(!t)
+            return nullptr;
+        PyTuple_SET_ITEM(ops.get(), i, t);
+    }
+
+    return Py_BuildValue("(IIsO)", static_cast<unsigned>(instr.addr),
+                         instr.size, instr.mnemonic, ops.get());
+}
+
+// Scans sources of disassembly tags the same way the parser in
+// z80/_disasm_parser.py used to do it token by token, and
+// produces records the parser then turns into tag objects.
+class tag_scanner {
+public:
+    // Comments starting at the specified column or further are
+    // inline comments.
+    tag_scanner(const Py_UCS4 *text, Py_ssize_t size,
+                Py_ssize_t comment_column)
+        : text(text), size(size), comment_column(comment_column)
+    {}
+
+    // Returns a list of records or null on failure. Errors in
+    // the source are reported with a trailing ('error', offset,
+    // literal, message) record.
+    PyObject *scan() {
+        records = PyList_New(0);
+        if(!records)
+            return nullptr;
+
+        decref_guard guard(records);
+        while(skip_past_tag_leader()) {
+            if(!scan_tag())
+                return nullptr;
+            if(has_error)
+                break;
+        }
+
+        return guard.release();
+    }
+
+private:
+    struct token {
+        Py_ssize_t start = 0;
+        Py_ssize_t end = 0;
+
+        // The literal, with escape sequences of strings
+        // translated.
+        std::vector<Py_UCS4> literal;
+
+        bool empty() const {
+            return start == end;
+        }
+    };
+
+    static bool is_ident_char(Py_UCS4 c) {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+               (c >= 'A' && c <= 'Z') || c == '_';
+    }
+
+    static bool equals(const token &tok, const char *s) {
+        std::size_t n = std::strlen(s);
+        if(tok.literal.size() != n)
+            return false;
+        for(std::size_t i = 0; i != n; ++i) {
+            if(tok.literal[i] != get_char_code(s[i]))
+                return false;
+        }
+        return true;
+    }
+
+    bool skip_past_tag_leader() {
+        for(; pos + 1 < size; ++pos) {
+            if(text[pos] == '@' && text[pos + 1] == '@') {
+                pos += 2;
+                return true;
+            }
+        }
+        pos = size;
+        return false;
+    }
+
+    // Returns the end of the string starting at the specified
+    // position or zero if it is unterminated.
+    Py_ssize_t get_string_end(Py_ssize_t i) const {
+        for(++i; i < size; ++i) {
+            Py_UCS4 c = text[i];
+            if(c == '\'')
+                return i + 1;
+            if(c == '\n')
+                break;
+            if(c == '\\') {
+                if(i + 1 < size &&
+                       (text[i + 1] == '\'' || text[i + 1] == '\\')) {
+                    ++i;
+                    continue;
+                }
+                break;
+            }
+        }
+        return 0;
+    }
+
+    static void replace_all(std::vector<Py_UCS4> &s, Py_UCS4 a, Py_UCS4 b,
+                            Py_UCS4 replacement) {
+        std::size_t j = 0;
+        for(std::size_t i = 0; i != s.size(); ++i) {
+            if(i + 1 != s.size() && s[i] == a && s[i + 1] == b) {
+                s[j++] = replacement;
+                ++i;
+            } else {
+                s[j++] = s[i];
+            }
+        }
+        s.resize(j);
+    }
+
+    // Returns false if the token is an unterminated string.
+    bool fetch_token(token &tok) {
+        while(pos < size && (text[pos] == ' ' || text[pos] == '\t'))
+            ++pos;
+
+        tok.start = pos;
+        Py_ssize_t end = pos;
+        bool is_string = false;
+        bool is_unterminated = false;
+        if(pos < size) {
+            Py_UCS4 c = text[pos];
+            if(is_ident_char(c)) {
+                while(end < size && is_ident_char(text[end]))
+                    ++end;
+            } else if(c == '\'') {
+                end = get_string_end(pos);
+                is_string = end != 0;
+                is_unterminated = !is_string;
+                if(is_unterminated)
+                    end = pos + 1;
+            } else if(c == '-' && pos + 1 < size && text[pos + 1] == '-') {
+                end = pos + 2;
+            } else if(c != '\n') {
+                end = pos + 1;
+            }
+        }
+
+        tok.end = end;
+        pos = end;
+
+        if(is_string) {
+            tok.literal.assign(text + tok.start + 1, text + tok.end - 1);
+            replace_all(tok.literal, '\\', '\\', '\\');
+            replace_all(tok.literal, '\\', '\'', '\'');
+        } else {
+            tok.literal.assign(text + tok.start, text + tok.end);
+        }
+
+        return !is_unterminated;
+    }
+
+    PyObject *make_str(const Py_UCS4 *p, std::size_t n) const {
+        return PyUnicode_FromKindAndData(PyUnicode_4BYTE_KIND, p,
+                                         static_cast<Py_ssize_t>(n));
+    }
+
+    PyObject *make_literal(const token &tok) const {
+        return make_str(tok.literal.data(), tok.literal.size());
+    }
+
+    // Evaluates the literal the same way int() does. Returns
+    // None for literals that are not numbers.
+    PyObject *evaluate_number(const token &tok, int base) const {
+        decref_guard literal(make_literal(tok));
+        if(!literal)
+            return nullptr;
+
+        PyObject *n = PyLong_FromUnicodeObject(literal.get(), base);
+        if(!n && PyErr_ExceptionMatches(PyExc_ValueError)) {
+            PyErr_Clear();
+            Py_RETURN_NONE;
+        }
+        return n;
+    }
+
+    bool add_record(PyObject *record) {
+        if(!record)
+            return false;
+        decref_guard guard(record);
+        return PyList_Append(records, record) == 0;
+    }
+
+    bool add_error(const token &tok, const char *message) {
+        decref_guard literal(make_literal(tok));
+        if(!literal)
+            return false;
+        has_error = true;
+        return add_record(Py_BuildValue("(snOs)", "error", tok.start,
+                                        literal.get(), message));
+    }
+
+    Py_ssize_t get_column(Py_ssize_t offset) const {
+        Py_ssize_t line_start = offset;
+        while(line_start > 0 && text[line_start - 1] != '\n')
+            --line_start;
+        return offset - line_start;
+    }
+
+    // The comment is the rest of the line starting with the
+    // specified token.
+    PyObject *make_comment(const token &tok) {
+        while(pos < size && text[pos] != '\n')
+            ++pos;
+        return make_str(text + tok.start,
+                        static_cast<std::size_t>(pos - tok.start));
+    }
+
+    bool scan_tag() {
+        token tok;
+        if(!fetch_token(tok))
+            return add_error(tok, "Unterminated string.");
+
+        // Parse optional tag address.
+        decref_guard addr(evaluate_number(tok, 0));
+        if(!addr)
+            return false;
+        if(addr.get() != Py_None && !fetch_token(tok))
+            return add_error(tok, "Unterminated string.");
+
+        // Collect bytes, if any specified.
+        long byte_offset = 0;
+        while(!tok.empty()) {
+            decref_guard value(evaluate_number(tok, 16));
+            if(!value)
+                return false;
+            if(value.get() == Py_None)
+                break;
+
+            if(addr.get() == Py_None)
+                return add_error(tok, "Bytes need a tag address.");
+
+            decref_guard offset(PyLong_FromLong(byte_offset));
+            if(!offset)
+                return false;
+            decref_guard byte_addr(PyNumber_Add(addr.get(), offset.get()));
+            if(!byte_addr || !add_record(Py_BuildValue(
+                    "(snOO)", "byte", tok.start, byte_addr.get(),
+                    value.get())))
+                return false;
+            ++byte_offset;
+
+            if(!fetch_token(tok))
+                return add_error(tok, "Unterminated string.");
+        }
+
+        // Parse regular tag.
+        token name;
+        token filename;
+        bool has_subject = false;
+        if(equals(tok, ".")) {
+            if(!fetch_token(name))
+                return add_error(name, "Unterminated string.");
+            if(name.empty())
+                return add_error(name, "A tag name expected.");
+
+            if(equals(name, "include_binary")) {
+                if(!fetch_token(filename))
+                    return add_error(filename, "Unterminated string.");
+                if(filename.empty())
+                    return add_error(filename, "A filename expected.");
+            } else if(!equals(name, "instr")) {
+                return add_error(name, "Unknown tag.");
+            }
+            has_subject = true;
+
+            if(!fetch_token(tok))
+                return add_error(tok, "Unterminated string.");
+            if(!tok.empty() && !equals(tok, "--"))
+                return add_error(tok, "End of line or a comment expected.");
+        }
+
+        // Parse comment, if specified.
+        if(equals(tok, "--") && !fetch_token(tok))
+            return add_error(tok, "Unterminated string.");
+
+        decref_guard comment(tok.empty() ? nullptr : make_comment(tok));
+        if(!tok.empty() && !comment)
+            return false;
+
+        if(!has_subject) {
+            if(!comment)
+                return true;
+
+            const char *kind = get_column(tok.start) < comment_column ?
+                "comment" : "inline_comment";
+            return add_record(Py_BuildValue("(snOO)", kind, tok.start,
+                                            addr.get(), comment.get()));
+        }
+
+        PyObject *comment_obj = comment ? comment.get() : Py_None;
+        if(equals(name, "instr")) {
+            return add_record(Py_BuildValue(
+                "(snOnO)", "instr", name.start, addr.get(), tok.start,
+                comment_obj));
+        }
+
+        decref_guard filename_literal(make_literal(filename));
+        if(!filename_literal)
+            return false;
+        return add_record(Py_BuildValue(
+            "(snOnOnO)", "include_binary", name.start, addr.get(),
+            filename.start, filename_literal.get(), tok.start,
+            comment_obj));
+    }
+
+    const Py_UCS4 *text;
+    Py_ssize_t size;
+    Py_ssize_t comment_column;
+    Py_ssize_t pos = 0;
+    PyObject *records = nullptr;
+    bool has_error = false;
 };
 
+static PyObject *parse_tags(PyObject *self, PyObject *args) {
+    PyObject *source;
+    Py_ssize_t comment_column;
+    if(!PyArg_ParseTuple(args, "Un:_parse_tags", &source, &comment_column))
+        return nullptr;
+
+    Py_UCS4 *text = PyUnicode_AsUCS4Copy(source);
+    if(!text)
+        return nullptr;
+
+    tag_scanner scanner(text, PyUnicode_GET_LENGTH(source), comment_column);
+    PyObject *records = scanner.scan();
+    PyMem_Free(text);
+    return records;
+}
+
 namespace i8080_machine {
 #define I8080_MACHINE
 #include "machine.inc"
@@ -294,37 +1509,283 @@ namespace z80_machine {
 #undef Z80_MACHINE
 }
 
+// Per-module state, so the module can be loaded in several
+// interpreters of the same process.
+struct module_state {
+    PyObject *i8080_machine_type;
+    PyObject *z80_machine_type;
+};
+
+static module_state &get_module_state(PyObject *module) {
+    return *static_cast<module_state*>(PyModule_GetState(module));
+}
+
+// A machine of either of the types.
+struct machine_ref {
+    i8080_machine::machine_object *i8080 = nullptr;
+    z80_machine::machine_object *z80 = nullptr;
+    z80::events_mask::type events = 0;
+};
+
+static bool parse_machine_ref(const module_state &state, PyObject *object,
+                              machine_ref &ref) {
+    auto *i8080_type = reinterpret_cast<PyTypeObject*>(
+        state.i8080_machine_type);
+    if(PyObject_TypeCheck(object, i8080_type)) {
+        ref.i8080 = &i8080_machine::cast_machine(object);
+        return true;
+    }
+
+    auto *z80_type = reinterpret_cast<PyTypeObject*>(state.z80_machine_type);
+    if(PyObject_TypeCheck(object, z80_type)) {
+        ref.z80 = &z80_machine::cast_machine(object);
+        return true;
+    }
+
+    PyErr_SetString(PyExc_TypeError, "machines expected");
+    return false;
+}
+
+// Starts the run unless the machine is already running. The
+// check and the start are done under the lock of the machine,
+// so concurrent attempts to run it cannot both succeed.
+static bool begin_run(PyObject *object, machine_ref &ref, least_u32 ticks) {
+    object_lock lock(object);
+    if(ref.i8080) {
+        if(ref.i8080->is_running())
+            return false;
+        ref.i8080->set_ticks_to_stop(ticks);
+        ref.i8080->begin_run();
+    } else {
+        if(ref.z80->is_running())
+            return false;
+        ref.z80->set_ticks_to_stop(ticks);
+        ref.z80->begin_run();
+    }
+    return true;
+}
+
+static void run_to_event(machine_ref &ref, PyThreadState *state) {
+    ref.events = ref.i8080 ? ref.i8080->run_to_event(state) :
+                             ref.z80->run_to_event(state);
+}
+
+// The thread state worker threads call Python callbacks in.
+// The thread that started the work uses its own state.
+class worker_thread_state {
+public:
+    worker_thread_state(PyInterpreterState *interp, PyThreadState *starter,
+                        bool is_starter)
+        : state(is_starter ? starter : PyThreadState_New(interp)),
+          owned(!is_starter)
+    {}
+
+    ~worker_thread_state() {
+        if(owned && state) {
+            PyEval_RestoreThread(state);
+            PyThreadState_Clear(state);
+            PyThreadState_DeleteCurrent();
+        }
+    }
+
+    worker_thread_state(const worker_thread_state &) = delete;
+    worker_thread_state &operator = (const worker_thread_state &) = delete;
+
+    PyThreadState *get() const {
+        return state;
+    }
+
+private:
+    PyThreadState *state;
+    bool owned;
+};
+
+static void end_run(machine_ref &ref) {
+    if(ref.i8080)
+        ref.i8080->end_run();
+    else
+        ref.z80->end_run();
+}
+
+static PyObject *run_machines(PyObject *self, PyObject *args) {
+    PyObject *machines_seq, *ticks_obj;
+    unsigned num_of_threads = 0;
+    if(!PyArg_ParseTuple(args, "OO|I:run_machines", &machines_seq, &ticks_obj,
+                         &num_of_threads))
+        return nullptr;
+
+    unsigned long ticks = PyLong_AsUnsignedLong(ticks_obj);
+    if(PyErr_Occurred())
+        return nullptr;
+    if(ticks == 0 || ticks > 0xffffffff) {
+        PyErr_SetString(PyExc_ValueError, "ticks out of range");
+        return nullptr;
+    }
+
+    // The tuple keeps the machines alive while they run with
+    // the GIL released, even if callbacks or other threads drop
+    // them from the original sequence.
+    decref_guard machines_tuple(PySequence_Tuple(machines_seq));
+    if(!machines_tuple)
+        return nullptr;
+
+    Py_ssize_t num_of_machines = PyTuple_GET_SIZE(machines_tuple.get());
+    std::vector<machine_ref> machines(
+        static_cast<std::size_t>(num_of_machines));
+    const module_state &state = get_module_state(self);
+    for(Py_ssize_t i = 0; i != num_of_machines; ++i) {
+        if(!parse_machine_ref(
+                state, PyTuple_GET_ITEM(machines_tuple.get(), i),
+                machines[static_cast<std::size_t>(i)]))
+            return nullptr;
+    }
+
+    // Start all the runs at once, so machines listed more than
+    // once can be caught.
+    for(std::size_t i = 0; i != machines.size(); ++i) {
+        PyObject *object = PyTuple_GET_ITEM(
+            machines_tuple.get(), static_cast<Py_ssize_t>(i));
+        if(!begin_run(object, machines[i], static_cast<least_u32>(ticks))) {
+            for(std::size_t j = 0; j != i; ++j)
+                end_run(machines[j]);
+            PyErr_SetString(PyExc_RuntimeError,
+                            "a machine is already running");
+            return nullptr;
+        }
+    }
+
+    // Every thread takes the next machine that has not been run
+    // yet until there are none left. Threads that fail to get a
+    // thread state leave the machines to the others.
+    unsigned n = get_num_of_threads(num_of_threads, machines.size());
+    PyThreadState *starter = PyThreadState_Get();
+    PyInterpreterState *interp = PyThreadState_GetInterpreter(starter);
+    std::atomic<std::size_t> next_machine(0);
+    run_on_threads(n, [&](unsigned thread_index) {
+        worker_thread_state state(interp, starter, thread_index == 0);
+        if(!state.get())
+            return;
+        for(;;) {
+            std::size_t i = next_machine.fetch_add(1);
+            if(i >= machines.size())
+                break;
+            run_to_event(machines[i], state.get());
+        }
+    });
+
+    // Report the first exception raised by callbacks.
+    PyObject *error_type = nullptr;
+    PyObject *error_value = nullptr;
+    PyObject *error_traceback = nullptr;
+    for(machine_ref &ref : machines) {
+        end_run(ref);
+        if(PyErr_Occurred()) {
+            if(error_type)
+                PyErr_Clear();
+            else
+                PyErr_Fetch(&error_type, &error_value, &error_traceback);
+        }
+    }
+
+    if(error_type) {
+        PyErr_Restore(error_type, error_value, error_traceback);
+        return nullptr;
+    }
+
+    decref_guard list(PyList_New(num_of_machines));
+    if(!list)
+        return nullptr;
+
+    for(std::size_t i = 0; i != machines.size(); ++i) {
+        PyObject *events = PyLong_FromUnsignedLong(machines[i].events);
+        if(!events)
+            return nullptr;
+        PyList_SET_ITEM(list.get(), static_cast<Py_ssize_t>(i), events);
+    }
+
+    return list.release();
+}
+
+static PyMethodDef module_methods[] = {
+    {"_parse_tags", parse_tags, METH_VARARGS,
+     "Scans a source of disassembly tags. Comments starting at the "
+     "specified column or further are inline comments. Returns a list "
+     "of tuples describing the tags."},
+    {"run_machines", run_machines, METH_VARARGS,
+     "Run machines for the specified number of ticks or until events "
+     "other than the end of frame, optionally on multiple threads, with "
+     "zero meaning the number of hardware threads. Returns the list of "
+     "events that stopped each of the machines."},
+    { nullptr }  // Sentinel.
+};
+
+static int module_exec(PyObject *m) {
+    module_state &state = get_module_state(m);
+
+    state.i8080_machine_type = PyType_FromModuleAndSpec(
+        m, &i8080_machine::type_spec, /* bases= */ nullptr);
+    if(!state.i8080_machine_type ||
+           PyModule_AddType(m, reinterpret_cast<PyTypeObject*>(
+               state.i8080_machine_type)) < 0)
+        return -1;
+
+    state.z80_machine_type = PyType_FromModuleAndSpec(
+        m, &z80_machine::type_spec, /* bases= */ nullptr);
+    if(!state.z80_machine_type ||
+           PyModule_AddType(m, reinterpret_cast<PyTypeObject*>(
+               state.z80_machine_type)) < 0)
+        return -1;
+
+    return 0;
+}
+
+static int module_traverse(PyObject *m, visitproc visit, void *arg) {
+    module_state &state = get_module_state(m);
+    Py_VISIT(state.i8080_machine_type);
+    Py_VISIT(state.z80_machine_type);
+    return 0;
+}
+
+static int module_clear(PyObject *m) {
+    module_state &state = get_module_state(m);
+    Py_CLEAR(state.i8080_machine_type);
+    Py_CLEAR(state.z80_machine_type);
+    return 0;
+}
+
+static void module_free(void *m) {
+    module_clear(static_cast<PyObject*>(m));
+}
+
+// The module keeps no global state and machines lock
+// themselves, so it can be loaded in sub-interpreters with
+// their own GILs and in free-threaded builds.
+static PyModuleDef_Slot module_slots[] = {
+    {Py_mod_exec, reinterpret_cast<void*>(module_exec)},
+#if PY_VERSION_HEX >= 0x030C0000
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#if PY_VERSION_HEX >= 0x030D0000
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+    {0, nullptr}  // Sentinel.
+};
+
 static PyModuleDef module = {
     PyModuleDef_HEAD_INIT,      // m_base
     "z80._z80",                 // m_name
     "Z80 Machine Emulation Module",
                                 // m_doc
-    -1,                         // m_size
-    nullptr,                    // m_methods
-    nullptr,                    // m_slots
-    nullptr,                    // m_traverse
-    nullptr,                    // m_clear
-    nullptr,                    // m_free
+    sizeof(module_state),       // m_size
+    module_methods,             // m_methods
+    module_slots,               // m_slots
+    module_traverse,            // m_traverse
+    module_clear,               // m_clear
+    module_free,                // m_free
 };
 
 }  // anonymous namespace
 
 extern "C" PyMODINIT_FUNC PyInit__z80(void) {
-    PyObject *m = PyModule_Create(&module);
-    if(!m)
-        return nullptr;
-
-    if(PyType_Ready(&z80_machine::type_object) < 0)
-        return nullptr;
-    if(PyType_Ready(&i8080_machine::type_object) < 0)
-        return nullptr;
-    Py_INCREF(&z80_machine::type_object);
-    Py_INCREF(&i8080_machine::type_object);
-
-    // TODO: Check the returning value.
-    PyModule_AddObject(m, "_Z80Machine",
-                       &z80_machine::type_object.ob_base.ob_base);
-    PyModule_AddObject(m, "_I8080Machine",
-                       &i8080_machine::type_object.ob_base.ob_base);
-    return m;
+    return PyModuleDef_Init(&module);
 }